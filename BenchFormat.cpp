@@ -0,0 +1,576 @@
+#include "stdafx.h"
+
+#pragma warning ( disable : 4786 )
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <limits.h>
+#include <stdio.h>
+#include "oformatstream.hpp"
+#include "oformatdigits.hpp"
+#include "oformattrace.hpp"
+#include "oformatsink.hpp"
+#include "iformatstream.hpp"
+
+// Run with "oformatstream_demo bench" to time the bulk inserters.
+// Build with OFORMAT_STATISTICS defined to also see each format's counters,
+// or OFORMAT_TRACE to see the last events of the run.
+// Each format is timed inserting the values one by one, then as one span
+// with every digit conversion kernel this processor supports.
+// The span output is checked against the one by one output.
+// Parsing is timed validating a batch of formats on one thread, then on all,
+// and then compiling them to a format_catalog against loading its cache.
+// A record format is timed into a std::ostringstream and through the sinks.
+// Measuring records is timed against outputting them, and their total
+// lengths compared.  Records are timed output one by one and then with
+// format_batch, on one thread and on all, and kept as format_records
+// to be output later, and read back by iformatstream.
+// Lines ended with endl are timed to a file under each flush policy.
+
+namespace {
+
+const int BENCH_VALUES = 1 << 16;
+const int BENCH_REPEATS = 32;
+
+const char* const ISA_NAME[] = { "scalar", "sse2", "avx2" };
+
+typedef std::chrono::steady_clock bench_clock;
+
+double ns_per_value(bench_clock::time_point start, bench_clock::time_point stop)
+{
+	return std::chrono::duration<double, std::nano>(stop - start).count()
+		/ (double(BENCH_VALUES) * BENCH_REPEATS);
+}
+
+template <typename T>
+void BenchIntegers(const char* format, const std::vector<T>& values)
+{
+	std::ostringstream out;
+	oformatstream ofs(std::string(format), &out);
+	std::string expected;
+
+	bench_clock::time_point start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		out.str(std::string());
+		ofs.formatter().rewind();
+		for (typename std::vector<T>::const_iterator it = values.begin();
+			 it != values.end(); ++it)
+		{
+			ofs << *it;
+		}
+	}
+	bench_clock::time_point stop = bench_clock::now();
+	expected = out.str();
+	std::cout << "records\tone by one\t" << ns_per_value(start, stop) << " ns\n";
+
+	digits_isa previous = digits_current_isa();
+	for (int isa = digits_scalar; isa <= digits_best_isa(); ++isa)
+	{
+		digits_use_isa(digits_isa(isa));
+		start = bench_clock::now();
+		for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+		{
+			out.str(std::string());
+			ofs.formatter().rewind();
+			ofs << std::span<const T>(values);
+		}
+		stop = bench_clock::now();
+		std::cout << format << "\tspan " << ISA_NAME[isa] << "\t"
+				  << ns_per_value(start, stop) << " ns"
+				  << (out.str() == expected ? "" : "\tOUTPUT DIFFERS") << "\n";
+	}
+	digits_use_isa(previous);
+}
+
+// Time a single field inserted BENCH_VALUES times against snprintf
+// with the same format.  %p is only expected to match the Microsoft CRT,
+// other C libraries print pointers in their own form.
+template <typename T>
+void BenchField(const char* format, const std::vector<T>& values,
+				bool classic = false)
+{
+	std::ostringstream out;
+	oformatstream ofs(std::string(format), &out);
+	ofs.classic(classic);
+	char buf[64];
+	std::string expected;
+	bench_clock::time_point start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		expected.erase();
+		for (typename std::vector<T>::const_iterator it = values.begin();
+			 it != values.end(); ++it)
+		{
+			int n = snprintf(buf, sizeof(buf), format, *it);
+			expected.append(buf, n);
+		}
+	}
+	bench_clock::time_point stop = bench_clock::now();
+	std::cout << format << "\tsnprintf\t" << ns_per_value(start, stop) << " ns\n";
+
+	start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		out.str(std::string());
+		for (typename std::vector<T>::const_iterator it = values.begin();
+			 it != values.end(); ++it)
+		{
+			ofs << *it;
+		}
+	}
+	stop = bench_clock::now();
+	std::cout << format << (classic ? "\tclassic\t" : "\toformatstream\t")
+			  << ns_per_value(start, stop) << " ns"
+			  << (out.str() == expected ? "" : "\tOUTPUT DIFFERS") << "\n";
+	if (format_statistics::enabled)
+	{
+		format_statistics st = ofs.formatter().statistics();
+		std::cout << "\t" << st.records << " records " << st.bytes << " bytes"
+				  << "\tp50 " << st.latency.percentile(50)
+				  << " p99 " << st.latency.percentile(99)
+				  << " max " << st.latency.maximum() << " ns\n";
+	}
+}
+
+void BenchValidate(const std::vector<std::string>& formats, unsigned int threads)
+{
+	std::vector<format_parse_result> results;
+	bench_clock::time_point start = bench_clock::now();
+	size_t rejected = format_validate(formats, results, threads);
+	bench_clock::time_point stop = bench_clock::now();
+	std::cout << "validate\t" << (threads ? "1 thread" : "all threads") << "\t"
+			  << std::chrono::duration<double, std::nano>(stop - start).count()
+				/ formats.size() << " ns per format\t"
+			  << rejected << " rejected\n";
+}
+
+template <typename T>
+double BenchRecords(std::ostream& os, const std::vector<T>& values)
+{
+	oformatstream ofs(std::string("[record] request served, id=%d, from %s\n"), &os);
+	bench_clock::time_point start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		for (typename std::vector<T>::const_iterator it = values.begin();
+			 it != values.end(); ++it)
+		{
+			ofs << *it << "frontend";
+		}
+		os.flush();
+	}
+	return ns_per_value(start, bench_clock::now());
+}
+
+template <typename T>
+double BenchWideRecords(std::wostream& os, const std::vector<T>& values)
+{
+	woformatstream ofs(std::wstring(L"[record] request served, id=%d, from %s\n"), &os);
+	bench_clock::time_point start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		for (typename std::vector<T>::const_iterator it = values.begin();
+			 it != values.end(); ++it)
+		{
+			ofs << *it << L"frontend";
+		}
+		os.flush();
+	}
+	return ns_per_value(start, bench_clock::now());
+}
+
+// Wide output to a file, through codecvt and straight to UTF-8
+template <typename T>
+void BenchWideSinks(const std::vector<T>& values)
+{
+	const char* const path = "oformat_bench.out";
+	{
+		std::wofstream file(path);
+		std::cout << "wofstream\t" << BenchWideRecords(file, values) << " ns\n";
+	}
+	remove(path);
+
+	FILE* file = tmpfile();
+	if (file)
+	{
+		{
+			fd_sink fd(fileno(file));
+			utf8_sink<fd_sink> utf8(fd);
+			wsinkbuf<utf8_sink<fd_sink> > buf(utf8);
+			std::wostream os(&buf);
+			std::cout << "utf8_sink\t" << BenchWideRecords(os, values) << " ns\n";
+		}
+		fclose(file);
+	}
+}
+
+template <typename T>
+void BenchSinks(const std::vector<T>& values)
+{
+	std::ostringstream out;
+	std::cout << "ostringstream\t" << BenchRecords(out, values) << " ns\n";
+
+	string_sink strings;
+	sinkbuf<string_sink> stringbuf(strings);
+	std::ostream stringos(&stringbuf);
+	std::cout << "string_sink\t" << BenchRecords(stringos, values) << " ns"
+			  << (strings.str() == out.str() ? "" : "\tOUTPUT DIFFERS") << "\n";
+
+	const char* const path = "oformat_bench.out";
+	{
+		std::ofstream file(path);
+		std::cout << "ofstream\t" << BenchRecords(file, values) << " ns\n";
+	}
+	remove(path);
+
+	FILE* file = tmpfile();
+	if (file)
+	{
+		fd_sink fd(fileno(file));
+		sinkbuf<fd_sink> fdbuf(fd);
+		std::ostream fdos(&fdbuf);
+		std::cout << "fd_sink\t" << BenchRecords(fdos, values) << " ns\n";
+		fclose(file);
+	}
+
+	for (int lz4 = 0; lz4 < 2; ++lz4)
+	{
+		file = tmpfile();
+		if (!file)
+		{
+			continue;
+		}
+		{
+			async_fd_sink sink(fileno(file), 1 << 16, 2, async_sync_none,
+							   lz4 ? async_format_lz4 : async_format_raw);
+			sinkbuf<async_fd_sink> buf(sink);
+			std::ostream os(&buf);
+			std::cout << (lz4 ? "async_fd_sink lz4\t" : "async_fd_sink\t")
+					  << BenchRecords(os, values) << " ns\n";
+			async_sink_metrics m = sink.metrics();
+			std::cout << "\t" << m.buffers << " buffers " << m.bytes << " bytes "
+					  << m.stored << " stored\t"
+					  << m.waits << " waits " << m.wait_ns / 1000 << " us"
+					  << " max " << m.max_wait_ns / 1000 << " us\t"
+					  << "flush " << m.flush_ns / 1000 << " us\t"
+					  << "compress " << m.compress_ns / 1000 << " us\t"
+					  << "io " << m.io_ns / 1000 << " us\n";
+		}
+		fclose(file);
+	}
+}
+
+// Measure each record, then output it, the lengths being added up
+void BenchMeasure(const std::vector<int>& i, const std::vector<double>& d)
+{
+	const char* const format = "[record] id=%08x, took %9.3f ms, from %s\n";
+	formatter f((std::string(format)));
+	size_t measured = 0;
+	bench_clock::time_point start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		for (int n = 0; n < BENCH_VALUES; ++n)
+		{
+			measured += f.measure(i[n], d[n], "frontend");
+		}
+	}
+	bench_clock::time_point stop = bench_clock::now();
+	double measure_ns = ns_per_value(start, stop);
+
+	std::ostringstream out;
+	oformatstream ofs(std::string(format), &out);
+	ofs.classic(true);
+	size_t written = 0;
+	start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		out.str(std::string());
+		for (int n = 0; n < BENCH_VALUES; ++n)
+		{
+			ofs << i[n] << d[n] << "frontend" << setformat;
+		}
+		written += out.str().size();
+	}
+	stop = bench_clock::now();
+
+	format_record_size size = f.record_size();
+	std::cout << format << "\tminimum " << size.minimum << "\ttypical " << size.typical
+			  << (size.fixed ? "\tfixed" : "") << "\n"
+			  << "measure\t" << measure_ns << " ns\toutput\t"
+			  << ns_per_value(start, stop) << " ns per record"
+			  << (measured == written ? "" : "\tLENGTHS DIFFER") << "\n";
+}
+
+// Records output one by one, then by format_batch on threads threads
+void BenchBatch(const std::vector<int>& i, const std::vector<double>& d)
+{
+	const char* const format = "[record] id=%d, took %9.3f ms, from %s\n";
+	std::vector<std::tuple<int, double, const char*> > records;
+	for (int n = 0; n < BENCH_VALUES; ++n)
+	{
+		records.push_back(std::make_tuple(i[n], d[n], "frontend"));
+	}
+
+	std::ostringstream out;
+	oformatstream ofs(std::string(format), &out);
+	bench_clock::time_point start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		out.str(std::string());
+		for (int n = 0; n < BENCH_VALUES; ++n)
+		{
+			ofs << i[n] << d[n] << "frontend" << setformat;
+		}
+	}
+	std::cout << "records\tone by one\t"
+			  << ns_per_value(start, bench_clock::now()) << " ns per record\n";
+	const std::string expected(out.str());
+
+	const unsigned int threads[] = { 1, 0 };
+	for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t)
+	{
+		start = bench_clock::now();
+		for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+		{
+			out.str(std::string());
+			format_batch(ofs, records.begin(), records.end(), threads[t]);
+		}
+		std::cout << "records\tformat_batch "
+				  << (threads[t] ? threads[t] : std::thread::hardware_concurrency())
+				  << " threads\t" << ns_per_value(start, bench_clock::now()) << " ns per record"
+				  << (out.str() == expected ? "" : "\tOUTPUT DIFFERS") << "\n";
+	}
+}
+
+// Records kept as format_records, then output, against output directly
+void BenchCapture(const std::vector<int>& i, const std::vector<double>& d)
+{
+	const formatter f(std::string("[record] id=%d, took %9.3f ms, from %s\n"));
+	std::vector<format_record> records(BENCH_VALUES, format_record(&f));
+	std::ostringstream out;
+	oformatstream ofs(f, &out);
+	bench_clock::time_point start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		out.str(std::string());
+		for (int n = 0; n < BENCH_VALUES; ++n)
+		{
+			ofs.put_record(i[n], d[n], "frontend");
+		}
+	}
+	double direct_ns = ns_per_value(start, bench_clock::now());
+	const std::string expected(out.str());
+
+	double capture_ns = 0, output_ns = 0;
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		start = bench_clock::now();
+		for (int n = 0; n < BENCH_VALUES; ++n)
+		{
+			records[n].clear();
+			records[n] << i[n] << d[n] << "frontend";
+		}
+		bench_clock::time_point captured = bench_clock::now();
+		out.str(std::string());
+		for (int n = 0; n < BENCH_VALUES; ++n)
+		{
+			ofs.put_record(records[n]);
+		}
+		capture_ns += ns_per_value(start, captured);
+		output_ns += ns_per_value(captured, bench_clock::now());
+	}
+	std::cout << "format_record\tcapture " << capture_ns << " ns\toutput " << output_ns
+			  << " ns\tdirect " << direct_ns << " ns per record, "
+			  << sizeof(format_record) << " bytes each"
+			  << (out.str() == expected ? "" : "\tOUTPUT DIFFERS") << "\n";
+}
+
+// Records output, then read back from memory
+void BenchScan(const std::vector<int>& i, const std::vector<double>& d)
+{
+	const std::string format("[record] id=%d, took %9.3f ms, from %s\n");
+	std::ostringstream out;
+	oformatstream ofs(format, &out);
+	ofs.classic(true);
+	bench_clock::time_point start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		out.str(std::string());
+		for (int n = 0; n < BENCH_VALUES; ++n)
+		{
+			ofs.put_record(i[n], d[n], "frontend");
+		}
+	}
+	double output_ns = ns_per_value(start, bench_clock::now());
+
+	const std::string text(out.str());
+	size_t records = 0;
+	long long sum = 0;
+	start = bench_clock::now();
+	for (int rep = 0; rep < BENCH_REPEATS; ++rep)
+	{
+		iformatstream ifs(format, text.data(), text.data() + text.size());
+		int id;
+		double took;
+		std::string_view name;
+		while (ifs.get_record(id, took, name))
+		{
+			++records;
+			sum += id + static_cast<long long>(name.size());
+		}
+	}
+	std::cout << "iformatstream\toutput " << output_ns << " ns\tread "
+			  << ns_per_value(start, bench_clock::now()) << " ns per record"
+			  << (records == size_t(BENCH_VALUES) * BENCH_REPEATS && sum ? "" : "\tRECORDS MISSED")
+			  << "\n";
+}
+
+// Lines ended by endl, to a file through fd_sink, under each flush policy
+void BenchFlush(const std::vector<int>& values)
+{
+	const format_flush policies[] = { flush_every_line, flush_every_records,
+		flush_every_bytes, flush_every_interval, flush_explicit };
+	const unsigned long long every[] = { 0, 64, 16384, 10, 0 };
+	const char* const names[] = { "every line", "every 64 records",
+		"every 16384 bytes", "every 10 ms", "explicit" };
+	for (size_t k = 0; k < sizeof(policies) / sizeof(policies[0]); ++k)
+	{
+		FILE* file = tmpfile();
+		if (!file)
+		{
+			continue;
+		}
+		{
+			fd_sink fd(fileno(file));
+			sinkbuf<fd_sink> buf(fd);
+			std::ostream os(&buf);
+			oformatstream ofs(std::string("[record] request served, id=%d, from %s"), &os);
+			ofs.flush_policy(policies[k], every[k]);
+			bench_clock::time_point start = bench_clock::now();
+			for (int rep = 0; rep < BENCH_REPEATS / 4; ++rep)
+			{
+				for (size_t n = 0; n < values.size(); ++n)
+				{
+					ofs << values[n] << "frontend" << endl;
+				}
+			}
+			ofs.flush();
+			double ns = std::chrono::duration<double, std::nano>(
+				bench_clock::now() - start).count();
+			std::cout << "endl\tflush " << names[k] << "\t"
+					  << ns / (double(BENCH_REPEATS / 4) * values.size()) << " ns per line\n";
+		}
+		fclose(file);
+	}
+}
+
+}	// namespace
+
+void BenchFormat()
+{
+	format_trace_enable(true);
+	std::vector<int> i;
+	std::vector<unsigned int> ui;
+	unsigned int seed = 12345;
+	for (int n = 0; n < BENCH_VALUES; ++n)
+	{
+		seed = seed * 1103515245 + 12345;
+		i.push_back(int(seed) >> (n % 31));
+		ui.push_back(seed >> (n % 32));
+	}
+
+	std::cout << "INTEGER SPANS " << BENCH_VALUES << " values x "
+			  << BENCH_REPEATS << " repeats\n";
+	BenchIntegers("%12d|", i);
+	BenchIntegers("%+-12d|", i);
+	BenchIntegers("%12u|", ui);
+	BenchIntegers("%012x|", ui);
+	BenchIntegers("%#12X|", ui);
+
+	std::vector<const void*> p;
+	std::vector<char> c;
+	for (int n = 0; n < BENCH_VALUES; ++n)
+	{
+		p.push_back(&i[n]);
+		c.push_back(char('!' + ui[n] % 94));
+	}
+	std::cout << "POINTERS, CHARACTERS AND TEXT\n";
+	BenchField("%p", p);
+	BenchField("%c", c);
+	BenchField("%4c", c);
+	BenchField("[record] request served, id=%d", i);
+	BenchSinks(i);
+	BenchWideSinks(i);
+	BenchFlush(i);
+
+	std::vector<double> d;
+	for (int n = 0; n < BENCH_VALUES; ++n)
+	{
+		d.push_back(double(i[n]) / double(ui[n] | 1));
+	}
+	std::cout << "FLOATING POINT\n";
+	BenchField("%f", d);
+	BenchField("%f", d, true);
+	BenchField("%.3e", d);
+	BenchField("%.3e", d, true);
+	std::cout << "RECORD SIZING\n";
+	BenchMeasure(i, d);
+	BenchBatch(i, d);
+	BenchCapture(i, d);
+	BenchScan(i, d);
+
+	const char* const parts[] = {
+		"[%s] ", "%-12d|", "%+#10.3e ", "%08lX", "%2$s=%1$d ", "%{id}u ",
+		"%*d", "text ", "%lld\n", "%.f", "%5.*f ", "%I64u"
+	};
+	const size_t nparts = sizeof(parts) / sizeof(parts[0]);
+	std::vector<std::string> formats;
+	for (int n = 0; n < BENCH_VALUES; ++n)
+	{
+		seed = seed * 1103515245 + 12345;
+		std::string s;
+		for (unsigned int k = 0; k < 2 + (seed >> 8) % 6; ++k)
+		{
+			s += parts[(seed >> (k * 4)) % nparts];
+		}
+		formats.push_back(s);
+	}
+	std::cout << "PARSING " << formats.size() << " formats\n";
+	BenchValidate(formats, 1);
+	BenchValidate(formats, 0);
+
+	const char* const cache = "oformat_bench.cache";
+	bench_clock::time_point start = bench_clock::now();
+	format_catalog catalog(formats);
+	bench_clock::time_point stop = bench_clock::now();
+	std::cout << "catalog\tcompile\t"
+			  << std::chrono::duration<double, std::milli>(stop - start).count() << " ms\n";
+	catalog.save(cache);
+	format_catalog cached;
+	start = bench_clock::now();
+	bool loaded = cached.load(cache, formats);
+	stop = bench_clock::now();
+	std::cout << "catalog\tload\t"
+			  << std::chrono::duration<double, std::milli>(stop - start).count() << " ms"
+			  << (loaded && cached.size() == catalog.size() ? "" : "\tNOT LOADED") << "\n";
+	remove(cache);
+
+#if defined(OFORMAT_TRACE)
+	std::vector<format_trace_entry> events(16);
+	events.resize(format_trace_snapshot(&events[0], events.size()));
+	std::cout << "TRACE\n";
+	for (size_t n = 0; n < events.size(); ++n)
+	{
+		std::cout << events[n].time << "\t" << events[n].stream << "\t"
+				  << format_trace_name(events[n].event) << "\t"
+				  << events[n].value << "\n";
+	}
+#endif
+	format_trace_enable(false);
+	std::cout.flush();
+}
@@ -31,7 +31,8 @@ typedef char CHAR_T;
 
 #define OUTPUT_FILE	"TestFormatOutput_STD.txt"
 
-#include <fstream>
+#include <stdio.h>
+#include <memory>
 #include "oformatstream.hpp"
 typedef wchar_t CHAR_T;
 #define _CHAR_T(x) L##x
@@ -114,8 +115,16 @@ void TestFormat()
 	FILE *stream = fopen(filename, "w" );
 	if (!stream) return;
 #else
+	// The wide output is encoded to UTF-8 as it is written, rather than
+	// by the codecvt facet of a std::wofstream
+	std::unique_ptr<FILE, int (*)(FILE*)> file(fopen(filename, "w"), fclose);
+	if (!file) return;
+	fd_sink outputsink(fileno(file.get()));
+	utf8_sink<fd_sink> outpututf8(outputsink);
+	wsinkbuf<utf8_sink<fd_sink> > outputbuf(outpututf8);
+	std::wostream outputfile(&outputbuf);
+
 	// Set up some default values
-	std::wofstream outputfile(filename);
 	std::wostream* defostream = &outputfile;//&std::wcout;
 	std::wostream* errorstream = defostream;//&std::wcerr;
 	std::streamsize defwidth(1), defprecision(2);
@@ -0,0 +1,1540 @@
+#include "stdafx.h"
+
+#pragma warning ( disable : 4786 )
+#pragma warning ( disable : 4996 )
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <float.h>
+#include <limits.h>
+#include <stdio.h>
+#include "oformatstream.hpp"
+#include "oformatsink.hpp"
+#include "iformatstream.hpp"
+
+// Run with "oformatstream_demo verify" to check oformatstream against printf.
+// Every format specification below is output with snprintf and with
+// oformatstream, narrow and wide, in the default and classic modes, and
+// the results compared byte for byte.  Any difference is listed.
+// Malformed formats are checked to be rejected with the right reason
+// at the right offset.  A format_catalog saved to a cache file and loaded
+// back is checked to output exactly as the one compiled, and output
+// through each sink exactly as through a std::ostringstream.
+// basic_formatter::measure() is checked against the length of records
+// actually output, and format_batch() and write_record() from a coroutine
+// against the same records output one by one.  Each flush policy is
+// checked to flush endl as often as it says, and an async_fd_sink with a
+// flush_interval() to pass output on to its file without being flushed.
+// Records kept in basic_format_records and output on another thread are
+// checked against the same values output directly.
+// Records read back by basic_iformatstream, from memory and from a mapped
+// file, are checked to output exactly as they were read.
+//
+// Run with "oformatstream_demo fuzz [n]" to parse n random format strings
+// and output a mix of values with each, eg. under a sanitizer.
+// Define OFORMAT_FUZZER and link with -fsanitize=fuzzer, leaving out
+// oformatstream_demo.cpp, to drive the same check from libFuzzer.
+
+namespace {
+
+// Specifications oformatstream means to output exactly as printf does.
+// Those it knowingly treats differently are left out, ie. integer
+// precision, the ' ' flag, %g (see the double inserter) and an empty
+// string, which is padded to the default format's width of 1.
+const char* const INT_FLAGS[] = { "", "-", "+", "0", "#", "+-", "-#", "0#", 0 };
+const char* const INT_WIDTHS[] = { "", "1", "8", "24", 0 };
+const char INT_TYPES[] = "diuxXo";
+const char* const FLOAT_FLAGS[] = { "", "-", "+", "0", "#", "+0", "-#", 0 };
+const char* const FLOAT_WIDTHS[] = { "", "1", "12", "30", 0 };
+const char* const FLOAT_PRECISIONS[] = { "", ".", ".0", ".1", ".3", ".9", 0 };
+const char FLOAT_TYPES[] = "eEf";
+
+int failures;
+
+std::wstring widen(const std::string& s)
+{
+	return std::wstring(s.begin(), s.end());
+}
+
+template <typename T>
+std::string oformat(const std::string& spec, T v, bool classic)
+{
+	std::ostringstream out;
+	oformatstream ofs(spec, &out);
+	ofs.classic(classic);
+	ofs << v << setformat;
+	return out.str();
+}
+
+template <typename T>
+std::string woformat(const std::string& spec, T v, bool classic)
+{
+	std::wostringstream out;
+	woformatstream ofs(widen(spec), &out);
+	ofs.classic(classic);
+	ofs << v << setformat;
+	std::wstring w(out.str());
+	return std::string(w.begin(), w.end());
+}
+
+template <typename T>
+void compare(const std::string& spec, T v, const char* printed)
+{
+	const std::string expected(printed);
+	const char* mode[] = { "default", "classic" };
+	for (int classic = 0; classic < 2; ++classic)
+	{
+		std::string narrow = oformat(spec, v, 0 != classic);
+		std::string wide = woformat(spec, v, 0 != classic);
+		if (narrow != expected || wide != expected)
+		{
+			if (++failures <= 50)
+			{
+				std::cout << spec << "\t" << mode[classic]
+						  << "\tprintf [" << expected << "]"
+						  << "\toformatstream [" << narrow << "]";
+				if (wide != narrow)
+				{
+					std::cout << "\twoformatstream [" << wide << "]";
+				}
+				std::cout << "\n";
+			}
+		}
+	}
+}
+
+template <typename T>
+void compare_values(const std::string& spec, const std::vector<T>& values)
+{
+	char buf[512];
+	for (typename std::vector<T>::const_iterator it = values.begin();
+		 it != values.end(); ++it)
+	{
+		snprintf(buf, sizeof(buf), spec.c_str(), *it);
+		compare(spec, *it, buf);
+	}
+}
+
+void VerifyIntegers()
+{
+	std::vector<int> i;
+	std::vector<long> l;
+	std::vector<long long> ll;
+	int const iv[] = { 0, 1, -1, 7, -42, 0xBED, INT_MAX, INT_MIN };
+	for (size_t n = 0; n < sizeof(iv) / sizeof(iv[0]); ++n)
+	{
+		i.push_back(iv[n]);
+		l.push_back(iv[n]);
+		ll.push_back(iv[n]);
+	}
+	l.push_back(LONG_MAX);
+	l.push_back(LONG_MIN);
+	ll.push_back(LLONG_MAX);
+	ll.push_back(LLONG_MIN);
+	ll.push_back(1234567890123456789LL);
+
+	for (int f = 0; INT_FLAGS[f]; ++f)
+	{
+		for (int w = 0; INT_WIDTHS[w]; ++w)
+		{
+			for (int t = 0; INT_TYPES[t]; ++t)
+			{
+				std::string spec = std::string("[%") + INT_FLAGS[f] + INT_WIDTHS[w];
+				char type[2] = { INT_TYPES[t], 0 };
+				if ('d' == type[0] || 'i' == type[0])
+				{	// hex and octal show every value as unsigned
+					compare_values(spec + type + "]", i);
+					compare_values(spec + "l" + type + "]", l);
+					compare_values(spec + "ll" + type + "]", ll);
+				}
+				else
+				{
+					std::vector<unsigned int> ui(i.begin(), i.end());
+					std::vector<unsigned long> ul(l.begin(), l.end());
+					std::vector<unsigned long long> ull(ll.begin(), ll.end());
+					compare_values(spec + type + "]", ui);
+					compare_values(spec + "l" + type + "]", ul);
+					compare_values(spec + "ll" + type + "]", ull);
+				}
+			}
+		}
+	}
+}
+
+void VerifyFloating()
+{
+	double const dv[] = {
+		0.0, -0.0, 1.0, -1.5, 0.5, 2.71828, 3.14159265358979, 100.0, 1e-5,
+		123456.789, 9.9999995, 0.000123456, 1e100, -1e-100,
+		DBL_MIN, DBL_MAX, DBL_EPSILON
+	};
+	std::vector<double> d(dv, dv + sizeof(dv) / sizeof(dv[0]));
+	std::vector<double> small;
+	for (size_t n = 0; n < d.size(); ++n)
+	{
+		if (d[n] < 1e30 && d[n] > -1e30) small.push_back(d[n]);
+	}
+
+	for (int f = 0; FLOAT_FLAGS[f]; ++f)
+	{
+		for (int w = 0; FLOAT_WIDTHS[w]; ++w)
+		{
+			for (int p = 0; FLOAT_PRECISIONS[p]; ++p)
+			{
+				for (int t = 0; FLOAT_TYPES[t]; ++t)
+				{
+					std::string spec = std::string("[%") + FLOAT_FLAGS[f] +
+						FLOAT_WIDTHS[w] + FLOAT_PRECISIONS[p] + FLOAT_TYPES[t] + "]";
+					compare_values(spec, 'f' == FLOAT_TYPES[t] ? small : d);
+				}
+			}
+		}
+	}
+}
+
+void VerifyCharacters()
+{
+	// the widths over 16 bits are held aside by basic_format_table
+	const char* const specs[] = {
+		"[%c]", "[%1c]", "[%5c]", "[%s]", "[%8s]", "[%70000c]", "[%-65535s]", 0
+	};
+	static char buf[80000];
+	for (int n = 0; specs[n]; ++n)
+	{
+		std::string spec(specs[n]);
+		if (std::string::npos != spec.find('c'))
+		{
+			const char cv[] = "a Z%~";
+			for (int k = 0; cv[k]; ++k)
+			{
+				snprintf(buf, sizeof(buf), spec.c_str(), cv[k]);
+				compare(spec, cv[k], buf);
+			}
+		}
+		else
+		{
+			const char* const sv[] = { "x", "text", "a longer string", 0 };
+			for (int k = 0; sv[k]; ++k)
+			{
+				snprintf(buf, sizeof(buf), spec.c_str(), sv[k]);
+				compare(spec, sv[k], buf);
+			}
+		}
+	}
+}
+
+struct parse_case
+{
+	const char* format;
+	format_error error;
+	size_t offset;
+};
+
+const parse_case PARSE_CASES[] = {
+	{ "plain text",			format_error_none,			0 },
+	{ "%d%% %s%c",			format_error_none,			0 },
+	{ "%I64d %I32u %Id",	format_error_none,			0 },
+	{ "%2$s %1$d",			format_error_none,			0 },
+	{ "100%",				format_error_incomplete,	4 },
+	{ "[%-08.3",			format_error_incomplete,	7 },
+	{ "%{name",				format_error_incomplete,	6 },
+	{ "%2$",				format_error_incomplete,	3 },
+	{ "%d %q",				format_error_type,			4 },
+	{ "%5-d",				format_error_type,			2 },
+	{ "%*5d",				format_error_type,			2 },
+	{ "%.3.4f",				format_error_type,			3 },
+	{ "%ld %lz",			format_error_type,			6 },
+	{ "count %n",			format_error_unsupported,	7 },
+	{ "%0$d",				format_error_argument,		1 },
+	{ "%{}d",				format_error_argument,		2 },
+	{ "%99999999999d",		format_error_range,			10 },
+	{ "%.99999999999f",		format_error_range,			11 },
+	{ "%99999999999$d",		format_error_range,			1 },
+	{ "%d %1$*d",			format_error_star,			2 },
+	{ 0 }
+};
+
+void VerifyParser()
+{
+	std::vector<std::string> formats;
+	for (int n = 0; PARSE_CASES[n].format; ++n)
+	{
+		formats.push_back(PARSE_CASES[n].format);
+	}
+	std::vector<format_parse_result> results;
+	format_validate(formats, results);
+	for (size_t n = 0; n < formats.size(); ++n)
+	{
+		const parse_case& pc = PARSE_CASES[n];
+		const format_parse_result& r = results[n];
+		size_t offset = r.ok() ? 0 : r.offset;
+		wformatter wide(widen(formats[n]));
+		if (r.error != pc.error || offset != pc.offset ||
+			wide.parse_result().error != r.error ||
+			wide.parse_result().offset != r.offset)
+		{
+			if (++failures <= 50)
+			{
+				std::cout << formats[n] << "\texpected " << format_error_text(pc.error)
+						  << " at " << pc.offset << "\tgot " << r.reason()
+						  << " at " << offset << "\n";
+			}
+		}
+	}
+}
+
+std::string catalog_output(const format_catalog& catalog)
+{
+	std::ostringstream out;
+	for (format_catalog::size_type n = 0; n < catalog.size(); ++n)
+	{
+		const format_parse_result& r = catalog[n].parse_result();
+		out << n << " " << r.error << " " << r.offset << " " << r.fields << ": ";
+		oformatstream ofs(catalog[n], &out);
+		ofs << 42 << -2.5 << "str" << 'c' << 7u << setformat << "\n";
+	}
+	return out.str();
+}
+
+void VerifyCatalog()
+{
+	const char* const path = "oformat_verify.cache";
+	format_specification fs(3, 4);
+	std::vector<std::string> formats;
+	for (int n = 0; PARSE_CASES[n].format; ++n)
+	{
+		formats.push_back(PARSE_CASES[n].format);
+	}
+	formats.push_back("[%-8s] %+.3e %{b}x %{a}d");
+	formats.push_back("%1$s %1$s %2$5d|");
+	format_catalog compiled(formats, 0, fs);
+	format_catalog loaded(fs);
+	std::string problem;
+	if (!compiled.save(path))
+	{
+		problem = "can't save";
+	}
+	else if (!loaded.load(path, formats))
+	{
+		problem = "can't load";
+	}
+	else if (catalog_output(loaded) != catalog_output(compiled) ||
+			 loaded.rejected() != compiled.rejected())
+	{
+		problem = "loaded catalog differs";
+	}
+	else
+	{
+		formats.back() += " ";
+		if (loaded.load(path, formats))
+		{
+			problem = "loaded from other formats";
+		}
+	}
+	remove(path);
+	if (!problem.empty())
+	{
+		++failures;
+		std::cout << "format_catalog\t" << problem << "\n";
+	}
+}
+
+std::string edit_output(const formatter& f)
+{
+	std::ostringstream out;
+	oformatstream ofs(f, &out);
+	for (int v = 1; v <= 9; ++v)
+	{
+		ofs << v * 11;
+	}
+	ofs << setformat;
+	return out.str();
+}
+
+// Compare a formatter edited with insert(), replace() and erase()
+// with one parsed from the joined format string.
+void VerifyEdits()
+{
+	const char* const PIECES[] = { "a=%d", " b=%x", " c=%5d", "|", 0 };
+	const char* const FRAGMENTS[] = { "id=%d, ", "%o", "<", "", "[%-4d]>", 0 };
+	std::vector<std::string> pieces(PIECES, PIECES + 4);
+	for (size_t n = 0; n <= pieces.size() + 1; ++n)
+	{
+		for (int i = 0; FRAGMENTS[i]; ++i)
+		{
+			std::string edits[3];
+			for (size_t k = 0; k < pieces.size(); ++k)
+			{
+				edits[0] += (k == n ? FRAGMENTS[i] : "") + pieces[k];
+				edits[1] += k == n ? FRAGMENTS[i] : pieces[k];
+				edits[2] += k == n ? "" : pieces[k];
+			}
+			if (n >= pieces.size())
+			{
+				edits[0] += FRAGMENTS[i];
+				edits[1] += FRAGMENTS[i];
+			}
+			formatter edited[3] = { formatter(pieces[0]), formatter(pieces[0]), formatter(pieces[0]) };
+			for (int e = 0; e < 3; ++e)
+			{
+				for (size_t k = 1; k < pieces.size(); ++k)
+				{
+					edited[e].append(pieces[k]);
+				}
+			}
+			edited[0].insert(n, std::string(FRAGMENTS[i]));
+			edited[1].replace(n, std::string(FRAGMENTS[i]));
+			edited[2].erase(n);
+			const char* const names[] = { "insert", "replace", "erase" };
+			for (int e = 0; e < 3; ++e)
+			{
+				std::string expected(edit_output(formatter(edits[e])));
+				std::string got(edit_output(edited[e]));
+				if (got != expected && ++failures <= 50)
+				{
+					std::cout << names[e] << "(" << n << ", \"" << FRAGMENTS[i]
+							  << "\")\texpected [" << expected << "]\tgot [" << got << "]\n";
+				}
+			}
+		}
+	}
+}
+
+// A formatter's default specification pads its literal text, so every
+// copy, move and concatenation of it, and every stream given one, must
+// keep it.
+void VerifyDefaultSpecification()
+{
+	const std::string s("<%d|%s>"), expected("     <    42     |     x     >");
+	const format_specification fs(6, 2);
+	formatter f(s, fs), moving(s, fs), assigned;
+	formatter copied(f), moved(std::move(moving));
+	assigned = f;
+	formatter joined(formatter(std::string("<%d"), fs) + formatter(std::string("|%s>"), fs));
+	format_catalog catalog(std::vector<std::string>(1, s), 0, fs);
+	const formatter* const formats[] = { &f, &copied, &moved, &assigned, &joined, &catalog[0] };
+	const char* const names[] = { "formatter", "copy", "move", "assignment", "operator+", "catalog" };
+	for (size_t n = 0; n < sizeof(formats) / sizeof(formats[0]); ++n)
+	{
+		std::ostringstream out;
+		{
+			oformatstream ofs(*formats[n], &out);
+			ofs.put_record(42, "x");
+		}
+		if (out.str() != expected && ++failures <= 50)
+		{
+			std::cout << "default specification\t" << names[n] << "\texpected ["
+					  << expected << "]\tgot [" << out.str() << "]\n";
+		}
+	}
+	iformatstream in(f, expected.data(), expected.data() + expected.size());
+	int i(0);
+	std::string_view name;
+	in >> i >> name;
+	if (!in || 42 != i || name != "x")
+	{
+		++failures;
+		std::cout << "default specification\tiformatstream read " << i
+				  << " [" << name << "] from [" << expected << "]\n";
+	}
+}
+
+// A few records, changing format part way so the sinks holding
+// literal text from the earlier formats must be synced first.
+void sink_records(std::ostream& os)
+{
+	oformatstream ofs("[%s] %5d|%-8.3f|%x\n", &os);
+	for (int n = 0; n < 500; ++n)
+	{
+		ofs << "record" << n * 37 << n / 7.0 << n;
+	}
+	ofs.formatter(formatter("%2$s=%1$d, "));
+	for (int n = 0; n < 100; ++n)
+	{
+		ofs << n << "name";
+	}
+	std::string rule(200, '-');
+	ofs.formatter(formatter((rule + "%d\n" + rule + "\n").c_str()));
+	for (int n = 0; n < 100; ++n)
+	{
+		ofs << n;
+	}
+	ofs.formatter(formatter("%s"));
+	ofs << std::string(30000, 'x').c_str() << setformat;
+}
+
+bool append_output(void* context, const char* p, size_t n)
+{
+	static_cast<std::string*>(context)->append(p, n);
+	return true;
+}
+
+void VerifySinks()
+{
+	std::ostringstream expected;
+	sink_records(expected);
+	std::vector<std::string> got, name;
+	{
+		string_sink sink;
+		sinkbuf<string_sink> buf(sink);
+		std::ostream os(&buf);
+		sink_records(os);
+		os.flush();
+		got.push_back(sink.str());
+		name.push_back("string_sink");
+	}
+	{
+		std::vector<char> array(expected.str().size() + 10);
+		buffer_sink sink(&array[0], array.size());
+		sinkbuf<buffer_sink> buf(sink);
+		std::ostream os(&buf);
+		sink_records(os);
+		os.flush();
+		got.push_back(std::string(sink.data(), sink.size()));
+		name.push_back("buffer_sink");
+	}
+	{
+		std::string out;
+		callback_sink sink(&append_output, &out);
+		sinkbuf<callback_sink> buf(sink);
+		std::ostream os(&buf);
+		sink_records(os);
+		os.flush();
+		got.push_back(out);
+		name.push_back("callback_sink");
+	}
+	FILE* file = tmpfile();
+	if (file)
+	{
+		{
+			fd_sink sink(fileno(file));
+			sinkbuf<fd_sink> buf(sink);
+			std::ostream os(&buf);
+			sink_records(os);
+		}
+		std::string out(expected.str().size() + 10, ' ');
+		rewind(file);
+		out.resize(fread(&out[0], 1, out.size(), file));
+		fclose(file);
+		got.push_back(out);
+		name.push_back("fd_sink");
+	}
+	const async_sink_format formats[] = { async_format_raw, async_format_lz4 };
+	const char* const format_names[] = { "async_fd_sink", "async_fd_sink lz4" };
+	for (int k = 0; k < 2; ++k)
+	{
+		file = tmpfile();
+		if (!file)
+		{
+			continue;
+		}
+		async_sink_metrics metrics;
+		{	// small buffers, so the writer has to wait for them
+			async_fd_sink sink(fileno(file), 1000, 3, async_sync_flush, formats[k]);
+			sinkbuf<async_fd_sink> buf(sink);
+			std::ostream os(&buf);
+			sink_records(os);
+			os.flush();
+			metrics = sink.metrics();
+		}
+		fseek(file, 0, SEEK_END);
+		std::string out(static_cast<size_t>(ftell(file)), ' ');
+		rewind(file);
+		out.resize(fread(&out[0], 1, out.size(), file));
+		fclose(file);
+		if (async_format_lz4 == formats[k])
+		{
+			std::string packed;
+			packed.swap(out);
+			if (!lz4_frame_decode(packed.data(), packed.size(), out))
+			{
+				++failures;
+				std::cout << format_names[k] << "\tnot a valid LZ4 frame\n";
+			}
+		}
+		if (metrics.bytes != expected.str().size())
+		{
+			++failures;
+			std::cout << format_names[k] << "\t" << metrics.bytes << " bytes in its metrics, "
+					  << expected.str().size() << " written\n";
+		}
+		got.push_back(out);
+		name.push_back(format_names[k]);
+	}
+	for (size_t n = 0; n < got.size(); ++n)
+	{
+		if (got[n] != expected.str())
+		{
+			++failures;
+			std::cout << name[n] << "\toutput differs from std::ostringstream\n";
+		}
+	}
+}
+
+// Pieces of wide text and their UTF-8 encoding, including a character
+// outside the BMP and broken surrogates, which become U+FFFD.
+struct utf8_piece
+{
+	std::wstring wide;
+	const char* utf8;
+};
+
+std::string utf8_of(const std::wstring& s)
+{
+	std::string out(4 * s.size() + 3, ' ');
+	wchar_t carry = 0;
+	out.resize(utf8_encode(s.data(), s.size(), &out[0], carry));
+	return out;
+}
+
+// Keeps what utf8_sink passes on, and the most it passed on at once
+struct utf8_check_sink
+{
+	utf8_check_sink()
+		: largest(0)
+	{}
+
+	void write(const char* p, size_t n)
+	{
+		out.append(p, n);
+		largest = std::max(largest, n);
+	}
+
+	bool flush()
+	{ return true; }
+
+	std::string out;
+	size_t largest;
+};
+
+void VerifyUtf8()
+{
+	std::wstring smile;
+	if (2 == sizeof(wchar_t))
+	{
+		smile += wchar_t(0xD83D);
+		smile += wchar_t(0xDE00);
+	}
+	else
+	{
+		smile += wchar_t(0x1F600);
+	}
+	const utf8_piece pieces[] = {
+		{ std::wstring(1, wchar_t(0xE9)), "\xC3\xA9" },
+		{ std::wstring(1, wchar_t(0x20AC)), "\xE2\x82\xAC" },
+		{ smile, "\xF0\x9F\x98\x80" },
+		{ std::wstring(1, wchar_t(0xD800)) + L"x", "\xEF\xBF\xBDx" },
+		{ std::wstring(1, wchar_t(0xDC00)), "\xEF\xBF\xBD" },
+	};
+	const size_t npieces = sizeof(pieces) / sizeof(pieces[0]);
+
+	std::wstring text;
+	std::string expected;
+	unsigned int seed = 4242;
+	for (int n = 0; n < 2000; ++n)
+	{
+		seed = seed * 1103515245 + 12345;
+		size_t k = (seed >> 16) % (npieces + 2);
+		if (k < npieces)
+		{
+			text += pieces[k].wide;
+			expected += pieces[k].utf8;
+		}
+		else
+		{	// a run of ASCII, long enough to take the block copy
+			for (size_t m = (seed >> 8) % 40; m; --m)
+			{
+				char c = char('0' + (seed >> (m % 32)) % 75);
+				text += wchar_t(c);
+				expected += c;
+			}
+		}
+	}
+
+	std::string whole = utf8_of(text);
+	std::string split;
+	wchar_t carry = 0;
+	char buf[4 * 17 + 3];
+	for (size_t at = 0; at < text.size(); )
+	{	// pieces of 1 to 17 characters, so pairs are split between calls
+		seed = seed * 1103515245 + 12345;
+		size_t n = std::min<size_t>(1 + (seed >> 16) % 17, text.size() - at);
+		split.append(buf, utf8_encode(text.data() + at, n, buf, carry));
+		at += n;
+	}
+	if (whole != expected || split != expected)
+	{
+		++failures;
+		std::cout << "utf8_encode\toutput differs from the expected encoding"
+				  << (whole == expected ? " when split" : "") << "\n";
+	}
+
+	std::wostringstream wide;
+	string_sink strings;
+	{
+		utf8_sink<string_sink> utf8(strings);
+		wsinkbuf<utf8_sink<string_sink> > buf(utf8);
+		std::wostream os(&buf);
+		woformatstream sinkofs(L"[%s] %5d|%-8.3f\n", &os);
+		woformatstream ofs(L"[%s] %5d|%-8.3f\n", &wide);
+		for (size_t at = 0; at < text.size(); at += 50)
+		{
+			std::wstring part(text, at, 50);
+			sinkofs << part.c_str() << int(at) << at / 7.0;
+			ofs << part.c_str() << int(at) << at / 7.0;
+		}
+	}
+	if (strings.str() != utf8_of(wide.str()))
+	{
+		++failures;
+		std::cout << "utf8_sink\toutput differs from std::wostringstream\n";
+	}
+
+	// A lone high surrogate ending one write, with the buffer all but
+	// full, is only known to be U+FFFD at the next write, and the
+	// characters after it must still fit.  Only UTF-16 carries one.
+	utf8_check_sink edge;
+	std::wstring edgetext;
+	{
+		utf8_sink<utf8_check_sink> utf8(edge);
+		std::wstring second(2, wchar_t(0x20AC));
+		second += L'b';
+		for (size_t pad = utf8_sink_buffer - 12; pad < utf8_sink_buffer; ++pad)
+		{
+			std::wstring first(pad, L'a');
+			first += wchar_t(0xD800);
+			utf8.write(first.data(), first.size());
+			utf8.write(second.data(), second.size());
+			utf8.flush();
+			edgetext += first + second;
+		}
+	}
+	if (edge.out != utf8_of(edgetext) || edge.largest > utf8_sink_buffer)
+	{
+		++failures;
+		std::cout << "utf8_sink\t" << edge.largest
+				  << " bytes passed on from a buffer of " << utf8_sink_buffer << "\n";
+	}
+}
+
+// Output one record of args in classic mode, completing it with setformat,
+// and compare its length with what measure() gives.
+template <typename S, typename... Args>
+void check_measure(const S& spec, Args... args)
+{
+	typedef typename S::value_type E;
+	std::basic_ostringstream<E> out;
+	basic_oformatstream<E> ofs(spec, &out);
+	ofs.classic(true);
+	if constexpr (sizeof...(Args) != 0)
+	{
+		(ofs << ... << args);
+	}
+	if (ofs.formatter().positional())
+	{
+		ofs << setformat;
+	}
+	while (ofs.formatter().position())
+	{
+		ofs << setformat;
+	}
+	size_t measured = ofs.formatter().measure(args...);
+	if (measured != out.str().size())
+	{
+		if (++failures <= 50)
+		{
+			std::basic_string<E> w(out.str());
+			std::cout << std::string(spec.begin(), spec.end())
+					  << "\tmeasure " << measured << "\toutput " << w.size()
+					  << " [" << std::string(w.begin(), w.end()) << "]\n";
+		}
+	}
+}
+
+// A '*' value out of the range of an int is consumed but ignored,
+// whatever the type it is given as, as if no width and a negative
+// precision had been given.
+template <typename T>
+void check_star(T ignored)
+{
+	std::ostringstream out, expected;
+	oformatstream ofs(std::string("%*d|%.*f|"), &out);
+	oformatstream plain(std::string("%*d|%.*f|"), &expected);
+	ofs << ignored << 7 << ignored << 2.5;
+	plain << 0 << 7 << -1 << 2.5;
+	check_measure(std::string("%*d|%.*f|"), ignored, 7, ignored, 2.5);
+	if (out.str() != expected.str() && ++failures <= 50)
+	{
+		std::cout << "%*d|%.*f| ignoring " << static_cast<long double>(ignored) << "\texpected ["
+				  << expected.str() << "]\tgot [" << out.str() << "]\n";
+	}
+}
+
+void VerifyMeasure()
+{
+	const char* const int_specs[] = {
+		"%d", "%+d", "%5d", "%-24d", "%x", "%#x", "%#X", "%o", "%#o", "<%08d>", 0 };
+	const char* const float_specs[] = {
+		"%g", "%e", "%.3f", "%#g", "%10.4g", "%+e", "%.0f", "%#.0e", "%-30.9E", "%.1g", 0 };
+	const double doubles[] = {
+		0.0, 1.0, -1.5, 1e-5, 0.1, 2.0 / 3.0, 123456789.0, -9.999e99, 1e300, DBL_MIN };
+
+	for (const char* const* spec = int_specs; *spec; ++spec)
+	{
+		std::string s(*spec);
+		unsigned long long p = 1;
+		for (int k = 0; k < 20; ++k, p *= 10)
+		{
+			check_measure(s, p);
+			check_measure(s, p - 1);
+			check_measure(s, (long long)(p - 1) * -1);
+			check_measure(s, int(p));
+			check_measure(s, (unsigned short)p);
+		}
+		check_measure(s, LLONG_MIN);
+		check_measure(s, ULLONG_MAX);
+		check_measure(s, INT_MIN);
+		check_measure(s, true);
+		check_measure(s, 'c');
+	}
+	for (const char* const* spec = float_specs; *spec; ++spec)
+	{
+		std::string s(*spec);
+		for (size_t k = 0; k < sizeof(doubles) / sizeof(doubles[0]); ++k)
+		{
+			check_measure(s, doubles[k]);
+			check_measure(s, float(doubles[k]));
+			check_measure(s, (long double)doubles[k]);
+		}
+	}
+	check_measure(std::string("%e|%f"), DBL_MAX, -HUGE_VAL);
+
+	int x;
+	check_measure(std::string("%s|%10s|%-3s|%c|%5c|%-4c"), "abc", "", "abcdef", 'x', 'y', 'z');
+	check_measure(std::string("%p %#p %20p"), (const void*)&x, &x, (void*)0);
+	check_measure(std::string("%*d|%-*.*f|%.*e"), 8, 42, 6, 2, 2.5, 3, 1e10);
+	check_measure(std::string("%*d|%*s"), -6, 42, 30, "right");
+	check_measure(std::string("%*d"), LONG_MAX, 7);
+	check_star((1LL << 32) | 5);
+	check_star(-(1LL << 32) - 5);
+	check_star(ULLONG_MAX);
+	check_star(ULLONG_MAX - 9);
+	check_star(static_cast<unsigned long>(INT_MAX) + 1);
+	check_star(LLONG_MIN);
+#if defined(__SIZEOF_INT128__)
+	check_star((static_cast<__int128>(1) << 64) | 5);
+	check_star(-(static_cast<__int128>(1) << 64) - 5);
+	check_star(~static_cast<unsigned __int128>(9));
+#endif
+	check_measure(std::string("[%d] %s and %5.1f end"), 1);
+	check_measure(std::string("[%d] %s and %5.1f end"), 1, "two", 3.0);
+	check_measure(std::string("[%d] %s and %5.1f end"), 1, "two", 3.0, 4);
+	check_measure(std::string("text only"));
+	check_measure(std::string("%2$s=%1$d %1$#x;"), 255, "key");
+	check_measure(std::string("%2$s=%1$d %1$#x;"), 255);
+	check_measure(std::string("%{id}05d %{name}-12s %{id}x\n"), 77, "name");
+	check_measure(std::wstring(L"%s|%5c|%s|%-3c"), L"wide", L'w', "narrow", 'n');
+
+	formatter fixed("%08x|%-10s|%6.2f\n");
+	format_record_size size = fixed.record_size();
+	if (!size.fixed || size.minimum != 27 || size.typical != 27 ||
+		fixed.measure(0xBEEF, "fits", 3.25) != size.minimum ||
+		formatter("%d %s").record_size().fixed)
+	{
+		++failures;
+		std::cout << "record_size\tfixed " << size.fixed << " minimum " << size.minimum
+				  << " typical " << size.typical << "\n";
+	}
+}
+
+// Output records one by one, then with format_batch on a few numbers of
+// threads, and compare.
+template <typename S, typename T>
+void check_batch(const S& spec, const std::vector<T>& records)
+{
+	typedef typename S::value_type E;
+	std::basic_ostringstream<E> expected;
+	basic_oformatstream<E> ofs(spec, &expected);
+	for (size_t n = 0; n < records.size(); ++n)
+	{
+		std::apply([&ofs](const auto&... v) { (ofs << ... << v); }, records[n]);
+		if (ofs.formatter().positional())
+		{
+			ofs << setformat;
+		}
+		while (ofs.formatter().position())
+		{
+			ofs << setformat;
+		}
+	}
+	const unsigned int threads[] = { 1, 2, 5, 0 };
+	for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t)
+	{
+		std::basic_ostringstream<E> out;
+		basic_oformatstream<E> batch(spec, &out);
+		format_batch(batch, records.begin(), records.end(), threads[t]);
+		if (out.str() != expected.str())
+		{
+			++failures;
+			std::cout << std::string(spec.begin(), spec.end())
+					  << "\tformat_batch on " << threads[t] << " threads differs\n";
+		}
+	}
+}
+
+void VerifyBatch()
+{
+	std::vector<std::tuple<int, double, const char*> > records;
+	std::vector<std::tuple<int, int, const char*> > starred;
+	std::vector<std::tuple<const wchar_t*, unsigned long long> > wide;
+	const char* const names[] = { "frontend", "db", "" };
+	unsigned int seed = 777;
+	for (int n = 0; n < 5000; ++n)
+	{	// more than one pass of the batch on one thread
+		seed = seed * 1103515245 + 12345;
+		records.push_back(std::make_tuple(int(seed) >> (n % 29), double(n) / 7.0, names[n % 3]));
+		starred.push_back(std::make_tuple(n % 13 - 6, n, names[n % 3]));
+		wide.push_back(std::make_tuple(L"wide", (unsigned long long)seed << (n % 32)));
+	}
+	check_batch(std::string("[%d] %8.3f %s\n"), records);
+	check_batch(std::string("%3$s: %1$05d %2$.2e %1$x\n"), records);
+	check_batch(std::string("%d %g"), records);
+	check_batch(std::string("%*d|%s\n"), starred);
+	check_batch(std::wstring(L"%s %llu\n"), wide);
+	records.resize(3);
+	check_batch(std::string("[%d] %8.3f %s\n"), records);
+	records.clear();
+	check_batch(std::string("[%d] %8.3f %s\n"), records);
+}
+
+// The simplest coroutine that can call write_record(), run at once
+struct record_task
+{
+	struct promise_type
+	{
+		record_task get_return_object() { return record_task(); }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+const char* const coroutine_names[] = { "frontend", "db", "" };
+
+record_task coroutine_records(oformatstream& ofs, int count, std::promise<void>& done)
+{
+	for (int n = 0; n < count; ++n)
+	{
+		co_await ofs.write_record(n * 37, n / 8.0, coroutine_names[n % 3]);
+	}
+	done.set_value();
+}
+
+void VerifyCoroutine()
+{
+	const std::string format("%5d %-8.3f [%s]\n");
+	const int count = 3000;
+	std::ostringstream expected;
+	oformatstream ofs(format, &expected);
+	for (int n = 0; n < count; ++n)
+	{
+		ofs.put_record(n * 37, n / 8.0, coroutine_names[n % 3]);
+	}
+
+	for (int classic = 0; classic < 3; ++classic)
+	{
+		std::string out;
+		FILE* file = 2 == classic ? NULL : tmpfile();
+		if (file)
+		{	// buffers so small the coroutine has to be suspended
+			async_fd_sink sink(fileno(file), 200, 2);
+			sinkbuf<async_fd_sink> buf(sink);
+			std::ostream os(&buf);
+			oformatstream aofs(format, &os);
+			aofs.classic(0 != classic);
+			std::promise<void> done;
+			coroutine_records(aofs, count, done);
+			done.get_future().wait();
+			os.flush();
+			fseek(file, 0, SEEK_END);
+			out.resize(static_cast<size_t>(ftell(file)));
+			rewind(file);
+			out.resize(fread(&out[0], 1, out.size(), file));
+			fclose(file);
+		}
+		else
+		{	// no sink, so it is never suspended
+			std::ostringstream os;
+			oformatstream aofs(format, &os);
+			std::promise<void> done;
+			coroutine_records(aofs, count, done);
+			out = os.str();
+		}
+		if (out != expected.str())
+		{
+			++failures;
+			std::cout << "write_record\t" << (2 == classic ? "std::ostringstream" :
+				classic ? "async_fd_sink classic" : "async_fd_sink")
+					  << " output differs from put_record\n";
+		}
+	}
+}
+
+// A sink counting the flushes that reach it
+struct counting_sink
+{
+	counting_sink()
+		: flushes(0)
+	{}
+
+	void write(const char* p, size_t n)
+	{ out.append(p, n); }
+
+	void write_stable(const char* p, size_t n)
+	{ out.append(p, n); }
+
+	bool flush()
+	{ ++flushes; return true; }
+
+	std::string out;
+	int flushes;
+};
+
+// Ten lines of 5 characters ended with endl, then flush(), under a
+// policy, the flushes counted from the first endl.
+void check_flush(const char* name, format_flush when, unsigned long long n,
+				 int endl_flushes, int flush_flushes)
+{
+	counting_sink sink;
+	sinkbuf<counting_sink> buf(sink);
+	std::ostream os(&buf);
+	oformatstream ofs(std::string("%d %s"), &os);
+	ofs.flush_policy(when, n);
+	ofs << 0 << "ab";
+	int base = sink.flushes;
+	ofs << endl;
+	for (int k = 1; k < 10; ++k)
+	{
+		ofs << k << "ab" << endl;
+	}
+	int lines = sink.flushes - base;
+	ofs << flush;
+	int flushed = sink.flushes - base - lines;
+	buf.pubsync();
+	if (lines != endl_flushes || flushed != flush_flushes ||
+		sink.out != "0 ab\n1 ab\n2 ab\n3 ab\n4 ab\n5 ab\n6 ab\n7 ab\n8 ab\n9 ab\n")
+	{
+		++failures;
+		std::cout << "flush_policy\t" << name << "\t" << lines << " endl and "
+				  << flushed << " flush() flushes, expected " << endl_flushes
+				  << " and " << flush_flushes << "\n";
+	}
+}
+
+long file_size(FILE* file)
+{
+	fseek(file, 0, SEEK_END);
+	return ftell(file);
+}
+
+// The size of file once it holds size bytes, or after two seconds
+long await_size(FILE* file, long size)
+{
+	for (int k = 0; k < 2000 && file_size(file) < size; ++k)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return file_size(file);
+}
+
+void VerifyFlush()
+{
+	check_flush("every line", flush_every_line, 0, 10, 1);
+	check_flush("every 4 records", flush_every_records, 4, 2, 1);
+	check_flush("every 12 bytes", flush_every_bytes, 12, 3, 1);
+	check_flush("every 0 ms", flush_every_interval, 0, 10, 1);
+	check_flush("every hour", flush_every_interval, 3600000, 0, 1);
+	check_flush("explicit", flush_explicit, 0, 0, 1);
+	check_flush("never", flush_never, 0, 0, 0);
+
+	FILE* file = tmpfile();
+	if (!file)
+	{
+		return;
+	}
+	{	// a line is written with no more writes after it, unflushed
+		async_fd_sink sink(fileno(file), 1 << 16, 2);
+		sink.flush_interval(std::chrono::milliseconds(1));
+		sink.write("first\n", 6);
+		long written = await_size(file, 6);
+		if (written != 6)
+		{
+			++failures;
+			std::cout << "flush_interval\t" << written
+					  << " bytes written before the sink was flushed, expected 6\n";
+		}
+	}
+	fclose(file);
+
+	file = tmpfile();
+	if (!file)
+	{
+		return;
+	}
+	{	// endl doesn't flush, so the new line stays in the sinkbuf, while
+		// the text passed on ahead of it is written
+		async_fd_sink sink(fileno(file), 1 << 16, 2);
+		sink.flush_interval(std::chrono::milliseconds(1));
+		sinkbuf<async_fd_sink> buf(sink);
+		std::ostream os(&buf);
+		oformatstream ofs(std::string("%s"), &os);
+		ofs.flush_policy(flush_explicit);
+		std::string line(300, 'x');
+		ofs << line.c_str() << endl;
+		long written = await_size(file, 300);
+		buf.pubsync();
+		long synced = file_size(file);
+		if (written != 300 || synced != 301)
+		{
+			++failures;
+			std::cout << "flush_interval\t" << written << " bytes of an endl line written"
+					  << " before the sinkbuf synced and " << synced
+					  << " after, expected 300 and 301\n";
+		}
+	}
+	fclose(file);
+}
+
+std::string statistics_problem(const char* name, const format_statistics& st,
+							   unsigned long long records, unsigned long long fields,
+							   unsigned long long bytes, unsigned long long reformats)
+{
+	if (st.records == records && st.fields == fields && st.bytes == bytes &&
+		st.reformats == reformats)
+	{
+		return std::string();
+	}
+	std::ostringstream out;
+	out << name << " counted " << st.records << " records " << st.fields << " fields "
+		<< st.bytes << " bytes " << st.reformats << " reformats, expected " << records
+		<< " " << fields << " " << bytes << " " << reformats;
+	return out.str();
+}
+
+// With OFORMAT_STATISTICS defined, what a stream outputs through a sink
+// is counted against the formatter it was given, and after reformat
+// against the new one.  format_batch's threads count against ofs's.
+void VerifyStatistics()
+{
+	if (!format_statistics::enabled)
+	{
+		return;
+	}
+	formatter a(std::string("%d %s\n")), b(std::string("[%5.1f|%c]\n"));
+	formatter c(std::string(";%d,%5x"));
+	counting_sink sink;
+	{
+		sinkbuf<counting_sink> buf(sink);
+		std::ostream os(&buf);
+		oformatstream ofs(a, &os);
+		for (int k = 0; k < 10; ++k)
+		{
+			ofs.put_record(k, "ab");
+		}
+		ofs << reformat(b);
+		for (int k = 0; k < 4; ++k)
+		{
+			ofs.put_record(2.5 * k, 'x');
+		}
+		int values[] = { 1, 20, 300, 4000, 50000, 600000 };
+		ofs << reformat(c) << std::span<int>(values);
+		buf.pubsync();
+	}
+	std::vector<std::tuple<int, const char*> > records(3000, std::make_tuple(7, "ab"));
+	std::ostringstream out;
+	oformatstream batch(a, &out);
+	format_batch(batch, records.begin(), records.end(), 3);
+	a(); a.next(); a.field(1);		// reading the fields is not an edit
+
+	std::string problem = statistics_problem("a", a.statistics(), 3010, 9030, 50 + out.str().size(), 0);
+	if (problem.empty())
+	{
+		problem = statistics_problem("b", b.statistics(), 4, 12, 40, 1);
+	}
+	if (problem.empty())
+	{
+		problem = statistics_problem("c", c.statistics(), 3, 6, sink.out.size() - 90, 1);
+	}
+	if (!problem.empty())
+	{
+		++failures;
+		std::cout << "statistics\t" << problem << "\n";
+	}
+}
+
+// Records in three formats, output directly to expected and kept in
+// records, whose strings don't outlast the loop.  Only records of more
+// than format_record_values values, or with a long name, need the heap.
+void capture_records(std::ostream& expected, const std::vector<formatter>& formats,
+					 std::vector<format_record>& records)
+{
+	oformatstream ofs(formats[0], &expected);
+	for (int n = 0; n < 300; ++n)
+	{
+		std::string name(n % 50 ? "frontend" :
+			"a name much too long for the text kept in the record itself, "
+			"which has to go on the heap");
+		name += char('a' + n % 26);
+		format_record rec(&formats[n % 3]);
+		ofs.formatter(formats[n % 3]);
+		switch (n % 3)
+		{
+		case 0:
+			rec << n * 37 << n / 8.0 << name.c_str() << char('A' + n % 26);
+			ofs.put_record(n * 37, n / 8.0, name.c_str(), char('A' + n % 26));
+			break;
+		case 1:
+			rec << (unsigned short)n << format_literal("literal") << (long long)-n << 1.5f
+				<< (const void*)&records << true;
+			ofs.put_record((unsigned short)n, "literal", (long long)-n, 1.5f,
+						   (const void*)&records, true);
+			break;
+		default:
+			rec << 6 << n << (unsigned long)n << n << n << n << n << n << n << n
+				<< (long double)n / 3 << name.c_str();
+			ofs.put_record(6, n, (unsigned long)n, n, n, n, n, n, n, n,
+						   (long double)n / 3, name.c_str());
+			break;
+		}
+		records.push_back(rec);
+		if (rec.on_heap() != (2 == n % 3 || (1 != n % 3 && 0 == n % 50)))
+		{
+			++failures;
+			std::cout << "format_record\t" << n << "\t"
+					  << (rec.on_heap() ? "on the heap" : "not on the heap") << "\n";
+		}
+	}
+}
+
+void VerifyRecords()
+{
+	std::vector<formatter> formats;
+	formats.push_back(formatter(std::string("%5d|%-8.3f|%s|%c\n")));
+	formats.push_back(formatter(std::string("%3$lld %1$hx [%2$s] %4$.2f %5$p %6$d\n")));
+	formats.push_back(formatter(std::string("%*d %d %lu %x %o %d %d %d %d %Lf %s\n")));
+	std::ostringstream expected;
+	std::vector<format_record> records;
+	capture_records(expected, formats, records);
+
+	std::ostringstream out;
+	std::thread writer([&out, &records]
+		{
+			oformatstream ofs(formatter(std::string("%s\n")), &out);
+			for (size_t n = 0; n < records.size(); ++n)
+			{
+				ofs.put_record(records[n]);
+			}
+		});
+	writer.join();
+	if (out.str() != expected.str())
+	{
+		++failures;
+		std::cout << "format_record\toutput differs from the values output directly\n";
+	}
+
+	std::wostringstream wexpected, wout;
+	wformatter wf(std::wstring(L"%d %s %c %s %c %c %c %s %s\n"));
+	woformatstream wofs(wf, &wexpected);
+	const signed char* sp = reinterpret_cast<const signed char*>("signed");
+	const unsigned char* up = reinterpret_cast<const unsigned char*>("unsigned");
+	wofs.put_record(42, L"wide", L'w', "narrow", 'n', (signed char)'s', (unsigned char)'u', sp, up);
+	wformat_record wrec(&wf);
+	wrec << 42 << L"wide" << L'w' << "narrow" << 'n' << (signed char)'s' << (unsigned char)'u'
+		 << sp << up;
+	woformatstream wofs2(wformatter(std::wstring(L"%s")), &wout);
+	wofs2.put_record(wrec);
+	if (wout.str() != wexpected.str())
+	{
+		++failures;
+		std::cout << "wformat_record\toutput differs from the values output directly\n";
+	}
+
+	std::ostringstream cexpected, cgot;
+	formatter cf(std::string("%c %c %s %s\n"));
+	oformatstream cofs(cf, &cexpected);
+	cofs.put_record((signed char)'s', (unsigned char)'u', sp, up);
+	format_record crec(&cf);
+	crec << (signed char)'s' << (unsigned char)'u' << sp << up;
+	oformatstream cofs2(formatter(std::string("%s")), &cgot);
+	cofs2.put_record(crec);
+	if (cgot.str() != cexpected.str())
+	{
+		++failures;
+		std::cout << "format_record\tsigned and unsigned chars differ from the values output directly\n";
+	}
+
+	// A stream whose copy of a record's format has been edited must take
+	// it again, and another formatter at the same address is another format.
+	std::ostringstream taken;
+	oformatstream tofs(formatter(std::string("%s\n")), &taken);
+	formatter f(std::string("<%d>\n"));
+	format_record frec(&f);
+	frec << 1;
+	tofs.put_record(frec);
+	tofs.formatter().field(0).width = 6;
+	tofs.put_record(frec);
+	const char* const specs[] = { "[%d]\n", "(%d)\n" };
+	for (int k = 0; k < 2; ++k)
+	{
+		formatter g((std::string(specs[k])));
+		format_record grec(&g);
+		grec << k;
+		tofs.put_record(grec);
+	}
+	if (taken.str() != "<1>\n<1>\n[0]\n(1)\n")
+	{
+		++failures;
+		std::cout << "format_record\tstale format, output [" << taken.str() << "]\n";
+	}
+
+	// Only a field that did change through a reference is an edit.
+	unsigned long long key = f.key();
+	f(); f.next(); f.field(1);
+	f.table();
+	bool kept = key == f.key();
+	f.field(0).width = 4;
+	formatter copied(f);
+	f.table();
+	copied.table();
+	if (!kept || key == f.key() || key == copied.key())
+	{
+		++failures;
+		std::cout << "format_record\tkey " << (kept ? "kept after an edit" : "changed by reading") << "\n";
+	}
+}
+
+// Strings are read into std::string, and output as their text
+template <typename T>
+const T& scanned(const T& v)
+{
+	return v;
+}
+
+const char* scanned(const std::string& v)
+{
+	return v.c_str();
+}
+
+// Read count records of the types in Values from text, and output them
+// again with spec, which should give text back.
+template <typename... Values>
+void check_scan(const std::string& spec, const std::string& text, int count)
+{
+	iformatstream ifs(spec, text.data(), text.data() + text.size());
+	std::ostringstream out;
+	oformatstream ofs(spec, &out);
+	ofs.classic(true);
+	std::tuple<Values...> v;
+	int n = 0;
+	for (; std::apply([&ifs](Values&... a) -> bool { return !!ifs.get_record(a...); }, v); ++n)
+	{
+		std::apply([&ofs](const Values&... a) { ofs.put_record(scanned(a)...); }, v);
+	}
+	if (n != count || !ifs.eof() || out.str() != text)
+	{
+		++failures;
+		std::cout << "iformatstream\t" << spec.substr(0, spec.size() - 1) << "\t" << n << " of " << count
+				  << " records read, stopped at " << (ifs.tell() - text.data())
+				  << (out.str() == text.substr(0, out.str().size()) ? "" : ", output differs")
+				  << "\n";
+	}
+}
+
+void VerifyScan()
+{
+	const int count = 500;
+	const char* const names[] = { "frontend", "db", "a much longer name", "" };
+	std::string spec[4];
+	std::ostringstream text[4];
+	spec[0] = "[%s] %5d|%-8.3f|%x\n";
+	spec[1] = "%+d %#o %#X %-6hd|%c|%10s|%-10s|%hhu\n";
+	spec[2] = "%08.2f %e %E %g %012lld %lu %5.1f%%\n";
+	spec[3] = "id=%d, took %9.3f ms, from %s\n";
+	for (int k = 0; k < 4; ++k)
+	{
+		oformatstream ofs(spec[k], &text[k]);
+		ofs.classic(true);
+		for (int n = 0; n < count; ++n)
+		{
+			int i = (n * 7919) ^ -(n & 1);
+			double d = (n - 250) * 1234.567 / 7.0;
+			switch (k)
+			{
+			case 0:
+				ofs.put_record(names[n % 4], i, d / 1000, unsigned(n * 2654435761U));
+				break;
+			case 1:
+				ofs.put_record(i, unsigned(n * 31), unsigned(n * 2654435761U), short(i),
+							   char('!' + n % 90), names[n % 4], names[(n + 1) % 4], n % 2);
+				break;
+			case 2:
+				ofs.put_record(d, d * 1e-9, d * 1e100, d / 3, i * 123456789LL,
+							   (unsigned long)n * 1000003, d / 100);
+				break;
+			default:
+				ofs.put_record(i * 100000003LL, d, names[n % 3]);
+				break;
+			}
+		}
+	}
+	check_scan<std::string, int, double, unsigned int>(spec[0], text[0].str(), count);
+	check_scan<int, unsigned int, unsigned int, short, char, std::string, std::string, bool>(
+		spec[1], text[1].str(), count);
+	check_scan<double, double, double, double, long long, unsigned long, double>(
+		spec[2], text[2].str(), count);
+	check_scan<long long, float, std::string>(spec[3], "id=-7, took     1.500 ms, from x\n", 1);
+	check_scan<long long, double, std::string>(spec[3], text[3].str(), count);
+
+	// a '*' width takes no value of its own
+	std::string star("  42|x\n");
+	iformatstream ifs(std::string("%*d|%s\n"), star.data(), star.data() + star.size());
+	int i = 0;
+	std::string_view name;
+	ifs.get_record(i, name);
+	if (!ifs || 42 != i || name != "x" || name.data() != star.data() + 5)
+	{
+		++failures;
+		std::cout << "iformatstream\t'*' width or string_view misread\n";
+	}
+
+	const char* const path = "oformat_verify.out";
+	FILE* file = fopen(path, "wb");
+	if (file)
+	{
+		fwrite(text[3].str().data(), 1, text[3].str().size(), file);
+		fclose(file);
+		{
+			format_mapped_file mapped(path);
+			if (!mapped.is_open() || mapped.size() != text[3].str().size() ||
+				std::string(mapped.data(), mapped.size()) != text[3].str())
+			{
+				++failures;
+				std::cout << "format_mapped_file\tmaps something else\n";
+			}
+		}
+		remove(path);
+	}
+
+	std::wostringstream wtext;
+	woformatstream wofs(std::wstring(L"%-6s=%+.3e;%d\n"), &wtext);
+	wofs.classic(true);
+	wofs.put_record(L"pi", 3.14159, 1);
+	wofs.put_record(L"large", -6.02e23, 2);
+	std::wstring w(wtext.str()), name1, name2;
+	double d1 = 0, d2 = 0;
+	int n1 = 0, n2 = 0;
+	wiformatstream wifs(std::wstring(L"%-6s=%+.3e;%d\n"), w.data(), w.data() + w.size());
+	wifs.get_record(name1, d1, n1).get_record(name2, d2, n2);
+	if (!wifs || !wifs.eof() || name1 != L"pi" || d1 != 3.142 || 1 != n1 ||
+		name2 != L"large" || d2 != -6.020e23 || 2 != n2)
+	{
+		++failures;
+		std::cout << "wiformatstream\twide records misread\n";
+	}
+}
+
+// Parse s and output a mix of every value type with it.
+// Returns the length of the output so the work can't be optimised away.
+size_t FuzzOne(const std::string& s)
+{
+	std::ostringstream out;
+	oformatstream ofs(s, &out);
+	size_t n = ofs.formatter().FieldCount() * 2 + 3;
+	for (size_t k = 0; k < n; ++k)
+	{
+		switch (k % 9)
+		{
+		case 0: ofs << int(k * 7919) - 40000; break;
+		case 1: ofs << double(k) / 3.0; break;
+		case 2: ofs << "str"; break;
+		case 3: ofs << char('a' + k % 26); break;
+		case 4: ofs << (unsigned long)k << -1L; break;
+		case 5: ofs << (long long)k * (LLONG_MAX / 9); break;
+		case 6: ofs << (const void*)&out; break;
+		case 7: ofs << 2; break;	// a plausible '*' width
+		default: ofs << setformat; break;
+		}
+	}
+	ofs << setformat;
+
+	std::wostringstream wout;
+	woformatstream wofs(widen(s), &wout);
+	wofs << 1 << 2.5 << L"w" << L'c' << setformat;
+	return out.str().size() + wout.str().size();
+}
+
+}	// namespace
+
+// Returns the number of differences found
+int VerifyFormat()
+{
+	failures = 0;
+	VerifyIntegers();
+	VerifyFloating();
+	VerifyCharacters();
+	VerifyParser();
+	VerifyCatalog();
+	VerifyEdits();
+	VerifyDefaultSpecification();
+	VerifySinks();
+	VerifyUtf8();
+	VerifyMeasure();
+	VerifyBatch();
+	VerifyCoroutine();
+	VerifyFlush();
+	VerifyStatistics();
+	VerifyRecords();
+	VerifyScan();
+	if (failures > 50)
+	{
+		std::cout << "...\n";
+	}
+	std::cout << "VERIFY " << failures << " differences\n";
+	return failures;
+}
+
+void FuzzFormat(int iterations)
+{
+	const char alphabet[] = "%%%%-+ #0123456789.*$lhLI{}dciouxXeEfgGpsn ab\n";
+	unsigned int seed = 20011106;
+	size_t total = 0;
+	for (int n = 0; n < iterations; ++n)
+	{
+		seed = seed * 1103515245 + 12345;
+		std::string s((seed >> 16) % 24, ' ');
+		for (size_t k = 0; k < s.size(); ++k)
+		{
+			seed = seed * 1103515245 + 12345;
+			s[k] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+		}
+		total += FuzzOne(s);
+	}
+	std::cout << "FUZZ " << iterations << " formats, " << total << " characters\n";
+}
+
+#if defined(OFORMAT_FUZZER)
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size)
+{
+	FuzzOne(std::string(reinterpret_cast<const char*>(data), size));
+	return 0;
+}
+#endif
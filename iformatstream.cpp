@@ -0,0 +1,102 @@
+#include "stdafx.h"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "iformatstream.hpp"
+
+#if defined(_WIN32)
+
+format_mapped_file::format_mapped_file(const char* path)
+	: _Data(NULL), _Size(0), _Open(false)
+{
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+							  FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (INVALID_HANDLE_VALUE == file)
+	{
+		return;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return;
+	}
+	if (!size.QuadPart)
+	{
+		_Open = true;
+	}
+	else
+	{	// the view keeps the file and its mapping open
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			_Data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+		if (_Data)
+		{
+			_Size = static_cast<size_t>(size.QuadPart);
+			_Open = true;
+		}
+	}
+	CloseHandle(file);
+}
+
+format_mapped_file::~format_mapped_file()
+{
+	if (_Data)
+	{
+		UnmapViewOfFile(_Data);
+	}
+}
+
+#else
+
+format_mapped_file::format_mapped_file(const char* path)
+	: _Data(NULL), _Size(0), _Open(false)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st))
+	{
+		close(fd);
+		return;
+	}
+	if (!st.st_size)
+	{
+		_Open = true;
+	}
+	else
+	{	// the mapping keeps the file open
+		void* p = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED != p)
+		{
+			_Data = p;
+			_Size = static_cast<size_t>(st.st_size);
+			_Open = true;
+			madvise(_Data, _Size, MADV_SEQUENTIAL);
+		}
+	}
+	close(fd);
+}
+
+format_mapped_file::~format_mapped_file()
+{
+	if (_Data)
+	{
+		munmap(_Data, _Size);
+	}
+}
+
+#endif
@@ -0,0 +1,584 @@
+//
+// iformatstream.hpp
+//
+//
+// Comments: reading basic_oformatstream output back into values
+//
+// basic_iformatstream scans records written by a basic_oformatstream with
+// the same format, from characters already in memory, eg. a file mapped
+// by format_mapped_file, without copying them.  It walks the same packed
+// field table the output did: each field's literal text is compared as
+// a block, and each value parsed as its field laid it out, in its base,
+// with its fill, sign and prefix.  Runs of eight decimal digits are
+// converted at once.
+//
+// Example usage:
+//
+// format_mapped_file file("requests.log");
+// iformatstream ifs(std::string("[%s] %5d|%-8.3f\n"), file.data(), file.data() + file.size());
+// std::string_view name;					// points into the file
+// int id;
+// double took;
+// while (ifs.get_record(name, id, took))
+// 	...
+// if (!ifs.eof())
+// 	...									// the record at ifs.tell() didn't match
+//
+// The output should have been written in classic mode, or in a locale
+// that neither groups digits nor changes the decimal point.
+// A string runs up to the next field's text, so it mustn't contain that
+// text itself, or across its width if the next field has no text.
+// bool is read as the 0 or 1 it is written as.  Positional formats are
+// not read, and '*' widths and precisions aren't recovered: such a field
+// is read as having no width, and takes no value of its own.
+//
+//
+
+#ifndef _iformatstream_
+#define _iformatstream_
+
+#include <ctype.h>
+#include <string.h>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "oformatstream.hpp"
+
+//------------------------------------------------------
+// scan_eight_digits
+// The value of the eight decimal digits at p, converted together as one
+// 64 bit word.  Returns false if they aren't all digits.
+//------------------------------------------------------
+inline bool scan_eight_digits(const char* p, std::uint32_t& v)
+{
+	std::uint64_t x;
+	memcpy(&x, p, 8);
+	if (((x & 0xF0F0F0F0F0F0F0F0ULL) |
+		 (((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) !=
+		0x3333333333333333ULL)
+	{
+		return false;
+	}
+	x -= 0x3030303030303030ULL;
+	x = x * 10 + (x >> 8);	// pairs of digits
+	x = (((x & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+		 (((x >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+	v = static_cast<std::uint32_t>(x);
+	return true;
+}
+
+//------------------------------------------------------
+// scan_digits
+// Converts the digits in base 8, 10 or 16 from s up to e, whichever case
+// the letters are, to u.  Returns the end of the digits, or NULL if
+// there are none or their value doesn't fit in u.
+//------------------------------------------------------
+template <typename _E>
+const _E* scan_digits(const _E* s, const _E* e, int base, unsigned long long& u)
+{
+	const _E* first = s;
+	unsigned long long v = 0;
+	if (10 == base)
+	{
+		if constexpr (sizeof(_E) == 1 && std::endian::native == std::endian::little)
+		{
+			std::uint32_t eight;
+			while (e - s >= 8 && scan_eight_digits(reinterpret_cast<const char*>(s), eight))
+			{
+				if (v > (ULLONG_MAX - eight) / 100000000ULL)
+				{
+					return NULL;
+				}
+				v = v * 100000000ULL + eight;
+				s += 8;
+			}
+		}
+		for (; s != e; ++s)
+		{
+			unsigned int d = static_cast<unsigned int>(*s) - '0';
+			if (d > 9)
+			{
+				break;
+			}
+			if (v > (ULLONG_MAX - d) / 10)
+			{
+				return NULL;
+			}
+			v = v * 10 + d;
+		}
+	}
+	else
+	{
+		const int shift = 16 == base ? 4 : 3;
+		for (; s != e; ++s)
+		{
+			unsigned int c = static_cast<unsigned int>(*s), d;
+			if (c - '0' <= 9)
+			{
+				d = c - '0';
+			}
+			else if ((c | 0x20) - 'a' <= 5)
+			{
+				d = (c | 0x20) - 'a' + 10;
+			}
+			else
+			{
+				break;
+			}
+			if (d >= static_cast<unsigned int>(base))
+			{
+				break;
+			}
+			if (v >> (64 - shift))
+			{
+				return NULL;
+			}
+			v = (v << shift) | d;
+		}
+	}
+	if (s == first)
+	{
+		return NULL;
+	}
+	u = v;
+	return s;
+}
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_iformatstream
+// Reads values from [first, last), which must stay valid while it is
+// read, as a basic_oformatstream with the same format wrote them.
+// Each value is taken from the next field, cycling through the field
+// table as the output did.  Once a field fails to match, fail() is true
+// and nothing more is read until clear(), tell() being where it failed.
+//------------------------------------------------------
+template <typename _E, typename _Tr = std::char_traits<_E> >
+class basic_iformatstream
+{
+public:
+	typedef basic_iformatstream<_E,_Tr> _Myt;
+	typedef basic_formatter<_E,_Tr> formatter_type;
+	typedef typename formatter_type::table_type table_type;
+	typedef typename formatter_type::size_type size_type;
+	typedef std::basic_string_view<_E,_Tr> view_type;
+
+	basic_iformatstream(const std::basic_string<_E,_Tr>& s, const _E* first, const _E* last)
+		: _Format(s), _Next(first), _Last(last), _N(0), _Fail(false)
+	{
+		_Pad = _Format.default_format_specification().width;
+		_Fail = _Format.positional();
+	}
+
+	basic_iformatstream(const formatter_type& f, const _E* first, const _E* last)
+		: _Format(f), _Next(first), _Last(last), _N(0), _Fail(false)
+	{
+		_Pad = _Format.default_format_specification().width;
+		_Fail = _Format.positional();
+	}
+
+	// Read on with another format, from its first field
+	void formatter(const formatter_type& f)
+	{
+		_Format = f; _N = 0;
+		_Pad = _Format.default_format_specification().width;
+		_Fail = _Fail || _Format.positional();
+	}
+
+	const formatter_type& formatter() const
+	{ return _Format; }
+
+	// The next character to read
+	const _E* tell() const
+	{ return _Next; }
+
+	// The field the next value is read from
+	size_type field() const
+	{ return _N; }
+
+	bool eof() const
+	{ return _Next == _Last; }
+
+	bool fail() const
+	{ return _Fail; }
+
+	explicit operator bool() const
+	{ return !_Fail; }
+
+	void clear()
+	{ _Fail = _Format.positional(); }
+
+	// Move past the next new line and start again at the first field,
+	// eg. to carry on after a record that didn't match.
+	void skip_line()
+	{
+		const _E nl = static_cast<_E>('\n');
+		while (_Next != _Last && !_Tr::eq(*_Next++, nl))
+		{
+		}
+		_N = 0;
+		clear();
+	}
+
+	// RECORDS
+	// Read args as one whole record, then the text of the fields after
+	// them, the reverse of basic_oformatstream::put_record().
+	template <typename... _Args>
+	_Myt& get_record(_Args&... args)
+		{if constexpr (sizeof...(_Args) != 0)
+			(*this >> ... >> args);
+		while (_N && !_Fail)
+			match_field_text();
+		return (*this); }
+
+	// Read the current field's literal text and move on to the next
+	// field without a value, the reverse of put_field_text().
+	void match_field_text()
+	{
+		format_plan<_E,_Tr> p;
+		if (begin_field(p))
+		{
+			next();
+		}
+	}
+
+	// EXTRACTORS
+	_Myt& operator>>(bool& _X)
+		{long v = 0; *this >> v; if (!_Fail) _X = 0 != v; return (*this); }
+	_Myt& operator>>(short& _X)
+		{return get_integer(_X); }
+	_Myt& operator>>(unsigned short& _X)
+		{return get_integer(_X); }
+	_Myt& operator>>(int& _X)
+		{return get_integer(_X); }
+	_Myt& operator>>(unsigned int& _X)
+		{return get_integer(_X); }
+	_Myt& operator>>(long& _X)
+		{return get_integer(_X); }
+	_Myt& operator>>(unsigned long& _X)
+		{return get_integer(_X); }
+	_Myt& operator>>(long long& _X)
+		{return get_integer(_X); }
+	_Myt& operator>>(unsigned long long& _X)
+		{return get_integer(_X); }
+	_Myt& operator>>(float& _X)
+		{return get_floating(_X); }
+	_Myt& operator>>(double& _X)
+		{return get_floating(_X); }
+	_Myt& operator>>(long double& _X)
+		{return get_floating(_X); }
+
+	// A character and the fill around it
+	_Myt& operator>>(_E& _X)
+		{format_plan<_E,_Tr> p;
+		if (!begin_field(p))
+			return (*this);
+		size_t w = p.width > 1 ? static_cast<size_t>(p.width) : 1;
+		if (static_cast<size_t>(_Last - _Next) < w)
+			return (failed());
+		_X = format_plan<_E,_Tr>::left == p.adjust ? _Next[0] : _Next[w - 1];
+		_Next += w;
+		next();
+		return (*this); }
+
+	// A string, pointing into the input rather than copied
+	_Myt& operator>>(view_type& _X)
+		{format_plan<_E,_Tr> p;
+		if (!begin_field(p))
+			return (*this);
+		_X = get_string(p);
+		return (*this); }
+
+	_Myt& operator>>(std::basic_string<_E,_Tr>& _X)
+		{format_plan<_E,_Tr> p;
+		if (!begin_field(p))
+			return (*this);
+		view_type v = get_string(p);
+		_X.assign(v.data(), v.size());
+		return (*this); }
+
+private:
+	// Plan the current field and match its text.  A '*' width is unknown.
+	bool begin_field(format_plan<_E,_Tr>& p)
+	{
+		if (_Fail)
+		{
+			return false;
+		}
+		const table_type& t = _Format.table();
+		if (!p.set(t, _N) && t.widtharg(_N))
+		{
+			p.width = 0;
+		}
+		if (!match_text(p.text, p.textlen))
+		{
+			failed();
+			return false;
+		}
+		return true;
+	}
+
+	// Literal text, with any blanks it was padded with to the default
+	// format's width, see basic_oformatstream::put_text()
+	bool match_text(const _E* text, size_t len)
+	{
+		const _E* s = _Next;
+		std::streamsize pad = (len && _Pad > static_cast<std::streamsize>(len)) ?
+			_Pad - static_cast<std::streamsize>(len) : 0;
+		const _E blank = static_cast<_E>(' ');
+		for (; pad && s != _Last && _Tr::eq(*s, blank); --pad)
+		{
+			++s;
+		}
+		if (static_cast<size_t>(_Last - s) < len || _Tr::compare(s, text, len))
+		{
+			return false;
+		}
+		for (s += len; pad && s != _Last && _Tr::eq(*s, blank); --pad)
+		{
+			++s;
+		}
+		_Next = s;
+		return true;
+	}
+
+	// Skip the fill before a value laid out as adjust.  A '0' fill is
+	// left for the digits.
+	void skip_fill(const _E*& s, const format_plan<_E,_Tr>& p,
+				   typename format_plan<_E,_Tr>::adjustment adjust)
+	{
+		if (adjust == p.adjust && !_Tr::eq(p.fill, static_cast<_E>('0')))
+		{
+			while (s != _Last && _Tr::eq(*s, p.fill))
+			{
+				++s;
+			}
+		}
+	}
+
+	// Skip the fill after a left adjusted value, as far as its width
+	void end_field(const _E* first, const _E* s, const format_plan<_E,_Tr>& p)
+	{
+		if (format_plan<_E,_Tr>::left == p.adjust)
+		{
+			while (s - first < p.width && s != _Last && _Tr::eq(*s, p.fill))
+			{
+				++s;
+			}
+		}
+		_Next = s;
+		next();
+	}
+
+	template <typename _Ty>
+	_Myt& get_integer(_Ty& _X)
+	{
+		typedef typename std::make_unsigned<_Ty>::type _Uty;
+		format_plan<_E,_Tr> p;
+		if (!begin_field(p))
+		{
+			return (*this);
+		}
+		const _E* first = _Next;
+		const _E* s = first;
+		skip_fill(s, p, format_plan<_E,_Tr>::right);
+		bool neg = false;
+		if (s != _Last && (_Tr::eq(*s, static_cast<_E>('-')) || _Tr::eq(*s, static_cast<_E>('+'))))
+		{
+			neg = _Tr::eq(*s++, static_cast<_E>('-'));
+		}
+		if (p.showbase && 16 == p.base && _Last - s > 2 && _Tr::eq(s[0], static_cast<_E>('0')) &&
+			(_Tr::eq(s[1], static_cast<_E>('x')) || _Tr::eq(s[1], static_cast<_E>('X'))))
+		{
+			s += 2;
+		}
+		skip_fill(s, p, format_plan<_E,_Tr>::internal);
+		unsigned long long u;
+		s = scan_digits(s, _Last, p.base, u);
+		if (!s || u > std::numeric_limits<_Uty>::max())
+		{
+			return (failed());
+		}
+		if constexpr (std::is_signed<_Ty>::value)
+		{
+			// decimal is signed, but octal and hex are the unsigned bits
+			const unsigned long long max = static_cast<unsigned long long>(
+				std::numeric_limits<_Ty>::max());
+			if (10 == p.base && u > max + (neg ? 1 : 0))
+			{
+				return (failed());
+			}
+			_X = static_cast<_Ty>(neg ? 0 - static_cast<_Uty>(u) : static_cast<_Uty>(u));
+		}
+		else
+		{
+			if (neg && u)
+			{
+				return (failed());
+			}
+			_X = static_cast<_Ty>(u);
+		}
+		end_field(first, s, p);
+		return (*this);
+	}
+
+	template <typename _Ty>
+	_Myt& get_floating(_Ty& _X)
+	{
+		format_plan<_E,_Tr> p;
+		if (!begin_field(p))
+		{
+			return (*this);
+		}
+		const _E* first = _Next;
+		const _E* s = first;
+		skip_fill(s, p, format_plan<_E,_Tr>::right);
+		bool neg = false;
+		if (s != _Last && (_Tr::eq(*s, static_cast<_E>('-')) || _Tr::eq(*s, static_cast<_E>('+'))))
+		{
+			neg = _Tr::eq(*s++, static_cast<_E>('-'));
+		}
+		skip_fill(s, p, format_plan<_E,_Tr>::internal);
+		_Ty v;
+		std::from_chars_result r;
+		if constexpr (sizeof(_E) == 1)
+		{
+			const char* c = reinterpret_cast<const char*>(s);
+			r = std::from_chars(c, c + (_Last - s), v);
+			s += r.ptr - c;
+		}
+		else
+		{	// the characters of a number are all ASCII
+			char buf[128];
+			size_t n = 0;
+			for (; n < sizeof(buf) && s + n != _Last; ++n)
+			{
+				unsigned int c = static_cast<unsigned int>(s[n]);
+				if (c >= 0x80 || !(isalnum(c) || '.' == c || '+' == c || '-' == c))
+				{
+					break;
+				}
+				buf[n] = static_cast<char>(c);
+			}
+			r = std::from_chars(buf, buf + n, v);
+			s += r.ptr - buf;
+		}
+		if (std::errc() != r.ec)
+		{
+			return (failed());
+		}
+		_X = neg ? -v : v;
+		end_field(first, s, p);
+		return (*this);
+	}
+
+	// Up to the next field's text and the blanks it was padded with,
+	// or across the width if it has none, less the fill of a value that
+	// was shorter than its width.
+	view_type get_string(const format_plan<_E,_Tr>& p)
+	{
+		const table_type& t = _Format.table();
+		size_type m = _N + 1 < t.size() ? _N + 1 : 0;
+		const _E* s = _Next;
+		const _E* e = _Last;
+		size_t len = t.text_size(m);
+		if (len)
+		{
+			size_t at = view_type(s, _Last - s).find(view_type(t.text(m), len));
+			if (view_type::npos != at)
+			{
+				e = s + at;
+				std::streamsize pad = _Pad > static_cast<std::streamsize>(len) ?
+					_Pad - static_cast<std::streamsize>(len) : 0;
+				for (; pad && e != s && _Tr::eq(e[-1], static_cast<_E>(' ')); --pad)
+				{
+					--e;
+				}
+			}
+		}
+		else if (p.width > 1 && _Last - s > p.width)
+		{
+			e = s + p.width;
+		}
+		_Next = e;
+		next();
+		if (p.width > 1 && e - s == p.width)
+		{
+			if (format_plan<_E,_Tr>::left == p.adjust)
+			{
+				while (e != s && _Tr::eq(e[-1], p.fill))
+				{
+					--e;
+				}
+			}
+			else
+			{
+				while (s != e && _Tr::eq(*s, p.fill))
+				{
+					++s;
+				}
+			}
+		}
+		return view_type(s, e - s);
+	}
+
+	_Myt& failed()
+	{
+		_Fail = true;
+		return (*this);
+	}
+
+	void next()
+	{
+		if (++_N >= _Format.table().size())
+		{
+			_N = 0;
+		}
+	}
+
+	formatter_type _Format;
+	const _E* _Next;
+	const _E* _Last;
+	size_type _N;
+	std::streamsize _Pad;	// the default format's width, which text is padded to
+	bool _Fail;
+};
+
+typedef basic_iformatstream<char, std::char_traits<char> > iformatstream;
+typedef basic_iformatstream<wchar_t, std::char_traits<wchar_t> > wiformatstream;
+
+//------------------------------------------------------
+// CLASS format_mapped_file
+// A file mapped read only into memory, for a basic_iformatstream to read
+// without copying it into a buffer first.  The operating system is told
+// it will be read in order.  An empty file maps to an empty range.
+//------------------------------------------------------
+class format_mapped_file
+{
+public:
+	explicit format_mapped_file(const char* path);
+	~format_mapped_file();
+
+	// False if the file couldn't be opened or mapped
+	bool is_open() const
+	{ return _Open; }
+
+	const char* data() const
+	{ return _Data ? static_cast<const char*>(_Data) : ""; }
+
+	size_t size() const
+	{ return _Size; }
+
+private:
+	format_mapped_file(const format_mapped_file&);
+	format_mapped_file& operator=(const format_mapped_file&);
+
+	void* _Data;
+	size_t _Size;
+	bool _Open;
+};
+
+#endif // _iformatstream_
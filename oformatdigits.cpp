@@ -0,0 +1,310 @@
+#include "stdafx.h"
+
+#include <string.h>
+#include "oformatdigits.hpp"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define DIGITS_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define DIGITS_TARGET_SSE2
+#define DIGITS_TARGET_AVX2
+#else
+#define DIGITS_TARGET_SSE2	__attribute__((target("sse2")))
+#define DIGITS_TARGET_AVX2	__attribute__((target("avx2")))
+#endif
+#endif
+
+//------------------------------------------------------
+// Plain C++ kernels, always available
+//------------------------------------------------------
+static void dec_scalar(const unsigned int* v, char* out)
+{
+	for (int i = 0; i < digits_batch; ++i)
+	{
+		unsigned int u = v[i];
+		char* p = out + (i + 1) * digits_dec_width;
+		for (int k = 0; k < digits_dec_width; ++k)
+		{
+			*--p = char('0' + u % 10);
+			u /= 10;
+		}
+	}
+}
+
+static void hex_scalar(const unsigned int* v, char* out, bool upper)
+{
+	const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	for (int i = 0; i < digits_batch; ++i)
+	{
+		unsigned int u = v[i];
+		char* p = out + (i + 1) * digits_hex_width;
+		for (int k = 0; k < digits_hex_width; ++k)
+		{
+			*--p = digits[u & 0xF];
+			u >>= 4;
+		}
+	}
+}
+
+#if defined(DIGITS_X86)
+
+// The vector kernels produce one digit of every value per step, least
+// significant first.  Each digit is shifted into place in a 32 bit word
+// holding 4 characters of its value, so w[g][i] holds characters
+// [width - 4 * (g + 1), width - 4 * g) of value i, in memory order.
+// The words are then copied out value by value.
+static inline int digit_shift(int k, int width)
+{
+	int group = (k / 4 == (width - 1) / 4) ? width - 4 * (k / 4) : 4;
+	return 8 * (group - 1 - k % 4);
+}
+
+static inline void copy_words(const unsigned int (&w)[3][digits_batch],
+							  int width, char* out)
+{
+	for (int i = 0; i < digits_batch; ++i)
+	{
+		char* p = out + (i + 1) * width;
+		for (int g = 0; 4 * g < width; ++g)
+		{
+			int n = width - 4 * g < 4 ? width - 4 * g : 4;
+			p -= n;
+			memcpy(p, &w[g][i], n);
+		}
+	}
+}
+
+//------------------------------------------------------
+// SSE2 kernels, 4 values per register
+//------------------------------------------------------
+
+// x / 10 for each unsigned 32 bit lane, as (x * 0xCCCCCCCD) >> 35
+DIGITS_TARGET_SSE2
+static inline __m128i div10_sse2(__m128i x)
+{
+	const __m128i m = _mm_set1_epi32((int)0xCCCCCCCD);
+	__m128i even = _mm_srli_epi64(_mm_mul_epu32(x, m), 35);
+	__m128i odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), m), 35);
+	return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+DIGITS_TARGET_SSE2
+static void dec_sse2(const unsigned int* v, char* out)
+{
+	alignas(16) unsigned int w[3][digits_batch];
+	const __m128i zero = _mm_set1_epi32('0');
+	for (int h = 0; h < digits_batch; h += 4)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + h));
+		__m128i word = _mm_setzero_si128();
+		for (int k = 0; k < digits_dec_width; ++k)
+		{
+			__m128i q = div10_sse2(x);
+			__m128i q10 = _mm_add_epi32(_mm_slli_epi32(q, 3), _mm_slli_epi32(q, 1));
+			__m128i digit = _mm_add_epi32(_mm_sub_epi32(x, q10), zero);
+			__m128i shift = _mm_cvtsi32_si128(digit_shift(k, digits_dec_width));
+			word = _mm_or_si128(word, _mm_sll_epi32(digit, shift));
+			if (3 == k % 4 || digits_dec_width - 1 == k)
+			{
+				_mm_store_si128(reinterpret_cast<__m128i*>(&w[k / 4][h]), word);
+				word = _mm_setzero_si128();
+			}
+			x = q;
+		}
+	}
+	copy_words(w, digits_dec_width, out);
+}
+
+DIGITS_TARGET_SSE2
+static void hex_sse2(const unsigned int* v, char* out, bool upper)
+{
+	alignas(16) unsigned int w[3][digits_batch];
+	const __m128i mask = _mm_set1_epi32(0xF);
+	const __m128i nine = _mm_set1_epi32(9);
+	const __m128i zero = _mm_set1_epi32('0');
+	const __m128i alpha = _mm_set1_epi32((upper ? 'A' : 'a') - '0' - 10);
+	for (int h = 0; h < digits_batch; h += 4)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + h));
+		__m128i word = _mm_setzero_si128();
+		for (int k = 0; k < digits_hex_width; ++k)
+		{
+			__m128i nib = _mm_and_si128(x, mask);
+			__m128i over = _mm_and_si128(_mm_cmpgt_epi32(nib, nine), alpha);
+			__m128i digit = _mm_add_epi32(_mm_add_epi32(nib, zero), over);
+			__m128i shift = _mm_cvtsi32_si128(digit_shift(k, digits_hex_width));
+			word = _mm_or_si128(word, _mm_sll_epi32(digit, shift));
+			if (3 == k % 4)
+			{
+				_mm_store_si128(reinterpret_cast<__m128i*>(&w[k / 4][h]), word);
+				word = _mm_setzero_si128();
+			}
+			x = _mm_srli_epi32(x, 4);
+		}
+	}
+	copy_words(w, digits_hex_width, out);
+}
+
+//------------------------------------------------------
+// AVX2 kernels, all 8 values in one register
+//------------------------------------------------------
+
+DIGITS_TARGET_AVX2
+static inline __m256i div10_avx2(__m256i x)
+{
+	const __m256i m = _mm256_set1_epi32((int)0xCCCCCCCD);
+	__m256i even = _mm256_srli_epi64(_mm256_mul_epu32(x, m), 35);
+	__m256i odd = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), m), 35);
+	return _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+}
+
+DIGITS_TARGET_AVX2
+static void dec_avx2(const unsigned int* v, char* out)
+{
+	alignas(32) unsigned int w[3][digits_batch];
+	const __m256i zero = _mm256_set1_epi32('0');
+	__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v));
+	__m256i word = _mm256_setzero_si256();
+	for (int k = 0; k < digits_dec_width; ++k)
+	{
+		__m256i q = div10_avx2(x);
+		__m256i q10 = _mm256_add_epi32(_mm256_slli_epi32(q, 3), _mm256_slli_epi32(q, 1));
+		__m256i digit = _mm256_add_epi32(_mm256_sub_epi32(x, q10), zero);
+		__m128i shift = _mm_cvtsi32_si128(digit_shift(k, digits_dec_width));
+		word = _mm256_or_si256(word, _mm256_sll_epi32(digit, shift));
+		if (3 == k % 4 || digits_dec_width - 1 == k)
+		{
+			_mm256_store_si256(reinterpret_cast<__m256i*>(w[k / 4]), word);
+			word = _mm256_setzero_si256();
+		}
+		x = q;
+	}
+	copy_words(w, digits_dec_width, out);
+}
+
+DIGITS_TARGET_AVX2
+static void hex_avx2(const unsigned int* v, char* out, bool upper)
+{
+	alignas(32) unsigned int w[3][digits_batch];
+	const __m256i mask = _mm256_set1_epi32(0xF);
+	const __m256i nine = _mm256_set1_epi32(9);
+	const __m256i zero = _mm256_set1_epi32('0');
+	const __m256i alpha = _mm256_set1_epi32((upper ? 'A' : 'a') - '0' - 10);
+	__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v));
+	__m256i word = _mm256_setzero_si256();
+	for (int k = 0; k < digits_hex_width; ++k)
+	{
+		__m256i nib = _mm256_and_si256(x, mask);
+		__m256i over = _mm256_and_si256(_mm256_cmpgt_epi32(nib, nine), alpha);
+		__m256i digit = _mm256_add_epi32(_mm256_add_epi32(nib, zero), over);
+		__m128i shift = _mm_cvtsi32_si128(digit_shift(k, digits_hex_width));
+		word = _mm256_or_si256(word, _mm256_sll_epi32(digit, shift));
+		if (3 == k % 4)
+		{
+			_mm256_store_si256(reinterpret_cast<__m256i*>(w[k / 4]), word);
+			word = _mm256_setzero_si256();
+		}
+		x = _mm256_srli_epi32(x, 4);
+	}
+	copy_words(w, digits_hex_width, out);
+}
+
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuid(r, 0);
+	if (r[0] < 7) return false;
+	__cpuid(r, 1);
+	const int osxsave = 1 << 27, avx = 1 << 28;
+	if ((r[2] & (osxsave | avx)) != (osxsave | avx)) return false;
+	if ((_xgetbv(0) & 6) != 6) return false;	// OS saves the YMM registers
+	__cpuidex(r, 7, 0);
+	return (r[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static bool cpu_has_sse2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	return true;
+#elif defined(_MSC_VER)
+	int r[4];
+	__cpuid(r, 1);
+	return (r[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports("sse2") != 0;
+#endif
+}
+
+#endif	// DIGITS_X86
+
+//------------------------------------------------------
+// Kernel selection
+//------------------------------------------------------
+typedef void (*dec_kernel)(const unsigned int*, char*);
+typedef void (*hex_kernel)(const unsigned int*, char*, bool);
+
+static digits_isa detect_isa()
+{
+#if defined(DIGITS_X86)
+	if (cpu_has_avx2()) return digits_avx2;
+	if (cpu_has_sse2()) return digits_sse2;
+#endif
+	return digits_scalar;
+}
+
+static digits_isa& current_isa()
+{
+	static digits_isa isa = digits_best_isa();
+	return isa;
+}
+
+static dec_kernel dec_kernels[] = {
+	&dec_scalar,
+#if defined(DIGITS_X86)
+	&dec_sse2,
+	&dec_avx2
+#endif
+};
+
+static hex_kernel hex_kernels[] = {
+	&hex_scalar,
+#if defined(DIGITS_X86)
+	&hex_sse2,
+	&hex_avx2
+#endif
+};
+
+digits_isa digits_best_isa()
+{
+	static const digits_isa best = detect_isa();
+	return best;
+}
+
+digits_isa digits_current_isa()
+{
+	return current_isa();
+}
+
+digits_isa digits_use_isa(digits_isa isa)
+{
+	digits_isa previous = current_isa();
+	current_isa() = isa < digits_best_isa() ? isa : digits_best_isa();
+	return previous;
+}
+
+void digits_dec(const unsigned int* v, char* out)
+{
+	(*dec_kernels[current_isa()])(v, out);
+}
+
+void digits_hex(const unsigned int* v, char* out, bool upper)
+{
+	(*hex_kernels[current_isa()])(v, out, upper);
+}
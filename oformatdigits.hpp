@@ -0,0 +1,53 @@
+//
+// oformatdigits.hpp
+//
+//
+// Comments: batched integer to digit conversion
+//
+// Used by the bulk inserters of basic_oformatstream when every field of the
+// format shares the same base.  digits_batch values are converted at once
+// into fixed width, zero padded digit strings; the caller then trims the
+// leading zeros and lays out each value for its own field.
+//
+// The kernel is chosen at run time from the best instruction set the
+// processor supports (AVX2, then SSE2, then plain C++).
+// digits_use_isa() selects a lesser one, eg. to compare them in a benchmark.
+//
+//
+
+#ifndef _oformatdigits_
+#define _oformatdigits_
+
+// Number of values converted by each call
+const int digits_batch = 8;
+
+// Width of each value's digits in the output of digits_dec / digits_hex
+const int digits_dec_width = 10;
+const int digits_hex_width = 8;
+
+enum digits_isa
+{
+	digits_scalar,
+	digits_sse2,
+	digits_avx2
+};
+
+// The best kernel this processor supports
+digits_isa digits_best_isa();
+
+// The kernel currently in use
+digits_isa digits_current_isa();
+
+// Use the given kernel, or the best supported if that is less.
+// Returns the kernel previously in use.
+digits_isa digits_use_isa(digits_isa isa);
+
+// Convert v[0..digits_batch) to digits_dec_width decimal digits each.
+// Value i is written to out[i * digits_dec_width] onwards.
+void digits_dec(const unsigned int* v, char* out);
+
+// Convert v[0..digits_batch) to digits_hex_width hexadecimal digits each.
+// Value i is written to out[i * digits_hex_width] onwards.
+void digits_hex(const unsigned int* v, char* out, bool upper);
+
+#endif	// _oformatdigits_
@@ -0,0 +1,845 @@
+#include "stdafx.h"
+
+#include <errno.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+#include <chrono>
+#include "oformatsink.hpp"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SINK_X86
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#define SINK_TARGET_SSE2
+#else
+#define SINK_TARGET_SSE2	__attribute__((target("sse2")))
+#endif
+#endif
+
+// Write all n bytes at p to fd, resuming after partial writes and signals.
+// Returns false on error.
+static bool write_all(int fd, const char* p, size_t n)
+{
+	while (n)
+	{
+#if defined(_WIN32)
+		unsigned int chunk = n > 0x40000000 ? 0x40000000 : static_cast<unsigned int>(n);
+		int done = _write(fd, p, chunk);
+#else
+		ssize_t done = ::write(fd, p, n);
+#endif
+		if (done < 0)
+		{
+			if (EINTR != errno)
+			{
+				return false;
+			}
+			continue;
+		}
+		p += done;
+		n -= done;
+	}
+	return true;
+}
+
+static bool sync_data(int fd)
+{
+#if defined(_WIN32)
+	return 0 == _commit(fd);
+#elif defined(__APPLE__)
+	return 0 == fsync(fd);
+#else
+	return 0 == fdatasync(fd);
+#endif
+}
+
+#if defined(_WIN32)
+
+bool fd_sink::flush()
+{
+	for (size_t n = 0; n < _Spans && _Ok; ++n)
+	{
+		_Ok = write_all(_Fd, _Base[n], _Length[n]);
+	}
+	_Spans = _Used = 0;
+	return _Ok;
+}
+
+#else
+
+bool fd_sink::flush()
+{
+	struct iovec iov[fd_sink_spans];
+	size_t n, first(0);
+	for (n = 0; n < _Spans; ++n)
+	{
+		iov[n].iov_base = const_cast<char*>(_Base[n]);
+		iov[n].iov_len = _Length[n];
+	}
+	while (first < _Spans && _Ok)
+	{
+		ssize_t done = writev(_Fd, iov + first, static_cast<int>(_Spans - first));
+		if (done < 0)
+		{
+			_Ok = (EINTR == errno);
+			continue;
+		}
+		// skip what was written, which may end part way through a span
+		size_t left = static_cast<size_t>(done);
+		while (first < _Spans && left >= iov[first].iov_len)
+		{
+			left -= iov[first++].iov_len;
+		}
+		if (left)
+		{
+			iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+			iov[first].iov_len -= left;
+		}
+	}
+	_Spans = _Used = 0;
+	return _Ok;
+}
+
+#endif
+
+//------------------------------------------------------
+// async_fd_sink
+//------------------------------------------------------
+
+typedef std::chrono::steady_clock sink_clock;
+
+static unsigned long long elapsed_ns(sink_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		sink_clock::now() - start).count();
+}
+
+async_fd_sink::async_fd_sink(int fd, size_t buffer_size, size_t buffers,
+							 async_sink_sync sync, async_sink_format format)
+	: _Fd(fd), _Size(buffer_size ? buffer_size : 1), _Sync(sync), _Format(format),
+	  _Started(false), _Used(0), _Busy(false), _Stop(false), _Ok(true), _WaitFor(0),
+	  _Interval(0), _Handed(sink_clock::now())
+{
+	if (buffers < 2)
+	{
+		buffers = 2;
+	}
+	_Storage.resize(_Size * buffers);
+	_Fill = &_Storage[0];
+	for (size_t n = 1; n < buffers; ++n)
+	{
+		_Free.push_back(&_Storage[n * _Size]);
+	}
+	memset(&_Metrics, 0, sizeof(_Metrics));
+	_Thread = std::thread(&async_fd_sink::run, this);
+}
+
+async_fd_sink::~async_fd_sink()
+{
+	flush();
+	{
+		std::lock_guard<std::mutex> lock(_Lock);
+		_Stop = true;
+	}
+	_Ready.notify_one();
+	_Thread.join();
+}
+
+void async_fd_sink::hand_over(std::unique_lock<std::mutex>& lock)
+{
+	_Handed = sink_clock::now();
+	if (_Used)
+	{
+		pending full = { _Fill, _Used };
+		_Pending.push_back(full);
+		_Ready.notify_one();
+		if (_Free.empty())
+		{	// every buffer is waiting to be written
+			OFORMAT_TRACE_EVENT(buffer_full, this, full.n);
+			if (std::this_thread::get_id() == _Thread.get_id())
+			{	// a writer resumed on the I/O thread can't wait for it
+				write_next(lock);
+			}
+			else
+			{
+				sink_clock::time_point start = sink_clock::now();
+				_Done.wait(lock, [this] { return !_Free.empty(); });
+				unsigned long long ns = elapsed_ns(start);
+				++_Metrics.waits;
+				_Metrics.wait_ns += ns;
+				if (ns > _Metrics.max_wait_ns)
+				{
+					_Metrics.max_wait_ns = ns;
+				}
+			}
+		}
+		_Fill = _Free.back();
+		_Free.pop_back();
+		_Used = 0;
+	}
+}
+
+bool async_fd_sink::flush()
+{
+	sink_clock::time_point start = sink_clock::now();
+	std::unique_lock<std::mutex> lock(_Lock);
+	hand_over(lock);
+	if (std::this_thread::get_id() == _Thread.get_id())
+	{
+		while (!_Pending.empty())
+		{
+			write_next(lock);
+		}
+	}
+	_Done.wait(lock, [this] { return _Pending.empty() && !_Busy; });
+	if (async_sync_flush == _Sync && _Ok)
+	{
+		_Ok = sync_data(_Fd);
+	}
+	_Metrics.flush_ns += elapsed_ns(start);
+	return _Ok;
+}
+
+void async_fd_sink::flush_interval(std::chrono::milliseconds every)
+{
+	{
+		std::lock_guard<std::mutex> lock(_Lock);
+		_Interval = every;
+	}
+	_Ready.notify_one();
+}
+
+bool async_fd_sink::resume_when_ready(size_t n, std::coroutine_handle<> h)
+{
+	std::lock_guard<std::mutex> lock(_Lock);
+	if (room() >= n || n > (_Size - _Used) + (_Storage.size() - _Size))
+	{
+		return false;
+	}
+	++_Metrics.suspends;
+	_Waiter = h;
+	_WaitFor = n;
+	return true;
+}
+
+async_sink_metrics async_fd_sink::metrics() const
+{
+	std::lock_guard<std::mutex> lock(_Lock);
+	return _Metrics;
+}
+
+void async_fd_sink::run()
+{
+	std::unique_lock<std::mutex> lock(_Lock);
+	for (;;)
+	{
+		std::chrono::milliseconds interval = _Interval;
+		auto work = [this, interval]
+			{ return _Stop || !_Pending.empty() || _Interval != interval; };
+		if (!interval.count())
+		{
+			_Ready.wait(lock, work);
+		}
+		else if (!_Ready.wait_until(lock, _Handed + interval, work))
+		{	// nothing is pending, so there is a free buffer to take instead
+			if (_Used)
+			{
+				++_Metrics.timed;
+			}
+			hand_over(lock);
+			continue;
+		}
+		if (_Pending.empty() && _Stop)
+		{
+			break;
+		}
+		if (_Pending.empty())
+		{	// a new interval
+			continue;
+		}
+		write_next(lock);
+		if (_Waiter && room() >= _WaitFor)
+		{
+			std::coroutine_handle<> writer = _Waiter;
+			_Waiter = nullptr;
+			lock.unlock();
+			writer.resume();
+			lock.lock();
+		}
+	}
+	if (async_format_lz4 == _Format && _Ok)
+	{
+		async_sink_metrics done;
+		memset(&done, 0, sizeof(done));
+		_Ok = finish(done);
+		_Metrics.stored += done.stored;
+	}
+}
+
+void async_fd_sink::write_next(std::unique_lock<std::mutex>& lock)
+{
+	pending next = _Pending.front();
+	_Pending.pop_front();
+	_Busy = true;
+	bool ok = _Ok;
+	lock.unlock();
+
+	// After an error the buffers are still taken, so the writer
+	// doesn't wait for ever, but no more is written.
+	async_sink_metrics done;
+	memset(&done, 0, sizeof(done));
+	sink_clock::time_point start = sink_clock::now();
+	if (ok)
+	{
+		ok = store(next.p, next.n, _Packed, _Table, done);
+		if (ok && async_sync_buffer == _Sync)
+		{
+			ok = sync_data(_Fd);
+		}
+	}
+	unsigned long long ns = elapsed_ns(start);
+
+	lock.lock();
+	if (ok)
+	{
+		++_Metrics.buffers;
+		_Metrics.bytes += next.n;
+		_Metrics.stored += done.stored;
+	}
+	_Ok = _Ok && ok;
+	_Metrics.compress_ns += done.compress_ns;
+	_Metrics.io_ns += ns - done.compress_ns;
+	_Free.push_back(next.p);
+	_Busy = false;
+	_Done.notify_one();
+}
+
+//------------------------------------------------------
+// LZ4 frames
+// See the LZ4 frame and block format descriptions at github.com/lz4/lz4.
+// Blocks are compressed greedily with a 4096 entry hash table, which
+// finds the repeated text and separators of formatted output cheaply.
+//------------------------------------------------------
+
+static const unsigned int lz4_magic = 0x184D2204;
+static const size_t lz4_min_match = 4;
+static const size_t lz4_last_literals = 5;	// a block always ends in literals
+static const size_t lz4_match_limit = 12;	// and its last match starts before these
+static const size_t lz4_max_offset = 65535;
+static const int lz4_hash_bits = 12;
+
+static unsigned int read_le32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned int>(p[3]) << 24);
+}
+
+static void write_le32(unsigned char* p, unsigned int v)
+{
+	p[0] = static_cast<unsigned char>(v);
+	p[1] = static_cast<unsigned char>(v >> 8);
+	p[2] = static_cast<unsigned char>(v >> 16);
+	p[3] = static_cast<unsigned char>(v >> 24);
+}
+
+static unsigned int rotl32(unsigned int v, int r)
+{
+	return (v << r) | (v >> (32 - r));
+}
+
+// xxHash32 of fewer than 16 bytes, as the frame descriptor checksum needs
+static unsigned int xxh32_short(const unsigned char* p, size_t n)
+{
+	const unsigned int prime1 = 2654435761U, prime2 = 2246822519U,
+		prime3 = 3266489917U, prime4 = 668265263U, prime5 = 374761393U;
+	unsigned int h = prime5 + static_cast<unsigned int>(n);
+	for (; n >= 4; p += 4, n -= 4)
+	{
+		h = rotl32(h + read_le32(p) * prime3, 17) * prime4;
+	}
+	for (; n; ++p, --n)
+	{
+		h = rotl32(h + *p * prime5, 11) * prime1;
+	}
+	h ^= h >> 15;
+	h *= prime2;
+	h ^= h >> 13;
+	h *= prime3;
+	h ^= h >> 16;
+	return h;
+}
+
+// The largest block a frame may hold, and its code in the descriptor
+static size_t lz4_block_max(size_t size, unsigned char* code)
+{
+	unsigned char c = 4;
+	size_t max = 64 << 10;
+	while (c < 7 && max < size)
+	{
+		++c;
+		max <<= 2;
+	}
+	*code = c;
+	return max;
+}
+
+static size_t lz4_bound(size_t n)
+{
+	return n + n / 255 + 16;
+}
+
+static unsigned char* lz4_length(unsigned char* op, size_t n)
+{
+	for (; n >= 255; n -= 255)
+	{
+		*op++ = 255;
+	}
+	*op++ = static_cast<unsigned char>(n);
+	return op;
+}
+
+// Compress the block of n bytes at src to dst, which has room for
+// lz4_bound(n).  Returns the compressed size.
+static size_t lz4_compress(const unsigned char* src, size_t n,
+						   unsigned char* dst, unsigned int* table)
+{
+	const unsigned char* ip = src;
+	const unsigned char* anchor = src;
+	const unsigned char* const end = src + n;
+	unsigned char* op = dst;
+	if (n > lz4_match_limit)
+	{
+		const unsigned char* const last = end - lz4_match_limit;
+		const unsigned char* const limit = end - lz4_last_literals;
+		memset(table, 0, sizeof(unsigned int) << lz4_hash_bits);
+		while (ip <= last)
+		{
+			unsigned int v = read_le32(ip);
+			unsigned int h = (v * 2654435761U) >> (32 - lz4_hash_bits);
+			const unsigned char* ref = src + table[h];
+			table[h] = static_cast<unsigned int>(ip - src);
+			if (ref >= ip || static_cast<size_t>(ip - ref) > lz4_max_offset || read_le32(ref) != v)
+			{	// step faster through text that doesn't repeat
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+			const unsigned char* m = ip + lz4_min_match;
+			for (ref += lz4_min_match; m < limit && *m == *ref; ++m, ++ref)
+			{
+			}
+
+			size_t literals = ip - anchor;
+			size_t match = m - ip - lz4_min_match;
+			unsigned char* token = op++;
+			*token = static_cast<unsigned char>((literals < 15 ? literals : 15) << 4 |
+												(match < 15 ? match : 15));
+			if (literals >= 15)
+			{
+				op = lz4_length(op, literals - 15);
+			}
+			memcpy(op, anchor, literals);
+			op += literals;
+			size_t offset = m - ref;
+			*op++ = static_cast<unsigned char>(offset);
+			*op++ = static_cast<unsigned char>(offset >> 8);
+			if (match >= 15)
+			{
+				op = lz4_length(op, match - 15);
+			}
+			ip = anchor = m;
+		}
+	}
+	size_t literals = end - anchor;
+	*op++ = static_cast<unsigned char>((literals < 15 ? literals : 15) << 4);
+	if (literals >= 15)
+	{
+		op = lz4_length(op, literals - 15);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+	return op - dst;
+}
+
+bool async_fd_sink::store(const char* p, size_t n, std::vector<char>& packed,
+						  std::vector<unsigned int>& table, async_sink_metrics& done)
+{
+	if (async_format_raw == _Format)
+	{
+		done.stored += n;
+		return write_all(_Fd, p, n);
+	}
+
+	unsigned char code;
+	size_t block = lz4_block_max(_Size, &code);
+	if (!_Started)
+	{	// magic, FLG (version 1, independent blocks), BD, header checksum
+		unsigned char header[7];
+		write_le32(header, lz4_magic);
+		header[4] = 0x60;
+		header[5] = static_cast<unsigned char>(code << 4);
+		header[6] = static_cast<unsigned char>(xxh32_short(header + 4, 2) >> 8);
+		if (!write_all(_Fd, reinterpret_cast<const char*>(header), sizeof(header)))
+		{
+			return false;
+		}
+		done.stored += sizeof(header);
+		_Started = true;
+		packed.resize(4 + lz4_bound(block < _Size ? block : _Size));
+		table.resize(1 << lz4_hash_bits);
+	}
+	for (; n; )
+	{
+		size_t chunk = n < block ? n : block;
+		sink_clock::time_point start = sink_clock::now();
+		unsigned char* out = reinterpret_cast<unsigned char*>(&packed[0]);
+		size_t size = lz4_compress(reinterpret_cast<const unsigned char*>(p), chunk,
+								   out + 4, &table[0]);
+		if (size >= chunk)
+		{	// stored as it is, flagged by the top bit
+			memcpy(out + 4, p, chunk);
+			size = chunk;
+			write_le32(out, static_cast<unsigned int>(size) | 0x80000000U);
+		}
+		else
+		{
+			write_le32(out, static_cast<unsigned int>(size));
+		}
+		done.compress_ns += elapsed_ns(start);
+		if (!write_all(_Fd, &packed[0], 4 + size))
+		{
+			return false;
+		}
+		done.stored += 4 + size;
+		p += chunk;
+		n -= chunk;
+	}
+	return true;
+}
+
+bool async_fd_sink::finish(async_sink_metrics& done)
+{
+	std::vector<char> packed;
+	std::vector<unsigned int> table;
+	if (!_Started && !store(0, 0, packed, table, done))
+	{	// an empty frame
+		return false;
+	}
+	const char end_mark[4] = { 0, 0, 0, 0 };
+	done.stored += sizeof(end_mark);
+	return write_all(_Fd, end_mark, sizeof(end_mark));
+}
+
+// Copy a match of length bytes from offset bytes back, which may overlap
+static bool lz4_copy_match(std::string& out, size_t base, size_t offset, size_t length)
+{
+	if (!offset || offset > out.size() - base)
+	{
+		return false;
+	}
+	size_t from = out.size() - offset;
+	for (size_t k = 0; k < length; ++k)
+	{
+		out += out[from + k];
+	}
+	return true;
+}
+
+// Read a length continued in following bytes
+static bool lz4_read_length(const unsigned char*& p, const unsigned char* end, size_t& length)
+{
+	unsigned char b;
+	do
+	{
+		if (p == end)
+		{
+			return false;
+		}
+		b = *p++;
+		length += b;
+	}
+	while (255 == b);
+	return true;
+}
+
+static bool lz4_decompress(const unsigned char* p, size_t n, std::string& out, size_t base)
+{
+	const unsigned char* end = p + n;
+	while (p < end)
+	{
+		unsigned char token = *p++;
+		size_t literals = token >> 4;
+		if (15 == literals && !lz4_read_length(p, end, literals))
+		{
+			return false;
+		}
+		if (literals > static_cast<size_t>(end - p))
+		{
+			return false;
+		}
+		out.append(reinterpret_cast<const char*>(p), literals);
+		p += literals;
+		if (p == end)
+		{	// the last sequence has no match
+			break;
+		}
+		if (end - p < 2)
+		{
+			return false;
+		}
+		size_t offset = p[0] | (p[1] << 8);
+		p += 2;
+		size_t match = token & 15;
+		if (15 == match && !lz4_read_length(p, end, match))
+		{
+			return false;
+		}
+		if (!lz4_copy_match(out, base, offset, match + lz4_min_match))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool lz4_frame_decode(const char* data, size_t n, std::string& out)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+	const unsigned char* end = p + n;
+	while (p < end)
+	{
+		if (end - p < 4)
+		{
+			return false;
+		}
+		unsigned int magic = read_le32(p);
+		p += 4;
+		if (0x184D2A50 == (magic & 0xFFFFFFF0))
+		{	// a skippable frame
+			if (end - p < 4 || read_le32(p) > static_cast<size_t>(end - p - 4))
+			{
+				return false;
+			}
+			p += 4 + read_le32(p);
+			continue;
+		}
+		if (lz4_magic != magic || end - p < 3)
+		{
+			return false;
+		}
+		unsigned char flags = p[0];
+		size_t descriptor = 2 + (flags & 0x08 ? 8 : 0) + (flags & 0x01 ? 4 : 0);
+		if (0x40 != (flags & 0xC0) || static_cast<size_t>(end - p) < descriptor + 1 ||
+			p[descriptor] != static_cast<unsigned char>(xxh32_short(p, descriptor) >> 8))
+		{
+			return false;
+		}
+		p += descriptor + 1;
+		// independent blocks can't refer back before their own start
+		bool independent = 0 != (flags & 0x20);
+		size_t checksum = flags & 0x10 ? 4 : 0;
+		size_t frame = out.size();
+		for (;;)
+		{
+			if (end - p < 4)
+			{
+				return false;
+			}
+			unsigned int size = read_le32(p);
+			p += 4;
+			if (!size)
+			{
+				break;
+			}
+			size_t length = size & 0x7FFFFFFF;
+			if (length + checksum > static_cast<size_t>(end - p))
+			{
+				return false;
+			}
+			if (size & 0x80000000U)
+			{
+				out.append(reinterpret_cast<const char*>(p), length);
+			}
+			else if (!lz4_decompress(p, length, out, independent ? out.size() : frame))
+			{
+				return false;
+			}
+			p += length + checksum;
+		}
+		if (flags & 0x04)
+		{	// content checksum
+			if (end - p < 4)
+			{
+				return false;
+			}
+			p += 4;
+		}
+	}
+	return true;
+}
+
+//------------------------------------------------------
+// UTF-8
+//------------------------------------------------------
+
+static unsigned char* utf8_put(unsigned char* o, unsigned int c)
+{
+	if (c < 0x80)
+	{
+		*o++ = static_cast<unsigned char>(c);
+	}
+	else if (c < 0x800)
+	{
+		*o++ = static_cast<unsigned char>(0xC0 | c >> 6);
+		*o++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+	}
+	else if (c < 0x10000)
+	{
+		*o++ = static_cast<unsigned char>(0xE0 | c >> 12);
+		*o++ = static_cast<unsigned char>(0x80 | (c >> 6 & 0x3F));
+		*o++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+	}
+	else
+	{
+		*o++ = static_cast<unsigned char>(0xF0 | c >> 18);
+		*o++ = static_cast<unsigned char>(0x80 | (c >> 12 & 0x3F));
+		*o++ = static_cast<unsigned char>(0x80 | (c >> 6 & 0x3F));
+		*o++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+	}
+	return o;
+}
+
+static const unsigned int utf8_replacement = 0xFFFD;
+
+#if defined(SINK_X86)
+// Narrow 16 characters at p to o if they are all ASCII.
+// Returns false, having written nothing, if any of them is not.
+SINK_TARGET_SSE2
+static bool utf8_ascii16_sse2(const wchar_t* p, unsigned char* o)
+{
+	const __m128i* in = reinterpret_cast<const __m128i*>(p);
+	__m128i bytes;
+	if (2 == sizeof(wchar_t))
+	{
+		__m128i a = _mm_loadu_si128(in);
+		__m128i b = _mm_loadu_si128(in + 1);
+		__m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16(-0x80));
+		if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())))
+		{
+			return false;
+		}
+		bytes = _mm_packus_epi16(a, b);
+	}
+	else
+	{
+		__m128i a = _mm_loadu_si128(in);
+		__m128i b = _mm_loadu_si128(in + 1);
+		__m128i c = _mm_loadu_si128(in + 2);
+		__m128i d = _mm_loadu_si128(in + 3);
+		__m128i high = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)),
+									 _mm_set1_epi32(-0x80));
+		if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi32(high, _mm_setzero_si128())))
+		{
+			return false;
+		}
+		bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+	}
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(o), bytes);
+	return true;
+}
+#endif
+
+size_t utf8_encode(const wchar_t* p, size_t n, char* out, wchar_t& carry)
+{
+	unsigned char* o = reinterpret_cast<unsigned char*>(out);
+	const wchar_t* const end = p + n;
+	if (carry && p != end)
+	{	// the high surrogate left by the last call
+		unsigned int low = static_cast<unsigned int>(*p);
+		if (low >= 0xDC00 && low < 0xE000)
+		{
+			++p;
+			o = utf8_put(o, 0x10000 + ((static_cast<unsigned int>(carry) - 0xD800) << 10) +
+						 (low - 0xDC00));
+		}
+		else
+		{
+			o = utf8_put(o, utf8_replacement);
+		}
+		carry = 0;
+	}
+	while (p != end)
+	{
+		// A block of ASCII is narrowed as it is
+#if defined(SINK_X86)
+		while (end - p >= 16 && utf8_ascii16_sse2(p, o))
+		{
+			p += 16;
+			o += 16;
+		}
+#else
+		while (end - p >= 8)
+		{
+			unsigned int bits = 0;
+			for (int k = 0; k < 8; ++k)
+			{
+				bits |= static_cast<unsigned int>(p[k]);
+			}
+			if (bits >= 0x80)
+			{
+				break;
+			}
+			for (int k = 0; k < 8; ++k)
+			{
+				o[k] = static_cast<unsigned char>(p[k]);
+			}
+			p += 8;
+			o += 8;
+		}
+#endif
+		if (p == end)
+		{
+			break;
+		}
+		unsigned int c = static_cast<unsigned int>(*p++);
+		if (c < 0x80)
+		{
+			*o++ = static_cast<unsigned char>(c);
+			continue;
+		}
+		if (c >= 0xD800 && c < 0xE000)
+		{
+			if (2 == sizeof(wchar_t) && c < 0xDC00)
+			{	// a high surrogate, to pair with the low one after it
+				if (p == end)
+				{
+					carry = static_cast<wchar_t>(c);
+					break;
+				}
+				unsigned int low = static_cast<unsigned int>(*p);
+				if (low >= 0xDC00 && low < 0xE000)
+				{
+					++p;
+					c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+				}
+				else
+				{
+					c = utf8_replacement;
+				}
+			}
+			else
+			{
+				c = utf8_replacement;
+			}
+		}
+		else if (c > 0x10FFFF)
+		{
+			c = utf8_replacement;
+		}
+		o = utf8_put(o, c);
+	}
+	return o - reinterpret_cast<unsigned char*>(out);
+}
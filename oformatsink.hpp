@@ -0,0 +1,714 @@
+//
+// oformatsink.hpp
+//
+//
+// Comments: destinations for basic_oformatstream output
+//
+// A sink is any class with these members, called directly, never through
+// a virtual function:
+//
+//	void write(const _E* p, size_t n)
+//		Take a copy of n characters.
+//	void write_stable(const _E* p, size_t n)
+//		As write, but p stays valid until the next flush(), so the sink
+//		may keep the pointer instead of copying.
+//	bool flush()
+//		Pass on everything written so far.  Returns false on error.
+//
+// basic_sinkbuf<_Sink> puts any sink under a std::basic_ostream, so every
+// inserter, manipulator and locale still works.  Its put area absorbs the
+// small writes, so the virtual overflow() is only reached once per buffer
+// full, and large writes go straight to the sink.  basic_oformatstream
+// recognises a basic_sinkbuf and hands it the literal text of its format
+// with write_stable(), so a sink that gathers, such as fd_sink, can write
+// long runs of text from the compiled format itself without copying them.
+//
+// A sink may also have these, for a coroutine writing through
+// basic_oformatstream::write_record():
+//
+//	bool ready(size_t n)
+//		True if n more characters can be written without waiting.
+//	bool resume_when_ready(size_t n, std::coroutine_handle<> h)
+//		Resume h once they can.  Returns false, leaving h to the caller,
+//		if they already can or never will.
+//
+// Example usage:
+//
+// fd_sink sink(1);						// standard output
+// sinkbuf<fd_sink> buf(sink);
+// std::ostream os(&buf);
+// oformatstream ofs("[%s] %d\n", &os);
+// ofs << "example" << 1;
+// os.flush();							// or let ofs go out of scope
+//
+//
+
+#ifndef _oformatsink_
+#define _oformatsink_
+
+#include <stddef.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include "oformattrace.hpp"
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_stable_sinkbuf
+// The part of basic_sinkbuf that basic_oformatstream needs to know about,
+// whatever the sink.
+//------------------------------------------------------
+template <typename _E, typename _Tr = std::char_traits<_E> >
+class basic_stable_sinkbuf : public std::basic_streambuf<_E,_Tr>
+{
+public:
+	// Write n characters which stay valid until the next pubsync().
+	virtual void put_stable(const _E* p, size_t n) = 0;
+
+	// As the sink members of the same names, for sinks that have them.
+	// Otherwise writing never waits.
+	virtual bool ready(size_t)
+	{ return true; }
+
+	virtual bool resume_when_ready(size_t, std::coroutine_handle<>)
+	{ return false; }
+
+	// Characters written since the last pubsync(), for flush_every_bytes
+	virtual size_t unflushed() const = 0;
+};
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_sinkbuf
+// A stream buffer writing to a sink, which it doesn't own.
+// Stable text shorter than sinkbuf_stable characters is copied.
+//------------------------------------------------------
+const size_t sinkbuf_stable = 64;
+
+template <typename _Sink, typename _E = char, typename _Tr = std::char_traits<_E> >
+class basic_sinkbuf : public basic_stable_sinkbuf<_E,_Tr>
+{
+public:
+	typedef typename _Tr::int_type int_type;
+
+	explicit basic_sinkbuf(_Sink& sink)
+		: _Sink_(sink), _Passed(0)
+	{
+		this->setp(_Buf, _Buf + sizeof(_Buf) / sizeof(_Buf[0]));
+	}
+
+	virtual ~basic_sinkbuf()
+	{
+		sync();
+	}
+
+	_Sink& sink()
+	{ return _Sink_; }
+
+	// Short text is cheaper to copy into the put area than to pass on
+	// by itself, whatever the sink does with it
+	virtual void put_stable(const _E* p, size_t n)
+	{
+		if (n < sinkbuf_stable && static_cast<std::streamsize>(n) <= this->epptr() - this->pptr())
+		{
+			_Tr::copy(this->pptr(), p, n);
+			this->pbump(static_cast<int>(n));
+		}
+		else
+		{
+			drain_full();
+			_Sink_.write_stable(p, n);
+			_Passed += n;
+		}
+	}
+
+	virtual size_t unflushed() const
+	{ return _Passed + held(); }
+
+	// The put area is passed on ahead of the n characters
+	virtual bool ready(size_t n)
+	{
+		if (static_cast<std::streamsize>(n) <= this->epptr() - this->pptr())
+		{
+			return true;
+		}
+		if constexpr (requires (_Sink& s) { s.ready(n); })
+		{
+			return _Sink_.ready(held() + n);
+		}
+		return true;
+	}
+
+	virtual bool resume_when_ready(size_t n, std::coroutine_handle<> h)
+	{
+		if constexpr (requires (_Sink& s) { s.resume_when_ready(n, h); })
+		{
+			return !ready(n) && _Sink_.resume_when_ready(held() + n, h);
+		}
+		return false;
+	}
+
+protected:
+	virtual int_type overflow(int_type c)
+	{
+		drain_full();
+		if (!_Tr::eq_int_type(c, _Tr::eof()))
+		{
+			*this->pptr() = _Tr::to_char_type(c);
+			this->pbump(1);
+			return c;
+		}
+		return _Tr::not_eof(c);
+	}
+
+	virtual std::streamsize xsputn(const _E* p, std::streamsize n)
+	{
+		if (n <= this->epptr() - this->pptr())
+		{
+			_Tr::copy(this->pptr(), p, static_cast<size_t>(n));
+			this->pbump(static_cast<int>(n));
+		}
+		else
+		{
+			drain_full();
+			_Sink_.write(p, static_cast<size_t>(n));
+			_Passed += static_cast<size_t>(n);
+		}
+		return n;
+	}
+
+	virtual int sync()
+	{
+		drain();
+		_Passed = 0;
+		return _Sink_.flush() ? 0 : -1;
+	}
+
+private:
+	size_t held() const
+	{ return static_cast<size_t>(this->pptr() - this->pbase()); }
+
+	// Hand the put area to the sink
+	void drain()
+	{
+		if (this->pptr() != this->pbase())
+		{
+			_Sink_.write(this->pbase(), this->pptr() - this->pbase());
+			_Passed += held();
+			this->setp(_Buf, _Buf + sizeof(_Buf) / sizeof(_Buf[0]));
+		}
+	}
+
+	// The put area can't take what is being written, so goes first
+	void drain_full()
+	{
+		if (held())
+		{
+			OFORMAT_TRACE_EVENT(buffer_full, this, held());
+		}
+		drain();
+	}
+
+	_Sink& _Sink_;
+	size_t _Passed;		// passed on to the sink since the last sync()
+	_E _Buf[256];
+};
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_buffer_sink
+// Writes into a fixed array supplied by the caller.
+// Output beyond its end is dropped and counted.
+//------------------------------------------------------
+template <typename _E>
+class basic_buffer_sink
+{
+public:
+	basic_buffer_sink(_E* buf, size_t size)
+		: _Buf(buf), _Size(size), _Used(0), _Dropped(0)
+	{}
+
+	void write(const _E* p, size_t n)
+	{
+		size_t room = _Size - _Used;
+		if (n > room)
+		{
+			_Dropped += n - room;
+			n = room;
+		}
+		memcpy(_Buf + _Used, p, n * sizeof(_E));
+		_Used += n;
+	}
+
+	void write_stable(const _E* p, size_t n)
+	{ write(p, n); }
+
+	bool flush()
+	{ return !_Dropped; }
+
+	const _E* data() const
+	{ return _Buf; }
+
+	size_t size() const
+	{ return _Used; }
+
+	// Characters that didn't fit
+	size_t dropped() const
+	{ return _Dropped; }
+
+	void clear()
+	{ _Used = _Dropped = 0; }
+
+private:
+	_E* _Buf;
+	size_t _Size;
+	size_t _Used;
+	size_t _Dropped;
+};
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_string_sink
+// Appends to a string, which grows as needed.
+//------------------------------------------------------
+template <typename _E, typename _Tr = std::char_traits<_E> >
+class basic_string_sink
+{
+public:
+	basic_string_sink()
+	{}
+
+	void write(const _E* p, size_t n)
+	{ _Str.append(p, n); }
+
+	void write_stable(const _E* p, size_t n)
+	{ _Str.append(p, n); }
+
+	bool flush()
+	{ return true; }
+
+	std::basic_string<_E,_Tr>& str()
+	{ return _Str; }
+
+private:
+	std::basic_string<_E,_Tr> _Str;
+};
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_callback_sink
+// Passes each piece of output to a function, eg. a logging back end.
+// The pointer given to the function is only valid during the call.
+//------------------------------------------------------
+template <typename _E>
+class basic_callback_sink
+{
+public:
+	typedef bool (*callback)(void* context, const _E* p, size_t n);
+
+	basic_callback_sink(callback fn, void* context)
+		: _Fn(fn), _Context(context), _Ok(true)
+	{}
+
+	void write(const _E* p, size_t n)
+	{ _Ok = (*_Fn)(_Context, p, n) && _Ok; }
+
+	void write_stable(const _E* p, size_t n)
+	{ write(p, n); }
+
+	// Returns false if any call so far returned false
+	bool flush()
+	{ return _Ok; }
+
+private:
+	callback _Fn;
+	void* _Context;
+	bool _Ok;
+};
+
+//------------------------------------------------------
+// CLASS fd_sink
+// Writes to a file descriptor, gathering the output into an array of
+// spans which is written with a single writev() when it fills or the
+// sink is flushed.  Stable spans of fd_sink_gather characters or more,
+// eg. the literal text of a format, are pointed to rather than copied.
+// Everything else is copied into a buffer of fd_sink_buffer bytes, which
+// adjacent spans share, as a short copy costs less than the kernel
+// spends on an extra span.
+// Where writev() is not available the spans are written one at a time.
+// The descriptor is not closed.
+//------------------------------------------------------
+const size_t fd_sink_spans = 1024;
+const size_t fd_sink_buffer = 16384;
+const size_t fd_sink_gather = 128;
+
+class fd_sink
+{
+public:
+	explicit fd_sink(int fd)
+		: _Fd(fd), _Spans(0), _Used(0), _Ok(true)
+	{}
+
+	~fd_sink()
+	{
+		flush();
+	}
+
+	void write(const char* p, size_t n)
+	{
+		if (n > fd_sink_buffer / 4)
+		{	// not worth copying
+			add(p, n, false);
+			flush();
+			return;
+		}
+		if (n > fd_sink_buffer - _Used)
+		{
+			flush_full();
+		}
+		memcpy(_Buffer + _Used, p, n);
+		add(_Buffer + _Used, n, true);
+		_Used += n;
+	}
+
+	void write_stable(const char* p, size_t n)
+	{
+		if (n < fd_sink_gather)
+		{
+			write(p, n);
+		}
+		else
+		{
+			add(p, n, false);
+		}
+	}
+
+	// Returns false if any write to the descriptor has failed
+	bool flush();
+
+	int fd() const
+	{ return _Fd; }
+
+private:
+	// The buffer or the spans are full, so what they hold is written
+	// before any more is taken
+	void flush_full()
+	{
+		OFORMAT_TRACE_EVENT(buffer_full, this, pending());
+		flush();
+	}
+
+	size_t pending() const
+	{
+		size_t n(0);
+		for (size_t k = 0; k < _Spans; ++k) n += _Length[k];
+		return n;
+	}
+
+	void add(const char* p, size_t n, bool copied)
+	{
+		if (!n)
+		{
+			return;
+		}
+		if (_Spans && _Copied[_Spans - 1] && copied &&
+			_Base[_Spans - 1] + _Length[_Spans - 1] == p)
+		{
+			_Length[_Spans - 1] += n;	// extends the last copy
+			return;
+		}
+		if (fd_sink_spans == _Spans)
+		{
+			flush_full();
+			if (copied)
+			{	// the copy was just flushed, take it again
+				memmove(_Buffer, p, n);
+				p = _Buffer;
+				_Used = 0;	// the caller adds n
+			}
+		}
+		_Base[_Spans] = p;
+		_Length[_Spans] = n;
+		_Copied[_Spans] = copied;
+		++_Spans;
+	}
+
+	int _Fd;
+	size_t _Spans;
+	const char* _Base[fd_sink_spans];
+	size_t _Length[fd_sink_spans];
+	bool _Copied[fd_sink_spans];
+	size_t _Used;
+	bool _Ok;
+	char _Buffer[fd_sink_buffer];
+};
+
+//------------------------------------------------------
+// CLASS async_fd_sink
+// Writes to a file descriptor from a thread of its own, so the thread
+// formatting the output doesn't wait on the disk.  The output is copied
+// into one of buffers buffers of buffer_size bytes; when it fills it is
+// handed to the I/O thread and the next free buffer is taken.  The
+// formatting thread only waits when every buffer is still being written,
+// or in flush(), and the time it spends waiting is kept in metrics().
+// With async_format_lz4 the I/O thread also compresses each buffer,
+// writing a standard LZ4 frame that "lz4 -d" or lz4_frame_decode()
+// reads.  The frame is only ended when the sink is destroyed.
+// The sink is written from one thread at a time, like any stream.
+// Instead of waiting for a buffer, a coroutine writer can be suspended
+// with resume_when_ready() and is then resumed on the I/O thread.
+// With flush_interval() the I/O thread also takes the part filled
+// buffer itself whenever none has been handed over for that long, so
+// output no longer flushed line by line still reaches the descriptor
+// soon after it reaches the sink, without the writer waiting for it to
+// be written.  A basic_sinkbuf above the sink keeps what it holds until
+// it fills or is synced, so a line left there needs a sync all the same.
+// The descriptor is not closed.
+//------------------------------------------------------
+const size_t async_sink_buffer = 1 << 20;
+
+enum async_sink_sync
+{
+	async_sync_none,	// write() only
+	async_sync_flush,	// fdatasync() in each flush()
+	async_sync_buffer	// fdatasync() after every buffer
+};
+
+enum async_sink_format
+{
+	async_format_raw,	// as written
+	async_format_lz4	// LZ4 frame of independent blocks
+};
+
+struct async_sink_metrics
+{
+	unsigned long long buffers;		// buffers written
+	unsigned long long bytes;		// bytes written to the sink
+	unsigned long long stored;		// bytes they took on the descriptor
+	unsigned long long waits;		// times the writer found no free buffer
+	unsigned long long wait_ns;		// time the writer spent blocked on them
+	unsigned long long max_wait_ns;	// longest single wait for a buffer
+	unsigned long long suspends;	// times a coroutine writer was suspended instead
+	unsigned long long timed;		// times flush_interval() took a buffer
+	unsigned long long flush_ns;	// time spent in flush()
+	unsigned long long compress_ns;	// time the I/O thread spent compressing
+	unsigned long long io_ns;		// time the I/O thread spent writing
+};
+
+class async_fd_sink
+{
+public:
+	explicit async_fd_sink(int fd, size_t buffer_size = async_sink_buffer,
+						   size_t buffers = 2, async_sink_sync sync = async_sync_none,
+						   async_sink_format format = async_format_raw);
+
+	// Flushes, then stops the I/O thread
+	~async_fd_sink();
+
+	// Copied under the lock, as flush_interval() may take the buffer
+	void write(const char* p, size_t n)
+	{
+		std::unique_lock<std::mutex> lock(_Lock);
+		while (n)
+		{
+			if (_Used == _Size)
+			{
+				hand_over(lock);
+			}
+			size_t chunk = n < _Size - _Used ? n : _Size - _Used;
+			memcpy(_Fill + _Used, p, chunk);
+			_Used += chunk;
+			p += chunk;
+			n -= chunk;
+		}
+	}
+
+	// The buffer is written after write_stable() returns, so it is copied
+	void write_stable(const char* p, size_t n)
+	{ write(p, n); }
+
+	// Waits until everything written so far is with the operating system,
+	// and on the disk with async_sync_flush.
+	// Returns false if any write to the descriptor has failed.
+	bool flush();
+
+	// Have the I/O thread take the buffer being filled and write it once
+	// every is up without one being handed over, 0 meaning never (the
+	// default).  Only what has reached the sink is written, see above.
+	void flush_interval(std::chrono::milliseconds every);
+
+	// True if n more bytes can be written without waiting for a buffer
+	bool ready(size_t n)
+	{
+		std::lock_guard<std::mutex> lock(_Lock);
+		return room() >= n;
+	}
+
+	// Resume h on the I/O thread once n more bytes can be written without
+	// waiting.  Returns false, leaving h to the caller, if they already
+	// can, or if n is more than every buffer holds.
+	// Until it next suspends, the resumed coroutine runs on the I/O
+	// thread, which then writes any buffer it would otherwise wait for
+	// itself, eg. in flush().
+	bool resume_when_ready(size_t n, std::coroutine_handle<> h);
+
+	async_sink_metrics metrics() const;
+
+	int fd() const
+	{ return _Fd; }
+
+private:
+	async_fd_sink(const async_fd_sink&);
+	async_fd_sink& operator=(const async_fd_sink&);
+
+	// Queue the fill buffer, if it has anything in it, and take a free
+	// one, lock held
+	void hand_over(std::unique_lock<std::mutex>& lock);
+	// Bytes that can be written before waiting, with _Lock held
+	size_t room() const
+	{ return (_Size - _Used) + _Free.size() * _Size; }
+	// The I/O thread
+	void run();
+	// Write the oldest pending buffer and free it, lock held on entry and exit
+	void write_next(std::unique_lock<std::mutex>& lock);
+	// Write n bytes at p, compressed as the format says
+	bool store(const char* p, size_t n, std::vector<char>& packed,
+			   std::vector<unsigned int>& table, async_sink_metrics& done);
+	// End the LZ4 frame
+	bool finish(async_sink_metrics& done);
+
+	struct pending
+	{
+		char* p;
+		size_t n;
+	};
+
+	int _Fd;
+	size_t _Size;
+	async_sink_sync _Sync;
+	async_sink_format _Format;
+	bool _Started;	// the frame header has been written
+	char* _Fill;
+	size_t _Used;
+	std::vector<char> _Storage;
+	std::vector<char*> _Free;
+	std::deque<pending> _Pending;
+	bool _Busy;
+	bool _Stop;
+	bool _Ok;
+	std::coroutine_handle<> _Waiter;	// a suspended writer
+	size_t _WaitFor;					// the bytes it will write
+	std::vector<char> _Packed;			// for the thread writing a buffer
+	std::vector<unsigned int> _Table;
+	std::chrono::milliseconds _Interval;
+	std::chrono::steady_clock::time_point _Handed;	// when a buffer last was
+	async_sink_metrics _Metrics;
+	mutable std::mutex _Lock;
+	std::condition_variable _Ready;	// work for the I/O thread
+	std::condition_variable _Done;	// a buffer is free again
+	std::thread _Thread;
+};
+
+//------------------------------------------------------
+// UTF-8
+//------------------------------------------------------
+
+// Encode the n wide characters at p as UTF-8 at out, which has room for
+// 4 * n + 3 bytes, and return the number of bytes.  wchar_t holds UTF-16
+// or UTF-32, whichever the platform uses.  A high surrogate at the end of
+// p is kept in carry, which starts as 0, to pair with the next call's
+// first character.  Anything that isn't a character becomes U+FFFD.
+// Runs of ASCII are copied several characters at a time.
+size_t utf8_encode(const wchar_t* p, size_t n, char* out, wchar_t& carry);
+
+//------------------------------------------------------
+// TEMPLATE CLASS utf8_sink
+// Encodes wide output as UTF-8 for a sink of bytes, so a wide stream can
+// write a UTF-8 file without going through a codecvt facet, eg.
+//
+// fd_sink file(fd);
+// utf8_sink<fd_sink> utf8(file);
+// wsinkbuf<utf8_sink<fd_sink> > buf(utf8);
+// std::wostream os(&buf);
+// woformatstream ofs(L"%s=%d\n", &os);
+//------------------------------------------------------
+const size_t utf8_sink_buffer = 8192;
+
+template <typename _Sink>
+class utf8_sink
+{
+public:
+	explicit utf8_sink(_Sink& sink)
+		: _Next(sink), _Used(0), _Carry(0)
+	{}
+
+	~utf8_sink()
+	{
+		pass_on();
+	}
+
+	// Encoded into a buffer, which is passed on as it fills
+	void write(const wchar_t* p, size_t n)
+	{
+		while (n)
+		{
+			if (utf8_sink_buffer - _Used < 7)
+			{	// not room for one character and a carried U+FFFD
+				pass_on();
+				continue;
+			}
+			size_t room = (utf8_sink_buffer - _Used - 3) / 4;
+			size_t chunk = n < room ? n : room;
+			_Used += utf8_encode(p, chunk, _Buf + _Used, _Carry);
+			p += chunk;
+			n -= chunk;
+		}
+	}
+
+	void write_stable(const wchar_t* p, size_t n)
+	{ write(p, n); }
+
+	bool flush()
+	{
+		pass_on();
+		return _Next.flush();
+	}
+
+	_Sink& sink()
+	{ return _Next; }
+
+private:
+	void pass_on()
+	{
+		if (_Used)
+		{
+			_Next.write(_Buf, _Used);
+			_Used = 0;
+		}
+	}
+
+	_Sink& _Next;
+	size_t _Used;
+	wchar_t _Carry;
+	char _Buf[utf8_sink_buffer];
+};
+
+// Append the data in the LZ4 frames from p to p + n to out.
+// Returns false if they are not valid LZ4 frames.
+bool lz4_frame_decode(const char* p, size_t n, std::string& out);
+
+template <typename _Sink>
+using sinkbuf = basic_sinkbuf<_Sink, char>;
+template <typename _Sink>
+using wsinkbuf = basic_sinkbuf<_Sink, wchar_t>;
+
+typedef basic_buffer_sink<char> buffer_sink;
+typedef basic_buffer_sink<wchar_t> wbuffer_sink;
+typedef basic_string_sink<char> string_sink;
+typedef basic_string_sink<wchar_t> wstring_sink;
+typedef basic_callback_sink<char> callback_sink;
+typedef basic_callback_sink<wchar_t> wcallback_sink;
+
+#endif // _oformatsink_
@@ -1,16 +1,22 @@
 #include "stdafx.h"
 
 #pragma warning ( disable : 4786 )
+#pragma warning ( disable : 4996 )
 
+#include <atomic>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
 #include "oformatstream.hpp"
 
 template <typename _E>
 void __cdecl format_manip(std::ios_base& io, basic_formatter<_E>& f)
 {
-	basic_formatterfield<_E>& ff = f.next();
-	io.width(ff.width);
-	io.precision(ff.precision);
-	io.flags(ff.flags);
+	const typename basic_formatter<_E>::table_type& t = f.table();
+	typename basic_formatter<_E>::size_type n = f.advance();
+	io.width(t.width(n));
+	io.precision(t.precision(n));
+	io.flags(t.flags(n));
 }
 
 void __cdecl formatspec_manip(std::ios_base& io, const format_specification& fs)
@@ -56,6 +62,358 @@ reformat(const wformatter& f)
 		(&reformat_manip<wchar_t,std::char_traits<wchar_t> >, f);
 }
 
+const char* format_error_text(format_error e)
+{
+	switch (e)
+	{
+	case format_error_none:			return "no error";
+	case format_error_incomplete:	return "format ends inside a specification";
+	case format_error_type:			return "expected a flag, width, precision, size or type";
+	case format_error_unsupported:	return "%n is not supported";
+	case format_error_argument:		return "arguments are numbered from 1$ and names can't be empty";
+	case format_error_range:		return "number too large";
+	case format_error_star:			return "'*' can't be used with positional or named arguments";
+	case format_error_name:			return "name not in the formatter's name list";
+	}
+	return "unknown error";
+}
+
+// Work is handed out to the threads in blocks of this many formats,
+// so a few slow ones don't hold up the rest.
+static const size_t parallel_block = 64;
+
+template <typename _E>
+static size_t validate(const std::vector<std::basic_string<_E> >& formats,
+					   std::vector<format_parse_result>& results,
+					   unsigned int threads)
+{
+	results.assign(formats.size(), format_parse_result());
+	std::atomic<size_t> rejected(0);
+	format_parallel_blocks(formats.size(), parallel_block, threads, [&](size_t n, size_t last)
+	{
+		size_t count(0);
+		for (; n < last; ++n)
+		{
+			basic_formatter<_E> f(formats[n]);
+			results[n] = f.parse_result();
+			if (!results[n].ok()) ++count;
+		}
+		rejected += count;
+	});
+	return rejected;
+}
+
+size_t format_validate(const std::vector<std::string>& formats,
+					   std::vector<format_parse_result>& results,
+					   unsigned int threads)
+{
+	return validate(formats, results, threads);
+}
+
+size_t format_validate(const std::vector<std::wstring>& formats,
+					   std::vector<format_parse_result>& results,
+					   unsigned int threads)
+{
+	return validate(formats, results, threads);
+}
+
+//------------------------------------------------------
+// basic_format_catalog
+//
+// The cache file holds, in the machine's own byte order
+//	header	"OFMC", format_cache_version, sizeof(_E), number of formats,
+//			hash of the formats and default format specification
+//	each format
+//			its format_parse_result, number of fields
+//			each field: flags, width, precision, fill, textonly, widtharg,
+//			precarg, argument, then the lengths and characters of its
+//			text and name
+// Every value, apart from the characters, is written 7 bits to a byte,
+// least significant first, the top bit set in all but the last byte.
+// The argument is written plus 1, as it may be -1.
+// Change format_cache_version with the layout or the meaning of any
+// compiled field, so older files are ignored.
+//------------------------------------------------------
+static const char format_cache_magic[4] = { 'O', 'F', 'M', 'C' };
+static const unsigned long long format_cache_version = 1;
+
+// Mixes the bytes of v into h, eight at a time
+static void cache_hash(unsigned long long& h, const void* v, size_t n)
+{
+	const char* p = static_cast<const char*>(v);
+	for (;;)
+	{
+		unsigned long long w(n);
+		memcpy(&w, p, n < sizeof(w) ? n : sizeof(w));
+		h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+		h ^= h >> 32;
+		if (n <= sizeof(w))
+		{
+			break;
+		}
+		p += sizeof(w);
+		n -= sizeof(w);
+	}
+}
+
+template <typename _E, typename _Tr>
+static unsigned long long catalog_hash(
+	const std::vector<std::basic_string<_E,_Tr> >& formats,
+	const format_specification& fs)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	unsigned long long spec[3] = {
+		static_cast<unsigned long long>(fs.width),
+		static_cast<unsigned long long>(fs.precision),
+		static_cast<unsigned long long>(*const_cast<format_flags*>(&fs.flags))
+	};
+	cache_hash(h, spec, sizeof(spec));
+	for (size_t n = 0; n < formats.size(); ++n)
+	{
+		cache_hash(h, formats[n].data(), formats[n].size() * sizeof(_E));
+	}
+	return h;
+}
+
+// Appends values to, and reads them back from, a cache file image
+class cache_image
+{
+public:
+	cache_image() : _at(0), _ok(true) {}
+
+	std::string& data()
+	{ return _data; }
+
+	bool ok() const
+	{ return _ok; }
+
+	void put(unsigned long long v)
+	{
+		while (v >= 0x80)
+		{
+			_data += static_cast<char>(v | 0x80);
+			v >>= 7;
+		}
+		_data += static_cast<char>(v);
+	}
+
+	template <typename _E, typename _Tr>
+	void put(const std::basic_string<_E,_Tr>& s)
+	{
+		put(s.size());
+		_data.append(reinterpret_cast<const char*>(s.data()), s.size() * sizeof(_E));
+	}
+
+	unsigned long long get()
+	{
+		unsigned long long v(0);
+		for (int shift = 0; _ok; shift += 7)
+		{
+			if (_at == _data.size() || shift > 63)
+			{
+				_ok = false;
+				return 0;
+			}
+			unsigned char b = static_cast<unsigned char>(_data[_at++]);
+			v |= static_cast<unsigned long long>(b & 0x7F) << shift;
+			if (b < 0x80)
+			{
+				break;
+			}
+		}
+		return v;
+	}
+
+	template <typename _E, typename _Tr>
+	void get(std::basic_string<_E,_Tr>& s)
+	{
+		unsigned long long len = get();
+		if (_ok && (_data.size() - _at) / sizeof(_E) >= len)
+		{
+			s.resize(static_cast<size_t>(len));
+			memcpy(&s[0], _data.data() + _at, s.size() * sizeof(_E));
+			_at += s.size() * sizeof(_E);
+		}
+		else
+		{
+			_ok = false;
+		}
+	}
+
+	bool at_end() const
+	{ return _at == _data.size(); }
+
+private:
+	std::string _data;
+	size_t _at;
+	bool _ok;
+};
+
+template <typename _E, typename _Tr>
+void basic_format_catalog<_E,_Tr>::compile(const string_vector& formats,
+										   unsigned int threads)
+{
+	std::vector<formatter_type> table(formats.size());
+	std::atomic<size_type> rejected(0);
+	format_parallel_blocks(formats.size(), parallel_block, threads, [&](size_t n, size_t last)
+	{
+		size_type count(0);
+		for (; n < last; ++n)
+		{
+			table[n] = formatter_type(formats[n], _default_format);
+			if (!table[n].parse_result().ok()) ++count;
+		}
+		rejected += count;
+	});
+	_table.swap(table);
+	_rejected = rejected;
+	_hash = catalog_hash(formats, _default_format);
+}
+
+template <typename _E, typename _Tr>
+bool basic_format_catalog<_E,_Tr>::save(const char* path) const
+{
+	cache_image image;
+	image.data().assign(format_cache_magic, sizeof(format_cache_magic));
+	image.put(format_cache_version);
+	image.put(sizeof(_E));
+	image.put(_table.size());
+	image.put(_hash);
+	for (size_type n = 0; n < _table.size(); ++n)
+	{
+		const format_parse_result& r = _table[n].parse_result();
+		image.put(r.error);
+		image.put(r.offset);
+		image.put(r.field);
+		image.put(r.fields);
+		image.put(r.specifications);
+		image.put(r.length);
+		const typename formatter_type::_Myffv& ffv = _table[n].fields();
+		image.put(ffv.size());
+		for (size_type f = 0; f < ffv.size(); ++f)
+		{
+			const typename formatter_type::field_type& ff = ffv[f];
+			image.put(static_cast<std::ios_base::fmtflags>(*const_cast<format_flags*>(&ff.flags)));
+			image.put(ff.width);
+			image.put(ff.precision);
+			image.put(static_cast<unsigned long long>(ff.fill));
+			image.put(ff.textonly);
+			image.put(ff.widtharg);
+			image.put(ff.precarg);
+			image.put(ff.argument + 1);
+			image.put(ff.text);
+			image.put(ff.name);
+		}
+	}
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		return false;
+	}
+	bool ok = fwrite(image.data().data(), 1, image.data().size(), file)
+		== image.data().size();
+	return (0 == fclose(file)) && ok;
+}
+
+template <typename _E, typename _Tr>
+bool basic_format_catalog<_E,_Tr>::load(const char* path,
+										const string_vector& formats)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+	{
+		return false;
+	}
+	cache_image image;
+	long size(-1);
+	if (0 == fseek(file, 0, SEEK_END) && (size = ftell(file)) > 0 &&
+		0 == fseek(file, 0, SEEK_SET))
+	{
+		image.data().resize(size);
+		image.data().resize(fread(&image.data()[0], 1, size, file));
+	}
+	fclose(file);
+
+	unsigned long long hash = catalog_hash(formats, _default_format);
+	if (image.data().compare(0, sizeof(format_cache_magic), format_cache_magic,
+							 sizeof(format_cache_magic)))
+	{
+		return false;
+	}
+	image.data().erase(0, sizeof(format_cache_magic));
+	if (image.get() != format_cache_version ||
+		image.get() != sizeof(_E) ||
+		image.get() != formats.size() ||
+		image.get() != hash)
+	{
+		return false;
+	}
+
+	std::vector<formatter_type> table(formats.size());
+	size_type rejected(0);
+	for (size_type n = 0; n < table.size() && image.ok(); ++n)
+	{
+		format_parse_result r;
+		unsigned long long error = image.get();
+		if (error > format_error_name)
+		{
+			return false;	// corrupt
+		}
+		r.error = static_cast<format_error>(error);
+		r.offset = static_cast<size_t>(image.get());
+		r.field = static_cast<size_t>(image.get());
+		r.fields = static_cast<size_t>(image.get());
+		r.specifications = static_cast<size_t>(image.get());
+		r.length = static_cast<size_t>(image.get());
+		unsigned long long nfields = image.get();
+		typename formatter_type::_Myffv ffv;
+		ffv.reserve(static_cast<size_t>(std::min<unsigned long long>(nfields, 1024)));
+		for (unsigned long long f = 0; f < nfields && image.ok(); ++f)
+		{
+			typename formatter_type::field_type ff;
+			ff.flags = static_cast<std::ios_base::fmtflags>(image.get());
+			ff.width = static_cast<std::streamsize>(image.get());
+			ff.precision = static_cast<std::streamsize>(image.get());
+			ff.fill = static_cast<_E>(image.get());
+			ff.textonly = 0 != image.get();
+			ff.widtharg = 0 != image.get();
+			ff.precarg = 0 != image.get();
+			ff.argument = static_cast<int>(image.get()) - 1;
+			image.get(ff.text);
+			image.get(ff.name);
+			ffv.push_back(std::move(ff));
+		}
+		table[n] = formatter_type(std::move(ffv), r, _default_format);
+		if (!r.ok()) ++rejected;
+	}
+	if (!image.ok() || !image.at_end())
+	{
+		return false;	// truncated or corrupt
+	}
+	_table.swap(table);
+	_rejected = rejected;
+	_hash = hash;
+	return true;
+}
+
+template <typename _E, typename _Tr>
+bool basic_format_catalog<_E,_Tr>::open(const char* path,
+										const string_vector& formats,
+										unsigned int threads)
+{
+	if (load(path, formats))
+	{
+		return true;
+	}
+	compile(formats, threads);
+	save(path);
+	return false;
+}
+
+template class basic_format_catalog<char, std::char_traits<char> >;
+template class basic_format_catalog<wchar_t, std::char_traits<wchar_t> >;
+
 //////////////////////////////////////////////////////////////////////
 #if 0
 #include <iostream>
@@ -40,7 +40,24 @@
 //
 //
 /*
-%[flags] [width] [.precision] [{h | l | I64 | L}]type
+%[argument] [flags] [width] [.precision] [{h | l | ll | I32 | I64 | L}]type
+
+argument:
+n$		The n'th inserted value (counting from 1), eg. "%2$s %1$d".
+{name}	The value named in the basic_formatter constructor's name list.
+
+size:
+h, l, ll, I32, I64, L are accepted but have no effect. The inserters are
+		type aware so a value is always shown at its own size, never narrowed.
+
+width, precision:
+*		Taken from the next inserted integer value, before the field's value.
+		A negative width left aligns, a negative precision is ignored.
+		Not available with positional or named arguments.
+.		Alone, without digits or '*', is a precision of 0 as for printf.
+
+A format which doesn't follow this grammar is rejected, up to the field in
+error is kept, and basic_formatter::parse_result() says where and why.
 
 flags:
 -	Left align the result within the given field width.  Right align.
@@ -91,6 +108,8 @@ s	String  A character string. Characters are printed up to the first null
 	or until the precision value is reached.
 p	Pointer to void. Prints the address pointed to by the argument in the form
 	xxxxxxxx where x are uppercase hexadecimal digits. 
+	There are always two digits per byte of a pointer, ie. 16 on a 64 bit
+	platform, and the # flag adds a leading 0X.
 
 NOT SUPPORTED
 n	Pointer to integer.
@@ -135,9 +154,54 @@ boolalpha,	to insert or extract objects of type bool as names
 #ifndef _INC_FLOAT
 #include <float.h>
 #endif
+#ifndef _INC_LIMITS
+#include <limits.h>
+#endif
 #ifndef _VECTOR_
 #include <vector>
 #endif
+#ifndef _SSTREAM_
+#include <sstream>
+#endif
+#ifndef _SPAN_
+#include <span>
+#endif
+#ifndef _TYPE_TRAITS_
+#include <type_traits>
+#endif
+#ifndef _CHARCONV_
+#include <charconv>
+#endif
+#ifndef _ALGORITHM_
+#include <algorithm>
+#endif
+#ifndef _BIT_
+#include <bit>
+#endif
+#ifndef _CHRONO_
+#include <chrono>
+#endif
+#ifndef _CSTDINT_
+#include <cstdint>
+#endif
+#ifndef _ATOMIC_
+#include <atomic>
+#endif
+#ifndef _THREAD_
+#include <thread>
+#endif
+#ifndef _TUPLE_
+#include <tuple>
+#endif
+#ifndef _MEMORY_
+#include <memory>
+#endif
+#ifndef _MUTEX_
+#include <mutex>
+#endif
+#include "oformatdigits.hpp"
+#include "oformattrace.hpp"
+#include "oformatsink.hpp"
 #ifndef _STRING_
 //#include <string>
 #endif
@@ -325,40 +389,59 @@ struct format_specification
 //
 // Provides a central place for storing constants required by the parsing routines.
 // Currently _E may be either char or wchar_t.
+// These are all in the basic character set, which has the same values
+// in every locale, so no ctype facet is needed to widen them.
 //------------------------------------------------------
 template <typename _E>
-struct format_characters: private std::ctype<_E>
-{
-	inline _E blank()   { return std::ctype<_E>::widen(' '); }
-	inline _E minus()   { return std::ctype<_E>::widen('-'); }
-	inline _E plus()    { return std::ctype<_E>::widen('+'); }
-	inline _E zero()    { return std::ctype<_E>::widen('0'); }
-	inline _E hash()    { return std::ctype<_E>::widen('#'); }
-	inline _E percent() { return std::ctype<_E>::widen('%'); }
-	inline _E dot()     { return std::ctype<_E>::widen('.'); }
-
-	inline _E c()       { return std::ctype<_E>::widen('c'); }
-	inline _E d()       { return std::ctype<_E>::widen('d'); }
-	inline _E i()       { return std::ctype<_E>::widen('i'); }
-	inline _E o()       { return std::ctype<_E>::widen('o'); }
-	inline _E u()       { return std::ctype<_E>::widen('u'); }
-	inline _E x()       { return std::ctype<_E>::widen('x'); }
-	inline _E X()       { return std::ctype<_E>::widen('X'); }
-	inline _E e()       { return std::ctype<_E>::widen('e'); }
-	inline _E E()       { return std::ctype<_E>::widen('E'); }
-	inline _E f()       { return std::ctype<_E>::widen('f'); }
-	inline _E g()       { return std::ctype<_E>::widen('g'); }
-	inline _E G()       { return std::ctype<_E>::widen('G'); }
-	inline _E n()       { return std::ctype<_E>::widen('n'); }
-	inline _E p()       { return std::ctype<_E>::widen('p'); }
-	inline _E s()       { return std::ctype<_E>::widen('s'); }
+struct format_characters
+{
+	inline _E blank()   { return static_cast<_E>(' '); }
+	inline _E minus()   { return static_cast<_E>('-'); }
+	inline _E plus()    { return static_cast<_E>('+'); }
+	inline _E zero()    { return static_cast<_E>('0'); }
+	inline _E hash()    { return static_cast<_E>('#'); }
+	inline _E percent() { return static_cast<_E>('%'); }
+	inline _E dot()     { return static_cast<_E>('.'); }
+	inline _E dollar()  { return static_cast<_E>('$'); }
+	inline _E star()    { return static_cast<_E>('*'); }
+	inline _E lbrace()  { return static_cast<_E>('{'); }
+	inline _E rbrace()  { return static_cast<_E>('}'); }
+
+	inline _E c()       { return static_cast<_E>('c'); }
+	inline _E d()       { return static_cast<_E>('d'); }
+	inline _E i()       { return static_cast<_E>('i'); }
+	inline _E o()       { return static_cast<_E>('o'); }
+	inline _E u()       { return static_cast<_E>('u'); }
+	inline _E x()       { return static_cast<_E>('x'); }
+	inline _E X()       { return static_cast<_E>('X'); }
+	inline _E e()       { return static_cast<_E>('e'); }
+	inline _E E()       { return static_cast<_E>('E'); }
+	inline _E f()       { return static_cast<_E>('f'); }
+	inline _E g()       { return static_cast<_E>('g'); }
+	inline _E G()       { return static_cast<_E>('G'); }
+	inline _E n()       { return static_cast<_E>('n'); }
+	inline _E p()       { return static_cast<_E>('p'); }
+	inline _E s()       { return static_cast<_E>('s'); }
 
 	// These are valid but ignored since operator<<() is type aware
-	inline _E h()       { return std::ctype<_E>::widen('h'); }
-	inline _E l()       { return std::ctype<_E>::widen('l'); }
-	inline _E L()       { return std::ctype<_E>::widen('L'); }
+	inline _E h()       { return static_cast<_E>('h'); }
+	inline _E l()       { return static_cast<_E>('l'); }
+	inline _E L()       { return static_cast<_E>('L'); }
+	inline _E I()       { return static_cast<_E>('I'); }
+
+	inline bool isDigit(_E ch)
+	{
+		return ch >= zero() && ch <= static_cast<_E>('9');
+	}
+
+	// A size prefix, "ll", "I32" and "I64" being made of these
+	inline bool isSize(_E ch)
+	{
+		return ch == h() || ch == l() || ch == L() || ch == I();
+	}
 
-	inline bool isFormatType(_E ch)
+	// The type character which ends a format specification
+	inline bool isConversion(_E ch)
 	{
 		return
 			(
@@ -375,10 +458,7 @@ struct format_characters: private std::ctype<_E>
 			ch == g() ||
 			ch == G() ||
 			ch == p() ||
-			ch == s() ||
-			ch == l() ||
-			ch == h() ||
-			ch == L()
+			ch == s()
 			);
 	}
 };
@@ -391,13 +471,16 @@ struct format_characters: private std::ctype<_E>
 template <typename _E, typename _Tr = std::char_traits<_E> >
 struct basic_formatterfield : public format_specification
 {
-	basic_formatterfield() {
+	basic_formatterfield()
+		: textonly(false), widtharg(false), precarg(false), argument(-1)
+	{
 		format_characters<_E> fc;
 		fill = fc.blank();
 	}
 
 	explicit basic_formatterfield(const format_specification& fs)
-		: format_specification(fs)
+		: format_specification(fs), textonly(false),
+		  widtharg(false), precarg(false), argument(-1)
 	{
 		format_characters<_E> fc;
 		fill = fc.blank();
@@ -410,9 +493,18 @@ struct basic_formatterfield : public format_specification
 
 	std::basic_string<_E,_Tr> text;	// plain text to be printed
 	_E fill;
+	bool textonly;	// no format specification followed the text
+	bool widtharg;	// "*" width, taken from the argument stream
+	bool precarg;	// ".*" precision, taken from the argument stream
+	int argument;	// zero based "%n$" argument, -1 if not given
+	std::basic_string<_E,_Tr> name;	// "%{name}" argument, if given
 	void clear()
 	{
 		text.erase();
+		textonly = false;
+		widtharg = precarg = false;
+		argument = -1;
+		name.erase();
 		format_specification::reset();
 	}
 };
@@ -424,6 +516,170 @@ template <typename _E, typename _Tr = std::char_traits<_E> >
 class  FormatFieldVector : public std::vector< basic_formatterfield<_E,_Tr> >
 {};
 
+//------------------------------------------------------
+// TEMPLATE CLASS basic_format_table
+// A basic_formatter's fields packed for output, as a structure of arrays.
+// All a field needs apart from its text is found by index in one block
+// of 32 bit words, 16 bytes a field, and the text of every field is held
+// end to end in one string.  So a format of a few fields fits in a cache
+// line or two, and outputting it never visits the fields themselves.
+// Widths and precisions are held in 16 bits, the rare larger value
+// is held aside.
+// An empty format is held as its default field, so entry 0 always exists.
+//------------------------------------------------------
+template <typename _E, typename _Tr = std::char_traits<_E> >
+class basic_format_table
+{
+public:
+	typedef size_t size_type;
+
+	basic_format_table()
+		: _count(0)
+	{}
+
+	void build(const FormatFieldVector<_E,_Tr>& ffv,
+			   const basic_formatterfield<_E,_Tr>& default_ff)
+	{
+		const basic_formatterfield<_E,_Tr>* ff = ffv.empty() ? &default_ff : &ffv[0];
+		size_type n;
+		_count = ffv.empty() ? 1 : ffv.size();
+		_words.assign(4 * _count + 1, 0);
+		_large.clear();
+		_text.erase();
+		for (n = 0; n < _count; ++n)
+		{
+			typedef typename std::make_unsigned<_E>::type _Uch;
+			_words[n] = static_cast<std::uint32_t>(
+				static_cast<SIB(fmtflags)>(*const_cast<format_flags*>(&ff[n].flags)));
+			_words[_count + n] = pack(n, 0, ff[n].width) | pack(n, 1, ff[n].precision) << 16;
+			_words[2 * _count + n] =
+				(static_cast<std::uint32_t>(static_cast<_Uch>(ff[n].fill)) & fill_mask) |
+				(ff[n].textonly ? textonly_bit : 0) |
+				(ff[n].widtharg ? widtharg_bit : 0) |
+				(ff[n].precarg ? precarg_bit : 0);
+			_words[3 * _count + n] = static_cast<std::uint32_t>(_text.size());
+			_text += ff[n].text;
+		}
+		_words[4 * _count] = static_cast<std::uint32_t>(_text.size());
+	}
+
+	// Number of entries, 1 for an empty format
+	size_type size() const
+	{ return _count; }
+
+	SIB(fmtflags) flags(size_type n) const
+	{ return static_cast<SIB(fmtflags)>(_words[n]); }
+
+	std::streamsize width(size_type n) const
+	{ return unpack(n, 0); }
+
+	std::streamsize precision(size_type n) const
+	{ return unpack(n, 1); }
+
+	_E fill(size_type n) const
+	{ return static_cast<_E>(_words[2 * _count + n] & fill_mask); }
+
+	bool textonly(size_type n) const
+	{ return (_words[2 * _count + n] & textonly_bit) != 0; }
+
+	bool widtharg(size_type n) const
+	{ return (_words[2 * _count + n] & widtharg_bit) != 0; }
+
+	bool precarg(size_type n) const
+	{ return (_words[2 * _count + n] & precarg_bit) != 0; }
+
+	const _E* text(size_type n) const
+	{ return _text.data() + _words[3 * _count + n]; }
+
+	size_t text_size(size_type n) const
+	{ return _words[3 * _count + n + 1] - _words[3 * _count + n]; }
+
+	// True if t outputs exactly as this does
+	bool operator==(const basic_format_table& t) const
+	{
+		return _count == t._count && _words == t._words &&
+			_text == t._text && _large == t._large;
+	}
+
+private:
+	static const std::uint32_t fill_mask = 0x00FFFFFF;
+	static const std::uint32_t textonly_bit = 0x01000000;
+	static const std::uint32_t widtharg_bit = 0x02000000;
+	static const std::uint32_t precarg_bit = 0x04000000;
+	static const std::uint32_t held_aside = 0xFFFF;
+
+	// The 16 bit form of width (which 0) or precision (which 1) v of field n
+	std::uint32_t pack(size_type n, int which, std::streamsize v)
+	{
+		if (v >= 0 && v < static_cast<std::streamsize>(held_aside))
+		{
+			return static_cast<std::uint32_t>(v);
+		}
+		if (_large.empty())
+		{
+			_large.resize(2 * _count);
+		}
+		_large[2 * n + which] = v;
+		return held_aside;
+	}
+
+	std::streamsize unpack(size_type n, int which) const
+	{
+		std::uint32_t v = (_words[_count + n] >> (16 * which)) & 0xFFFF;
+		return held_aside == v ? _large[2 * n + which] : static_cast<std::streamsize>(v);
+	}
+
+	size_type _count;
+	std::vector<std::uint32_t> _words;	// flags, sizes, fill and bits, text offsets
+	std::basic_string<_E,_Tr> _text;
+	std::vector<std::streamsize> _large;	// sizes of held_aside fields, if any
+};
+
+//------------------------------------------------------
+// ENUM format_error
+// Why a format string was rejected, see format_parse_result.
+//------------------------------------------------------
+enum format_error
+{
+	format_error_none,
+	format_error_incomplete,	// the format ends inside a specification
+	format_error_type,			// a character that can't start or end a specification
+	format_error_unsupported,	// %n
+	format_error_argument,		// "0$" or "{}"
+	format_error_range,			// a width, precision or argument over INT_MAX
+	format_error_star,			// a '*' in a format with positional arguments
+	format_error_name			// a name not in the formatter's name list
+};
+
+// A short description of e, eg. "format ends inside a specification"
+const char* format_error_text(format_error e);
+
+//------------------------------------------------------
+// STRUCT format_parse_result
+// Where and why parsing a format string stopped,
+// and what was found up to that point.
+//------------------------------------------------------
+struct format_parse_result
+{
+	format_parse_result()
+		: error(format_error_none), offset(0), field(0),
+		  fields(0), specifications(0), length(0)
+	{}
+
+	bool ok() const
+	{ return format_error_none == error; }
+
+	const char* reason() const
+	{ return format_error_text(error); }
+
+	format_error error;
+	size_t offset;			// of the character in error, or the length if the format stopped short
+	size_t field;			// index of the field in error
+	size_t fields;			// fields parsed, including text only ones
+	size_t specifications;	// fields with a format specification
+	size_t length;			// characters in the format
+};
+
 //------------------------------------------------------
 // Parsing routines
 //------------------------------------------------------
@@ -435,7 +691,9 @@ class  FormatFieldVector : public std::vector< basic_formatterfield<_E,_Tr> >
 template <typename _E>
 SIB(fmtflags) format_flag_from_char(const _E ch)
 {
-	format_flags flags;
+	// Plain fmtflags, as format_flags would default the alignment
+	// to right and so override a '-' flag already parsed.
+	SIB(fmtflags) flags(SIB(_Fmtzero));
 	format_characters<_E> fc;
 
 	if (ch == fc.E() ||
@@ -447,8 +705,6 @@ SIB(fmtflags) format_flag_from_char(const _E ch)
 	else if (ch == fc.hash())	flags |= SIB(showbase);
 	else if (ch == fc.plus())	flags |= SIB(showpos);
 	else if (ch == fc.minus())	flags |= SIB(left);
-	else if (ch == fc.c())		flags |= SIB(right);
-	else if (ch == fc.s())		flags |= SIB(right);
 	else if (ch == fc.d() ||
 			 ch == fc.i() ||
 			 ch == fc.u())		flags |= SIB(dec);
@@ -464,10 +720,36 @@ SIB(fmtflags) format_flag_from_char(const _E ch)
 	return flags;
 };
 
+//------------------------------------------------------
+// append_digit
+// Adds the decimal digit ch to the value n.
+// Returns false, leaving n alone, if the result would exceed INT_MAX.
+//------------------------------------------------------
+template <typename _E, typename _Ty>
+bool append_digit(_Ty& n, const _E ch)
+{
+	format_characters<_E> fc;
+	int d = static_cast<int>(ch - fc.zero());
+	if (n > (INT_MAX - d) / 10)
+	{
+		return false;
+	}
+	n = n * 10 + d;
+	return true;
+}
+
 //------------------------------------------------------
 // parse_format_specification
 // Called by parse_field<_E>() to process a single field's format specification.
 // ie. everything after the percent (%) symbol.
+// A '*' width or precision sets widtharg or precarg, the value is then
+// taken from the argument stream when the field is output.
+//
+// The specification is read strictly left to right, flags, width,
+// precision, size then type, and each character either is consumed or
+// moves the state on, so the time taken is linear in its length.
+// On failure error says why and it is left at the offending character,
+// or at end if the format stopped short.
 //------------------------------------------------------
 template <typename _E, typename _Iter>
 bool parse_format_specification(
@@ -475,129 +757,146 @@ bool parse_format_specification(
 	_Iter& end,
 	format_specification& outfs,
 	bool& widthset, bool& precset,
-	_E& fillchar)
+	bool& widtharg, bool& precarg,
+	_E& fillchar,
+	format_error& error)
 {
-	bool ok(true), done(false);
+	bool done(false), precdigits(false);
 	widthset = precset = false;
+	widtharg = precarg = false;
 	format_specification fs(0,0);
-	SIB(fmtflags) ftemp(SIB(_Fmtzero));
 	format_characters<_E> fc;
-	SIB(fmtflags) flags(SIB(_Fmtzero));
-	enum { inFlags, inWidth, inPrecision, inType} status = inFlags;
-	while (it != end && !done && ok)
+	enum { inFlags, inWidth, inPrecision, inSize, inType } status = inFlags;
+	error = format_error_none;
+	while (!done && format_error_none == error)
 	{
+		if (it == end)
+		{
+			error = format_error_incomplete;
+			break;
+		}
+		const _E ch = *it;
 		switch (status)
 		{
 		case inFlags:
-			if (fc.zero() == *it)
-			{
-				fillchar = *it;
-				break;
-			}
-			else if (std::isdigit(*it))
+			if (fc.zero() == ch || fc.blank() == ch)
 			{
-				status = inWidth;	// fall through to next case
+				fillchar = ch;
 			}
-			else if (fc.isFormatType(*it))
+			else if (fc.hash()  == ch ||
+					 fc.plus()  == ch ||
+					 fc.minus() == ch)
 			{
-				status = inType;		// fall straight through inType case
+				fs.flags |= format_flag_from_char(ch);
 			}
 			else
 			{
-				if (fc.hash()  == *it ||
-					fc.plus()  == *it ||
-					fc.minus() == *it)
-				{
-					fs.flags |= format_flag_from_char(*it);
-				}
-				else if (fc.blank() == *it)
-				{
-					fillchar = *it;
-				}
-				else
-				{
-					status = inWidth;
-				}
-				break;
+				status = inWidth;
+				continue;
 			}
+			break;
 		case inWidth:
-			if (inWidth == status)
+			if (fc.isDigit(ch) && !widtharg)
 			{
-				if (std::isdigit(*it))
-				{
-					fs.width *= 10;
-					fs.width += (*it - fc.zero());
-					widthset = true;
-					break;
-				}
-				else if (fc.dot() == *it)
-				{
-					status = inPrecision;	// fall through to inPrecision case
-					fs.flags |= SIB(showpoint);
-					++it;
-					if (it == end)
-					{
-						ok = false;
-						done = true;
-						break;
-					}
-				}
-				else if (fc.isFormatType(*it))
-				{
-					status = inType;		// fall straight through inType case
-				}
-				else
+				if (!append_digit(fs.width, ch))
 				{
-					ok = false;
+					error = format_error_range;
+					continue;
 				}
-			}	// otherwise falling through
+				widthset = true;
+			}
+			else if (fc.star() == ch && !widthset)
+			{
+				widthset = widtharg = true;
+			}
+			else if (fc.dot() == ch)
+			{	// as printf, a '.' alone is a precision of 0
+				status = inPrecision;
+				fs.flags |= SIB(showpoint);
+				precset = true;
+			}
+			else
+			{
+				status = inSize;
+				continue;
+			}
+			break;
 		case inPrecision:
-			if (inPrecision == status)
+			if (fc.isDigit(ch) && !precarg)
 			{
-				if (std::isdigit(*it))
-				{
-					fs.precision *= 10;
-					fs.precision += (*it - fc.zero());
-					precset = true;
-					break;
-				}
-				else if (fc.isFormatType(*it))
-				{
-					status = inType;		// fall straight through inType case
-				}
-				else
+				if (!append_digit(fs.precision, ch))
 				{
-					ok = false;
+					error = format_error_range;
+					continue;
 				}
-			}	// otherwise falling through
+				precdigits = true;
+			}
+			else if (fc.star() == ch && !precdigits && !precarg)
+			{
+				precarg = true;
+			}
+			else
+			{
+				status = inSize;
+				continue;
+			}
+			break;
+		case inSize:
+			if (fc.I() == ch)
+			{	// Microsoft I, I32 or I64 size
+				while (++it != end && fc.isDigit(*it))
+					;
+				continue;
+			}
+			else if (!fc.isSize(ch))
+			{
+				status = inType;
+				continue;
+			}
+			break;
 		case inType:
-			if (fc.blank() == *it)
+			if (fc.isConversion(ch))
 			{
+				fs.flags |= format_flag_from_char(ch);
 				done = true;
 			}
+			else if (fc.n() == ch)
+			{
+				error = format_error_unsupported;
+				continue;
+			}
 			else
 			{
-				ftemp = format_flag_from_char(*it);
-				if (SIB(_Fmtzero) != ftemp)
-				{
-					fs.flags |= ftemp;
-				}
-				else if (!fc.isFormatType(*it))
-				{
-					done = true;
-				}
+				error = format_error_type;
+				continue;
 			}
 			break;
 		}
-		if (!done && it != end) ++it;
+		++it;
 	}
-	if (ok)
+	if (done)
 	{
+		if (fc.zero() == fillchar)
+		{	// as printf, zeros go after any sign or base, and '-' wins
+			if (static_cast<SIB(fmtflags)>(fs.flags) & SIB(left))
+			{
+				fillchar = fc.blank();
+			}
+			else
+			{
+				fs.flags |= SIB(internal);
+			}
+		}
+		if ((static_cast<SIB(fmtflags)>(fs.flags) & SIB(floatfield)) &&
+			(static_cast<SIB(fmtflags)>(fs.flags) & SIB(showbase)))
+		{	// '#' keeps the decimal point of %e and %f
+			fs.flags |= SIB(showpoint);
+		}
 		if (!fs.width)
 		{
 			fs.width = 1;
 		}
-		if (!fs.precision &&
+		if (!precset &&
 			((SIB(basefield) | SIB(floatfield))
 			 & static_cast<SIB(fmtflags)>(fs.flags)))
 		{
@@ -605,7 +904,71 @@ bool parse_format_specification(
 		}
 		outfs = fs;
 	}
-	return ok;
+	return done;
+}
+
+//------------------------------------------------------
+// parse_argument_reference
+// Called by parse_field<_E>() before the format specification is parsed.
+// Recognises a POSIX positional reference "n$" or a named reference "{name}"
+// and leaves it pointing at the format specification proper.
+// On failure it is left at the offending character, as for
+// parse_format_specification<_E>().
+//------------------------------------------------------
+template <typename _E, typename _Iter>
+bool parse_argument_reference(
+	_Iter& it,
+	_Iter& end,
+	basic_formatterfield<_E>& outff,
+	format_error& error)
+{
+	format_characters<_E> fc;
+	_Iter n = it;
+	if (fc.lbrace() == *it)
+	{
+		while (++n != end && fc.rbrace() != *n)
+			;
+		if (n == end)
+		{
+			it = n;
+			error = format_error_incomplete;
+			return false;
+		}
+		if (++it == n)
+		{
+			error = format_error_argument;	// empty name
+			return false;
+		}
+		outff.name.assign(it, n);
+		it = ++n;
+	}
+	else
+	{
+		int arg(0);
+		bool range(true);
+		while (n != end && fc.isDigit(*n))
+		{
+			range = append_digit(arg, *n) && range;
+			++n;
+		}
+		if (n == it || n == end || fc.dollar() != *n)
+		{
+			return true;	// just a width, leave it alone
+		}
+		if (!range || !arg)
+		{	// arguments are numbered from 1
+			error = range ? format_error_argument : format_error_range;
+			return false;
+		}
+		outff.argument = arg - 1;
+		it = ++n;
+	}
+	if (it == end)
+	{
+		error = format_error_incomplete;
+		return false;
+	}
+	return true;
 }
 
 //------------------------------------------------------
@@ -617,12 +980,14 @@ bool parse_format_specification(
 template<typename _E, typename _Iter>
 bool parse_field(_Iter& it, _Iter& end,
 				 basic_formatterfield<_E>& outff,
-				 format_specification& default_fs)
+				 format_specification& default_fs,
+				 format_error& error)
 {
 	bool ok(true), done(false), widthset(false), precset(false);
 	format_characters<_E> fc;
 	enum { inText, inField } status = inText;
 	outff.clear();
+	error = format_error_none;
 	while (it != end && !done && ok)
 	{
 		switch (status)
@@ -646,14 +1011,22 @@ bool parse_field(_Iter& it, _Iter& end,
 			}
 			else
 			{
-				ok = parse_format_specification<_E>(it,end,outff,
-					widthset,precset,outff.fill);
+				ok = parse_argument_reference<_E>(it,end,outff,error) &&
+					parse_format_specification<_E>(it,end,outff,
+						widthset,precset,outff.widtharg,outff.precarg,
+						outff.fill,error);
 				done = true;
 			}
 			break;
 		}
 		if (!done && it != end) ++it;
 	}
+	if (inField == status && !done)
+	{
+		error = format_error_incomplete;	// a '%' ending the format
+		ok = false;
+	}
+	outff.textonly = !done;
 	if (!widthset)
 	{
 		outff.width = default_fs.width;
@@ -670,270 +1043,2758 @@ bool parse_field(_Iter& it, _Iter& end,
 // Used by basic_formatter<_E> constructors to process a full format specification.
 // Calls parse_field<_E>() to build a basic_formatterfield which
 // it then stores in a FormatFieldVector.
+// The fields before any error are kept, result says where and why
+// the parse stopped.
 //------------------------------------------------------
 template <typename _E>
 bool parse_format(
-	std::basic_string<_E> fs,
+	const std::basic_string<_E>& fs,
 	FormatFieldVector<_E>& ffv,
-	format_specification& default_fs)
+	format_specification& default_fs,
+	format_parse_result& result)
 {
 	bool ok(true);
 	auto it = fs.begin(), end = fs.end();
+	result = format_parse_result();
+	result.length = fs.size();
 	while (it != end && ok)
 	{
 		basic_formatterfield<_E> ff;
-		ok = parse_field(it,end,ff,default_fs);
+		ok = parse_field(it,end,ff,default_fs,result.error);
 		if (ok)
 		{
 			ffv.push_back(ff);
+			++result.fields;
+			if (!ff.textonly) ++result.specifications;
 		}
 	}
+	if (!ok)
+	{
+		result.offset = static_cast<size_t>(it - fs.begin());
+		result.field = result.fields;
+	}
 	return ok;
 }
 
+template <typename _E>
+bool parse_format(
+	const std::basic_string<_E>& fs,
+	FormatFieldVector<_E>& ffv,
+	format_specification& default_fs)
+{
+	format_parse_result result;
+	return parse_format(fs, ffv, default_fs, result);
+}
+
 //------------------------------------------------------
-// TEMPLATE CLASS basic_formatter
-// The format of each field is controlled by the given format string.
+// CLASS format_histogram
+// Counts values in log linear buckets, as an HDR histogram does.
+// Values below 2^sub_bits have a bucket each, above that every power of
+// two is split into 2^sub_bits buckets, so any value is placed to within
+// 1/8th of itself, from 0 to 2^64, in a fixed 4KB table.
 //------------------------------------------------------
-template <typename _E, typename _Tr = std::char_traits<_E> >
-class basic_formatter
+class format_histogram
 {
 public:
-	basic_formatter()
-		: _ok(true), _curff()
-	{}
-
-	basic_formatter(const format_specification fs)
-		: _ok(true), _curff(0), _default_format(fs)
-	{}
-	
-	basic_formatter(std::basic_string<_E,_Tr> fs)
-		: _ok(true)
+	enum
 	{
-		_ok = parse_format(fs, _ffv, _default_format);
-		_curff = _ffv.begin();
-	}
+		sub_bits = 3,
+		sub_count = 1 << sub_bits,
+		bucket_count = (64 - sub_bits + 1) * sub_count
+	};
 
-	basic_formatter(std::basic_string<_E,_Tr> s, const format_specification& fs)
-		: _ok(true), _default_format(fs)
+	format_histogram()
+	{ clear(); }
+
+	void clear()
 	{
-		_ok = parse_format(s, _ffv, _default_format);
-		_curff = _ffv.begin();
+		std::fill_n(_Counts, static_cast<int>(bucket_count), 0ull);
+		_Count = _Total = _Max = 0;
+		_Min = ~0ull;
 	}
 
-	basic_formatter(const basic_formatter& f)
+	void add(unsigned long long v)
 	{
-		*this = f;
+		++_Counts[bucket(v)];
+		++_Count;
+		_Total += v;
+		if (v < _Min) _Min = v;
+		if (v > _Max) _Max = v;
 	}
 
-	basic_formatter& operator=(const basic_formatter& f)
+	unsigned long long count() const
+	{ return _Count; }
+
+	unsigned long long minimum() const
+	{ return _Count ? _Min : 0; }
+
+	unsigned long long maximum() const
+	{ return _Max; }
+
+	double mean() const
+	{ return _Count ? double(_Total) / double(_Count) : 0.0; }
+
+	// The value p percent of the values are at or below, to the
+	// resolution of the buckets.
+	unsigned long long percentile(double p) const
 	{
-		if (this != &f)
+		double target = p / 100.0 * double(_Count);
+		unsigned long long seen(0);
+		for (int b = 0; b < bucket_count; ++b)
 		{
-			_ok = f._ok;	// you're _ok I'm _ok
-			_ffv = f._ffv;	// copy formatter field vector
-			_curff = _ffv.begin();	// restart at first formatter field on copy
+			seen += _Counts[b];
+			if (seen && double(seen) >= target)
+			{
+				unsigned long long high = b + 1 < bucket_count ? lowest(b + 1) - 1 : ~0ull;
+				return high < _Max ? high : _Max;
+			}
 		}
-		return (*this);
+		return _Max;
 	}
 
-	void default_format_specification(const format_specification& f)
+	// Number of values counted in bucket b, and the smallest value it holds.
+	unsigned long long bucket_value_count(int b) const
+	{ return _Counts[b]; }
+
+	static unsigned long long lowest(int b)
 	{
-		_default_format = f;
+		if (b < sub_count) return b;
+		return static_cast<unsigned long long>(sub_count + b % sub_count) << (b / sub_count - 1);
 	}
-	format_specification default_format_specification()
+
+	static int bucket(unsigned long long v)
 	{
-		return _default_format;
+		if (v < sub_count) return static_cast<int>(v);
+		int m = static_cast<int>(std::bit_width(v)) - 1 - sub_bits;
+		return (m + 1) * sub_count + static_cast<int>((v >> m) - sub_count);
 	}
 
-	bool isValid()
-	{ return _ok; }
+private:
+	unsigned long long _Counts[bucket_count];
+	unsigned long long _Count;
+	unsigned long long _Total;
+	unsigned long long _Min;
+	unsigned long long _Max;
+};
 
-	FormatFieldVector<_E>::size_type FieldCount()
-	{ return _ffv.size(); }
+//------------------------------------------------------
+// STRUCT format_statistics
+// A snapshot of what has been output with a compiled format.
+// They are only counted when OFORMAT_STATISTICS is defined, otherwise
+// every snapshot is empty and the counting compiles to nothing.
+//------------------------------------------------------
+struct format_statistics
+{
+	typedef std::chrono::steady_clock clock;
 
-	basic_formatterfield<_E>& operator() ()
-	{ return (_curff != _ffv.end() ? *_curff : _default_format); }
+#if defined(OFORMAT_STATISTICS)
+	static const bool enabled = true;
+#else
+	static const bool enabled = false;
+#endif
 
-	// This is the heart of the whole operation.
-	// Each time a field is output the custom setformat() function
-	// calls this routine and shifts _curff to the next basic_formatterfield
-	basic_formatterfield<_E>& next()
+	format_statistics()
+		: records(0), fields(0), bytes(0), flushes(0), reformats(0)
+	{}
+
+	unsigned long long records;		// complete passes through the fields
+	unsigned long long fields;		// fields output, including text only ones
+	unsigned long long bytes;		// characters written
+	unsigned long long flushes;		// flush() and endl, when they do flush
+	unsigned long long reformats;	// times a stream was given this format
+	format_histogram latency;		// nanoseconds per record, bulk inserts excluded
+};
+
+//------------------------------------------------------
+// CLASS format_counters
+// The statistics of one compiled format, which every copy of its
+// formatter shares.  What the private copies of oformatstreams output
+// is counted against the formatter they were given, eg. an entry of a
+// format_catalog, whichever threads the streams run on.
+//------------------------------------------------------
+class format_counters
+{
+public:
+	format_statistics get() const
 	{
-		basic_formatterfield<_E>& ret = operator()();
-		if (!_ffv.empty() && ++_curff == _ffv.end()) _curff = _ffv.begin();
-		return ret;
+		std::lock_guard<std::mutex> lock(_Lock);
+		return _Stats;
+	}
+
+	void reset()
+	{
+		std::lock_guard<std::mutex> lock(_Lock);
+		_Stats = format_statistics();
+	}
+
+	// Add to the statistics with f, holding the lock
+	template <typename _Fn>
+	void update(_Fn f)
+	{
+		std::lock_guard<std::mutex> lock(_Lock);
+		f(_Stats);
 	}
 
 private:
-	bool _ok;
-	FormatFieldVector<_E,_Tr> _ffv;
-	FormatFieldVector<_E,_Tr>::iterator _curff;
-	basic_formatterfield<_E> _default_format;
+	mutable std::mutex _Lock;
+	format_statistics _Stats;
 };
 
-typedef basic_formatter<char, std::char_traits<char> > formatter;
-typedef basic_formatter<wchar_t, std::char_traits<wchar_t> > wformatter;
+//------------------------------------------------------
+// STRUCT format_record_size
+// The length of one record of a format, from basic_formatter::record_size().
+// A value without a width, or with a '*' width, is guessed to be
+// format_typical_value characters long, or as long as its precision
+// makes it for %e and %f.
+//------------------------------------------------------
+const std::streamsize format_typical_value = 6;
 
+struct format_record_size
+{
+	size_t minimum;		// no record is shorter
+	size_t typical;		// each value as long as its width, or as guessed
+	bool fixed;			// every value has a width, none taken from the
+						// arguments, so a record whose values fit is minimum long
+};
 
 //------------------------------------------------------
-// TEMPLATE CLASS basic_oformatstream
-// Outputs values to the connected stream (does nothing if not).
-// The internal basic_formatter object controls the layout of each
-// output field and the order that they are expected.
-// No exceptions are thrown if the supplied field type does not match
-// the expected format. The output will probably just look awful.
+// TEMPLATE CLASS basic_formatter
+// The format of each field is controlled by the given format string.
+//
+// A compiled format may also be edited after construction.
+// Fields can be appended, inserted, replaced or erased one at a time
+// and whole formatters concatenated, so a format assembled from
+// fragments only ever parses the fragment that changed.
+// The current field is tracked by index so it remains valid across
+// edits; it is shifted when fields are inserted or erased before it.
+//
+// Fields may refer to their argument by position "%2$s" or by name
+// "%{name}s".  The names are looked up in the list supplied to the
+// constructor, or numbered in order of first use if there is no list.
+// Either way every reference is resolved here, once, into a table giving
+// the fields of each argument, so basic_oformatstream only ever indexes.
+//
+// basic_oformatstream outputs from table(), a packed copy of the fields
+// rebuilt whenever they may have changed, rather than the fields.
 //------------------------------------------------------
 template <typename _E, typename _Tr = std::char_traits<_E> >
-class basic_oformatstream
+class basic_formatter
 {
 public:
+	typedef basic_formatterfield<_E,_Tr> field_type;
+	typedef FormatFieldVector<_E,_Tr> _Myffv;
+	typedef typename _Myffv::size_type size_type;
+	typedef basic_format_table<_E,_Tr> table_type;
+	typedef std::vector<std::basic_string<_E,_Tr> > name_vector;
 
-	typedef basic_oformatstream<_E,_Tr> _Myt;
-	typedef std::basic_ostream<_E,_Tr> _Myostream;
-	typedef _Myostream::_Mysb _Mysb;
-	typedef _Myostream::_Myios _Myios;
+	basic_formatter()
+		: _ok(true), _curff(0), _positional(false), _stale(true)
+	{}
 
-	basic_oformatstream()
-		: _Ostream(NULL)
+	basic_formatter(const format_specification fs)
+		: _ok(true), _curff(0), _positional(false), _stale(true), _default_format(fs)
 	{}
+	
+	basic_formatter(std::basic_string<_E,_Tr> fs)
+		: _ok(true), _curff(0), _positional(false), _stale(true)
+	{
+		parse(fs);
+	}
 
-	explicit basic_oformatstream(const std::basic_string<_E,_Tr>& s, _Myostream *os = NULL)
-		: _Format(basic_formatter<_E,_Tr>(s)), _Ostream(NULL)
-	{ tie(os); }
+	basic_formatter(std::basic_string<_E,_Tr> s, const format_specification& fs)
+		: _ok(true), _curff(0), _positional(false), _stale(true), _default_format(fs)
+	{
+		parse(s);
+	}
 
-	explicit basic_oformatstream(const basic_formatter<_E>& f, _Myostream *os = NULL)
-		: _Format(f), _Ostream(NULL)
-	{ tie(os); }
+	basic_formatter(std::basic_string<_E,_Tr> s, const name_vector& names)
+		: _ok(true), _curff(0), _positional(false), _stale(true), _names(names)
+	{
+		parse(s);
+	}
 
-	virtual ~basic_oformatstream()
-	{}
+	basic_formatter(std::basic_string<_E,_Tr> s, const name_vector& names,
+					const format_specification& fs)
+		: _ok(true), _curff(0), _positional(false), _stale(true), _names(names),
+		  _default_format(fs)
+	{
+		parse(s);
+	}
 
-	void formatter(const basic_formatter<_E,_Tr>& f)
-	{ _Format = f; }
+	// A formatter of fields compiled earlier, eg. by basic_format_catalog,
+	// along with the result of parsing them.
+	basic_formatter(_Myffv ffv, const format_parse_result& result,
+					const format_specification& fs)
+		: _ok(result.ok()), _result(result), _ffv(std::move(ffv)), _curff(0),
+		  _positional(false), _stale(true), _default_format(fs)
+	{
+		_ok = index_arguments() && _ok;
+	}
 
-	basic_formatter<_E>& formatter()
-	{ return _Format; }
+	basic_formatter(const basic_formatter& f)
+	{
+		*this = f;
+	}
 
-	void tie(_Myostream *os)
-	{ _Ostream = os; }
+	basic_formatter& operator=(const basic_formatter& f)
+	{
+		if (this != &f)
+		{
+			_ok = f._ok;	// you're _ok I'm _ok
+			_result = f._result;
+			_stale = true;
+			_ffv = f._ffv;	// copy formatter field vector
+			_names = f._names;
+			_positional = f._positional;
+			_argoffset = f._argoffset;
+			_argfield = f._argfield;
+			_default_format = f._default_format;
+			_key = f._key;
+			_touched = f._touched;
+			if (_touched)
+			{	// the fields as they were, to compare with in table()
+				_table = f._table;
+			}
+			_curff = 0;		// restart at first formatter field on copy
+#if defined(OFORMAT_STATISTICS)
+			_stats = f._stats;
+#endif
+		}
+		return (*this);
+	}
 
-	_Myostream* get_ostream()
-	{ return _Ostream; }
+	// Moving takes the fields rather than copying them,
+	// otherwise it is the same as copying.
+	basic_formatter(basic_formatter&& f)
+	{
+		*this = std::move(f);
+	}
 
-	format_specification default_format_specification()
-	{ return _Format.default_format_specification(); }
+	basic_formatter& operator=(basic_formatter&& f)
+	{
+		if (this != &f)
+		{
+			_ok = f._ok;
+			_result = f._result;
+			_stale = true;
+			_ffv = std::move(f._ffv);
+			_names = std::move(f._names);
+			_positional = f._positional;
+			_argoffset = std::move(f._argoffset);
+			_argfield = std::move(f._argfield);
+			_default_format = std::move(f._default_format);
+			_key = f._key;
+			_touched = f._touched;
+			if (_touched)
+			{
+				_table = std::move(f._table);
+			}
+			_curff = 0;
+#if defined(OFORMAT_STATISTICS)
+			_stats = f._stats;
+#endif
+		}
+		return (*this);
+	}
 
-	// MANIPULATION OPERATIONS
+	void default_format_specification(const format_specification& f)
+	{
+		_default_format = basic_formatterfield<_E>(f);
+		_stale = true;
+		_key = new_key();
+	}
+	format_specification default_format_specification() const
+	{
+		return _default_format;
+	}
 
-	_Myt& operator<<(_Myt& (__cdecl *_F)(_Myt&))
-	{ return ((*_F)(*this)); }
+	bool isValid()
+	{ return _ok; }
+
+	// Where and why the constructor's format string was rejected,
+	// with counts of what it held.  Edits don't change this.
+	const format_parse_result& parse_result() const
+	{ return _result; }
+
+	// Copies of a formatter have the same key until one of them is
+	// edited, which gives it a new one, so equal keys mean equal formats.
+	// 0, equal to no format, while a field reached through operator()(),
+	// next() or field() may have changed and table() hasn't looked.
+	unsigned long long key() const
+	{ return _touched ? 0 : _key; }
+
+	size_type FieldCount()
+	{ return _ffv.size(); }
+
+	// Changes made through this, next() or field() are seen by table().
+	basic_formatterfield<_E>& operator() ()
+	{
+		touch();
+		return (_curff < _ffv.size() ? _ffv[_curff] : _default_format);
+	}
+
+	// This is the heart of the whole operation.
+	// Each time a field is output the custom setformat() function
+	// calls this routine and shifts _curff to the next basic_formatterfield
+	basic_formatterfield<_E>& next()
+	{
+		basic_formatterfield<_E>& ret = operator()();
+		if (!_ffv.empty() && ++_curff >= _ffv.size()) _curff = 0;
+		return ret;
+	}
+
+	// As next() but giving only the field's index, for use with table().
+	size_type advance()
+	{
+		size_type n = _curff;
+		if (!_ffv.empty() && ++_curff >= _ffv.size()) _curff = 0;
+		return n;
+	}
+
+	// False if table() will be rebuilt when next asked for.
+	bool table_current() const
+	{ return !_stale; }
+
+	// The fields packed for output, indexed as they are.
+	// Rebuilt here if they may have changed since it was last asked for.
+	// Fields handed out by reference count as edited only if they did
+	// change, so merely reading them keeps the key and statistics.
+	const table_type& table()
+	{
+		if (_stale && _touched)
+		{
+			table_type was(std::move(_table));
+			_table.build(_ffv, _default_format);
+			if (!(_table == was))
+			{
+				edited();
+			}
+			_touched = false;
+		}
+		else if (_stale)
+		{
+			_table.build(_ffv, _default_format);
+		}
+		_stale = false;
+		return _table;
+	}
+
+	// ARGUMENT REFERENCES
+
+	// True if any field refers to its argument by position or name.
+	bool positional()
+	{ return _positional; }
+
+	// Number of arguments making up one record of a positional format.
+	size_type ArgumentCount()
+	{ return _argoffset.empty() ? 0 : _argoffset.size() - 1; }
+
+	// Number of fields that display argument a.
+	size_type ReferenceCount(size_type a)
+	{ return _argoffset[a + 1] - _argoffset[a]; }
+
+	// Index of the r'th field that displays argument a.
+	size_type Reference(size_type a, size_type r)
+	{ return _argfield[_argoffset[a] + r]; }
+
+	// RECORD SIZING
+	// The length of one pass through the fields as an oformatstream in
+	// classic mode writes it, text only fields being written by setformat.
+	format_record_size record_size()
+	{
+		const table_type& t = table();
+		format_record_size r = { 0, 0, true };
+		size_type n;
+		for (n = 0; n < t.size(); ++n)
+		{
+			size_t len = t.text_size(n);
+			if (len && _default_format.width > static_cast<std::streamsize>(len))
+			{
+				len = static_cast<size_t>(_default_format.width);
+			}
+			r.minimum += len;
+			r.typical += len;
+			if (t.textonly(n))
+			{
+				continue;
+			}
+			std::streamsize w = t.widtharg(n) ? 0 : t.width(n);
+			std::streamsize guess = format_typical_value, prec = t.precision(n);
+			switch (t.flags(n) & SIB(floatfield))
+			{
+			case SIB(fixed):		guess = prec > 0 ? prec + 2 : 1; break;
+			case SIB(scientific):	guess = prec > 0 ? prec + 6 : 5; break;
+			}
+			r.minimum += static_cast<size_t>(w);
+			r.typical += static_cast<size_t>(w > guess ? w : guess);
+			r.fixed = r.fixed && w > 1;
+		}
+		return r;
+	}
+
+	// The exact length of the record an oformatstream in classic mode
+	// writes for args, inserted from the first field.  Fields after the
+	// last value are counted as setformat writes them, and in a positional
+	// format an argument not given is left empty, as end_record() does.
+	// Integers and strings are measured without being converted.
+	// Takes the types the inserters do, see format_measure.
+	template <typename... _Args>
+	size_t measure(_Args... args);
+
+	// STATISTICS
+	// Counted by the oformatstreams that output this format.  They
+	// belong to the compiled format, so copies and assignments share
+	// them, while editing the fields starts the formatter's own from zero.
+	format_statistics statistics() const
+	{
+#if defined(OFORMAT_STATISTICS)
+		return _stats->get();
+#else
+		return format_statistics();
+#endif
+	}
+
+	void reset_statistics()
+	{
+#if defined(OFORMAT_STATISTICS)
+		_stats->reset();
+#endif
+	}
+
+#if defined(OFORMAT_STATISTICS)
+	format_counters& counters()
+	{ return *_stats; }
+#endif
+
+	// EDITING OPERATIONS
+	// None of these re-parse the fields already held.
+	// The fragment versions leave the formatter untouched if the
+	// fragment fails to parse and return false.
+
+	// Every compiled field, eg. to save them.
+	const _Myffv& fields() const
+	{ return _ffv; }
+
+	// Direct access to a compiled field, for in place changes.
+	// Use replace() to change a field's argument reference.
+	field_type& field(size_type n)
+	{
+		touch();
+		return _ffv[n];
+	}
+
+	// Index of the field that the next insertion will use.
+	size_type position()
+	{ return _curff; }
+
+	// Restart output at the first field.
+	void rewind()
+	{ _curff = 0; }
+
+	// Continue output from field n.
+	void position(size_type n)
+	{ _curff = n < _ffv.size() ? n : 0; }
+
+	void append(const field_type& ff)
+	{
+		_Myffv ffv;
+		ffv.push_back(ff);
+		splice(ffv);
+	}
+
+	// Parse only the format fragment s and append its fields.
+	bool append(const std::basic_string<_E,_Tr>& s)
+	{
+		_Myffv ffv;
+		bool ok = parse_format(s, ffv, _default_format);
+		if (ok)
+		{
+			splice(ffv);
+		}
+		return ok;
+	}
+
+	// Insert ff before field n, or append it when n is past the end.
+	void insert(size_type n, const field_type& ff)
+	{
+		splice(n, 0, _Myffv(1, ff));
+	}
+
+	// Parse only the format fragment s and insert its fields before field n.
+	bool insert(size_type n, const std::basic_string<_E,_Tr>& s)
+	{
+		_Myffv ffv;
+		bool ok = parse_format(s, ffv, _default_format);
+		if (ok)
+		{
+			splice(n, 0, ffv);
+		}
+		return ok;
+	}
+
+	// Replace field n with ff, or append it when n is past the end.
+	void replace(size_type n, const field_type& ff)
+	{
+		splice(n, 1, _Myffv(1, ff));
+	}
+
+	// Replace field n with the fields parsed from the fragment s.
+	bool replace(size_type n, const std::basic_string<_E,_Tr>& s)
+	{
+		_Myffv ffv;
+		bool ok = parse_format(s, ffv, _default_format);
+		if (ok)
+		{
+			splice(n, 1, ffv);
+		}
+		return ok;
+	}
+
+	// Remove field n; nothing happens when n is past the end.
+	void erase(size_type n)
+	{
+		splice(n, 1, _Myffv());
+	}
+
+	// Concatenation copies the compiled fields of f after our own.
+	basic_formatter& operator+=(const basic_formatter& f)
+	{
+		splice(f._ffv);
+		_ok = _ok && f._ok;
+		return (*this);
+	}
+
+	basic_formatter& operator+=(const field_type& ff)
+	{
+		append(ff);
+		return (*this);
+	}
+
+private:
+	// Parse the constructor's format string s.
+	void parse(const std::basic_string<_E,_Tr>& s)
+	{
+		_ok = parse_format(s, _ffv, _default_format, _result);
+		format_parse_result indexed;
+		if (!index_arguments(&indexed) && _ok)
+		{	// the fields parsed, so find where the one in error starts
+			_ok = false;
+			indexed.length = _result.length;
+			indexed.fields = _result.fields;
+			indexed.specifications = _result.specifications;
+			_result = indexed;
+			auto it = s.begin(), end = s.end();
+			basic_formatterfield<_E> ff;
+			for (size_type n = 0; n < _result.field; ++n)
+			{
+				parse_field(it,end,ff,_default_format,indexed.error);
+			}
+			_result.offset = static_cast<size_t>(it - s.begin());
+		}
+	}
+
+	// Add ffv to the end of our fields.
+	void splice(const _Myffv& ffv)
+	{
+		splice(_ffv.size(), 0, ffv);
+	}
+
+	// Put ffv in place of the count fields from n.  A text only field
+	// is joined to the field which follows it, on either side of the
+	// edit, exactly as if the format strings had been parsed as one.
+	// Output continues from the same field, or from the first new one
+	// when that field was replaced.
+	void splice(size_type n, size_type count, _Myffv ffv)
+	{
+		if (n > _ffv.size()) n = _ffv.size();
+		if (count > _ffv.size() - n) count = _ffv.size() - n;
+		if (!ffv.empty() && n > 0 && _ffv[n - 1].textonly)
+		{
+			ffv.front().text.insert(0, _ffv[n - 1].text);
+			--n;
+			++count;
+		}
+		if (!ffv.empty() && ffv.back().textonly && n + count < _ffv.size())
+		{
+			_ffv[n + count].text.insert(0, ffv.back().text);
+			ffv.pop_back();
+		}
+		if (_curff >= n + count) _curff = _curff - count + ffv.size();
+		else if (_curff > n) _curff = n;
+		_ffv.erase(_ffv.begin() + n, _ffv.begin() + n + count);
+		_ffv.insert(_ffv.begin() + n, ffv.begin(), ffv.end());
+		if (_curff >= _ffv.size()) _curff = 0;
+		_ok = index_arguments() && _ok;
+		edited();
+	}
+
+	// A field is being handed out by reference, so table() compares the
+	// fields with the table as it is now before it is next used.
+	void touch()
+	{
+		if (!_touched)
+		{
+			table();
+			_touched = true;
+		}
+		_stale = true;
+	}
+
+	// The compiled fields have changed, so they take a new key and
+	// their statistics start again
+	void edited()
+	{
+		_key = new_key();
+#if defined(OFORMAT_STATISTICS)
+		_stats = std::make_shared<format_counters>();
+#endif
+	}
+
+	static unsigned long long new_key()
+	{
+		static std::atomic<unsigned long long> next(0);
+		return ++next;
+	}
+
+	// Resolve every field's argument reference and build the
+	// argument to field table, _argfield[_argoffset[a]] onwards.
+	// Fields without a reference take the argument following the
+	// previous field's.  Returns false for a name not in _names,
+	// or for a '*' width or precision which has no argument to name,
+	// and sets result, if given, for the first such field.
+	bool index_arguments(format_parse_result* result = 0)
+	{
+		bool ok(true);
+		size_type n, nfields = _ffv.size();
+		_positional = false;
+		_stale = true;
+		for (n = 0; n < nfields; ++n)
+		{
+			_positional = _positional ||
+				_ffv[n].argument >= 0 || !_ffv[n].name.empty();
+		}
+		_argoffset.clear();
+		_argfield.clear();
+		if (!_positional)
+		{
+			return ok;
+		}
+		std::vector<int> fieldarg(nfields, -1);
+		name_vector named;
+		int a(-1), count(0);
+		for (n = 0; n < nfields; ++n)
+		{
+			field_type& ff = _ffv[n];
+			if (ff.textonly)
+			{
+				continue;
+			}
+			if (ff.widtharg || ff.precarg)
+			{
+				reject(result, format_error_star, n, ok);
+			}
+			if (ff.argument >= 0)
+			{
+				a = ff.argument;
+			}
+			else if (!ff.name.empty())
+			{
+				name_vector& names = _names.empty() ? named : _names;
+				typename name_vector::size_type i = 0;
+				while (i < names.size() && names[i] != ff.name) ++i;
+				if (i == names.size())
+				{
+					if (&names == &_names)
+					{
+						reject(result, format_error_name, n, ok);
+						continue;
+					}
+					named.push_back(ff.name);
+				}
+				a = static_cast<int>(i);
+			}
+			else
+			{
+				++a;
+			}
+			fieldarg[n] = a;
+			if (a >= count) count = a + 1;
+		}
+		// counting sort of the fields by argument
+		_argoffset.assign(count + 1, 0);
+		for (n = 0; n < nfields; ++n)
+		{
+			if (fieldarg[n] >= 0) ++_argoffset[fieldarg[n] + 1];
+		}
+		for (a = 0; a < count; ++a)
+		{
+			_argoffset[a + 1] += _argoffset[a];
+		}
+		_argfield.resize(_argoffset[count]);
+		std::vector<size_type> fill(_argoffset.begin(), _argoffset.end() - 1);
+		for (n = 0; n < nfields; ++n)
+		{
+			if (fieldarg[n] >= 0) _argfield[fill[fieldarg[n]]++] = n;
+		}
+		return ok;
+	}
+
+	static void reject(format_parse_result* result, format_error e,
+					   size_type n, bool& ok)
+	{
+		if (result && ok)
+		{
+			result->error = e;
+			result->field = n;
+		}
+		ok = false;
+	}
+
+	bool _ok;
+	format_parse_result _result;
+	_Myffv _ffv;
+	size_type _curff;
+	bool _positional;
+	bool _stale;			// _table needs rebuilding
+	bool _touched = false;	// fields handed out by reference since _table was built
+	name_vector _names;
+	std::vector<size_type> _argoffset;
+	std::vector<size_type> _argfield;
+	basic_formatterfield<_E> _default_format;
+	table_type _table;
+	unsigned long long _key = new_key();
+#if defined(OFORMAT_STATISTICS)
+	std::shared_ptr<format_counters> _stats = std::make_shared<format_counters>();
+#endif
+};
+
+template <typename _E, typename _Tr> inline
+basic_formatter<_E,_Tr> operator+(const basic_formatter<_E,_Tr>& l,
+								  const basic_formatter<_E,_Tr>& r)
+{
+	basic_formatter<_E,_Tr> f(l);
+	f += r;
+	return f;
+}
+
+typedef basic_formatter<char, std::char_traits<char> > formatter;
+typedef basic_formatter<wchar_t, std::char_traits<wchar_t> > wformatter;
+
+//------------------------------------------------------
+// format_parallel_blocks
+// Calls fn(first, last) for consecutive blocks of block items of
+// [0, count) on up to threads threads, 0 meaning one per processor,
+// this one included.  Each thread takes the next block as it finishes
+// its last, so a few slow blocks don't hold up the rest.
+//------------------------------------------------------
+template <typename _Fn>
+void format_parallel_blocks(size_t count, size_t block, unsigned int threads, _Fn fn)
+{
+	if (!threads)
+	{
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	size_t blocks = (count + block - 1) / block;
+	if (threads > blocks)
+	{
+		threads = static_cast<unsigned int>(std::max<size_t>(1, blocks));
+	}
+	std::atomic<size_t> next(0);
+	auto work = [&]()
+	{
+		for (;;)
+		{
+			size_t n = next.fetch_add(block);
+			if (n >= count)
+			{
+				break;
+			}
+			fn(n, std::min(n + block, count));
+		}
+	};
+	std::vector<std::thread> pool;
+	for (unsigned int t = 1; t < threads; ++t)
+	{
+		pool.push_back(std::thread(work));
+	}
+	work();
+	for (size_t t = 0; t < pool.size(); ++t)
+	{
+		pool[t].join();
+	}
+}
+
+//------------------------------------------------------
+// format_validate
+// Checks a batch of format strings, eg. all those in a configuration
+// file, exactly as constructing a basic_formatter from each would.
+// results[n] describes formats[n].  The work is spread over up to
+// threads threads, 0 meaning one per processor.
+// Returns the number of formats rejected.
+//------------------------------------------------------
+size_t format_validate(const std::vector<std::string>& formats,
+					   std::vector<format_parse_result>& results,
+					   unsigned int threads = 0);
+size_t format_validate(const std::vector<std::wstring>& formats,
+					   std::vector<format_parse_result>& results,
+					   unsigned int threads = 0);
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_format_catalog
+// A table of formatters compiled from a list of format strings,
+// eg. every format a program loads from its configuration at startup.
+// The formats are compiled across a pool of threads into one contiguous
+// table, indexed as the list was.  Once built the table is read only.
+//
+// The compiled table can be saved to a cache file and loaded back on a
+// later run, so long as it was compiled from the same list of formats
+// with the same default format specification, skipping the parse.
+// A cache file from anything else, including another version of this
+// code, is ignored.
+//
+// Instantiated for char and wchar_t in oformatstream.cpp.
+//------------------------------------------------------
+template <typename _E, typename _Tr = std::char_traits<_E> >
+class basic_format_catalog
+{
+public:
+	typedef basic_formatter<_E,_Tr> formatter_type;
+	typedef std::vector<std::basic_string<_E,_Tr> > string_vector;
+	typedef typename std::vector<formatter_type>::size_type size_type;
+
+	explicit basic_format_catalog(const format_specification& fs = format_specification())
+		: _hash(0), _rejected(0), _default_format(fs)
+	{}
+
+	basic_format_catalog(const string_vector& formats, unsigned int threads = 0,
+						 const format_specification& fs = format_specification())
+		: _hash(0), _rejected(0), _default_format(fs)
+	{
+		compile(formats, threads);
+	}
+
+	// Compile every one of formats, spread over up to threads threads,
+	// 0 meaning one per processor.  Replaces the current table.
+	void compile(const string_vector& formats, unsigned int threads = 0);
+
+	// Write the table to the file path.  Returns false if it can't.
+	bool save(const char* path) const;
+
+	// Replace the table with the one saved in path, if it was compiled
+	// from formats.  Returns false, leaving the table alone, if not.
+	bool load(const char* path, const string_vector& formats);
+
+	// Load the table from path, or compile formats and save the table
+	// there if it can't be loaded.  Returns true if it was loaded.
+	bool open(const char* path, const string_vector& formats,
+			  unsigned int threads = 0);
+
+	size_type size() const
+	{ return _table.size(); }
+
+	// The formatter compiled from the n'th format
+	const formatter_type& operator[](size_type n) const
+	{ return _table[n]; }
+
+	// Number of formats that failed to compile
+	size_type rejected() const
+	{ return _rejected; }
+
+private:
+	std::vector<formatter_type> _table;
+	unsigned long long _hash;	// of the formats compiled and _default_format
+	size_type _rejected;
+	format_specification _default_format;
+};
+
+typedef basic_format_catalog<char, std::char_traits<char> > format_catalog;
+typedef basic_format_catalog<wchar_t, std::char_traits<wchar_t> > wformat_catalog;
+
+
+//------------------------------------------------------
+// TEMPLATE STRUCT format_plan
+// A field's format specification reduced to the decisions needed to
+// convert an integer, so the bulk inserters make them once per field
+// rather than once per value.
+//------------------------------------------------------
+template <typename _E, typename _Tr = std::char_traits<_E> >
+struct format_plan
+{
+	enum adjustment { right, left, internal };
+
+	// Returns false if the field can't be planned, ie. it takes
+	// a '*' width or precision from the argument stream.
+	bool set(const basic_format_table<_E,_Tr>& t, size_t n)
+	{
+		SIB(fmtflags) f = t.flags(n);
+		text = t.text(n);
+		textlen = t.text_size(n);
+		fill = t.fill(n);
+		width = t.width(n);
+		base = (f & SIB(hex)) ? 16 : (f & SIB(oct)) ? 8 : 10;
+		upper = (f & SIB(uppercase)) != 0;
+		showpos = (f & SIB(showpos)) != 0;
+		showbase = (f & SIB(showbase)) != 0;
+		adjust = (f & SIB(left)) ? left : (f & SIB(internal)) ? internal : right;
+		return !t.widtharg(n) && !t.precarg(n);
+	}
+
+	// Plan from the state prefix() has left on a field's stream.
+	void set(const std::ios_base& io, _E f)
+	{
+		SIB(fmtflags) fl = io.flags();
+		text = NULL;
+		textlen = 0;
+		fill = f;
+		width = io.width();
+		base = (fl & SIB(hex)) ? 16 : (fl & SIB(oct)) ? 8 : 10;
+		upper = (fl & SIB(uppercase)) != 0;
+		showpos = (fl & SIB(showpos)) != 0;
+		showbase = (fl & SIB(showbase)) != 0;
+		adjust = (fl & SIB(left)) ? left : (fl & SIB(internal)) ? internal : right;
+	}
+
+	const _E* text;		// the field's literal text, NULL if there is none
+	size_t textlen;
+	_E fill;
+	std::streamsize width;
+	int base;		// 8, 10 or 16
+	bool upper;
+	bool showpos;
+	bool showbase;
+	adjustment adjust;
+};
+
+//------------------------------------------------------
+// TEMPLATE STRUCT format_integer_traits
+// std::make_unsigned and std::is_signed for every integer type
+// format_integer accepts, including the 128 bit ones where available.
+//------------------------------------------------------
+template <typename _Ty>
+struct format_integer_traits
+{
+	typedef typename std::make_unsigned<_Ty>::type unsigned_type;
+	static const bool is_signed = std::is_signed<_Ty>::value;
+};
+
+#if defined(__SIZEOF_INT128__)
+template <>
+struct format_integer_traits<__int128>
+{
+	typedef unsigned __int128 unsigned_type;
+	static const bool is_signed = true;
+};
+
+template <>
+struct format_integer_traits<unsigned __int128>
+{
+	typedef unsigned __int128 unsigned_type;
+	static const bool is_signed = false;
+};
+#endif
+
+//------------------------------------------------------
+// decimal_digits
+// Writes the decimal digits of u in front of p, two at a time,
+// returning the first digit.
+//------------------------------------------------------
+template <typename _Uty>
+char* decimal_digits(char* p, _Uty u)
+{
+	static const char pairs[] =
+		"00010203040506070809" "10111213141516171819"
+		"20212223242526272829" "30313233343536373839"
+		"40414243444546474849" "50515253545556575859"
+		"60616263646566676869" "70717273747576777879"
+		"80818283848586878889" "90919293949596979899";
+	while (u >= 100)
+	{
+		unsigned int r = static_cast<unsigned int>(u % 100) * 2;
+		u /= 100;
+		*--p = pairs[r + 1];
+		*--p = pairs[r];
+	}
+	if (u >= 10)
+	{
+		unsigned int r = static_cast<unsigned int>(u) * 2;
+		*--p = pairs[r + 1];
+		*--p = pairs[r];
+	}
+	else
+	{
+		*--p = static_cast<char>('0' + static_cast<unsigned int>(u));
+	}
+	return p;
+}
+
+#if defined(__SIZEOF_INT128__)
+// 128 bit division is a library call, so peel off 19 digits at a
+// time and convert those with 64 bit arithmetic.
+inline char* decimal_digits(char* p, unsigned __int128 u)
+{
+	const unsigned long long e19 = 10000000000000000000ull;
+	while (u > ~0ull)
+	{
+		char* q = decimal_digits(p, static_cast<unsigned long long>(u % e19));
+		u /= e19;
+		while (q != p - 19) *--q = '0';
+		p = q;
+	}
+	return decimal_digits(p, static_cast<unsigned long long>(u));
+}
+#endif
+
+//------------------------------------------------------
+// integer_prefix
+// Writes the sign or base of an integer in front of p, returning the
+// start of the prefix.  A sign is only shown for signed decimal values,
+// the base only for non zero values.
+//------------------------------------------------------
+template <typename _E, typename _Tr>
+char* integer_prefix(char* p, bool neg, bool sign, bool nonzero,
+					 const format_plan<_E,_Tr>& plan)
+{
+	if (10 == plan.base)
+	{
+		if (neg) *--p = '-';
+		else if (plan.showpos && sign) *--p = '+';
+	}
+	else if (plan.showbase && nonzero)
+	{
+		if (16 == plan.base) *--p = plan.upper ? 'X' : 'x';
+		*--p = '0';
+	}
+	return p;
+}
+
+//------------------------------------------------------
+// layout_integer
+// Appends the prefix [p, pend) and digits [body, end) of an integer
+// to buf, padded to the plan's width with its fill character.
+//------------------------------------------------------
+template <typename _E, typename _Tr>
+void layout_integer(std::basic_string<_E,_Tr>& buf,
+					const char* p, const char* pend,
+					const char* body, const char* end,
+					const format_plan<_E,_Tr>& plan)
+{
+	typedef typename std::basic_string<_E,_Tr>::size_type _Sz;
+	std::streamsize len = (pend - p) + (end - body);
+	std::streamsize pad = plan.width > len ? plan.width - len : 0;
+	_Sz at = buf.size();
+	buf.resize(at + static_cast<_Sz>(len + pad));
+	_E* out = &buf[at];
+	if (pad && format_plan<_E,_Tr>::right == plan.adjust)
+	{
+		out = std::fill_n(out, pad, plan.fill);
+		pad = 0;
+	}
+	while (p != pend) *out++ = _E(*p++);
+	if (pad && format_plan<_E,_Tr>::internal == plan.adjust)
+	{
+		out = std::fill_n(out, pad, plan.fill);
+		pad = 0;
+	}
+	while (body != end) *out++ = _E(*body++);
+	std::fill_n(out, pad, plan.fill);
+}
+
+//------------------------------------------------------
+// format_integer
+// Appends v to buf laid out as the num_put facet of the "C" locale
+// would for the given plan.  Hex and octal values are shown unsigned.
+//------------------------------------------------------
+template <typename _E, typename _Tr, typename _Ty>
+void format_integer(std::basic_string<_E,_Tr>& buf, _Ty v,
+					const format_plan<_E,_Tr>& plan)
+{
+	typedef typename format_integer_traits<_Ty>::unsigned_type _Uty;
+	const bool is_signed = format_integer_traits<_Ty>::is_signed;
+	static const char lower[] = "0123456789abcdef";
+	static const char upper[] = "0123456789ABCDEF";
+	const char* digits = plan.upper ? upper : lower;
+	char tmp[sizeof(_Ty) * 3 + 4];	// octal digits plus sign and base
+	char* end = tmp + sizeof(tmp);
+	char* p = end;
+	_Uty u = static_cast<_Uty>(v);
+	bool neg(false);
+
+	if (10 == plan.base)
+	{
+		if (is_signed && v < 0)
+		{
+			neg = true;
+			u = static_cast<_Uty>(0) - u;
+		}
+		p = decimal_digits(p, u);
+	}
+	else
+	{
+		const int shift = (16 == plan.base) ? 4 : 3;
+		const _Uty mask = static_cast<_Uty>(plan.base - 1);
+		do *--p = digits[u & mask]; while (u >>= shift);
+	}
+	char* body = p;
+	p = integer_prefix(p, neg, is_signed, v != 0, plan);
+	layout_integer(buf, p, body, body, end, plan);
+}
+
+//------------------------------------------------------
+// format_pointer
+// Appends v to buf as every digit of its address in hex, ie. a fixed
+// width on every platform, as printf's %p does with the Microsoft CRT.
+// The digits are always upper case, and prefixed by 0X for %#p.
+//------------------------------------------------------
+template <typename _E, typename _Tr>
+void format_pointer(std::basic_string<_E,_Tr>& buf, const void* v,
+					const format_plan<_E,_Tr>& plan)
+{
+	const char* digits = "0123456789ABCDEF";
+	char tmp[sizeof(void*) * 2 + 2];
+	char* end = tmp + sizeof(tmp);
+	char* p = end;
+	std::uintptr_t u = reinterpret_cast<std::uintptr_t>(v);
+	for (std::size_t k = 0; k < sizeof(void*) * 2; ++k, u >>= 4)
+	{
+		*--p = digits[u & 0xF];
+	}
+	char* body = p;
+	if (plan.showbase)
+	{
+		*--p = 'X';
+		*--p = '0';
+	}
+	layout_integer(buf, p, body, body, end, plan);
+}
+
+//------------------------------------------------------
+// floating_chars
+// Converts v into tmp as the num_put facet of the "C" locale would for
+// the flags f and precision prec, leaving its characters, less any sign,
+// in [body, end) and whether it is negative in neg.
+// Returns false for hexfloat, or a value too long to convert, which
+// the caller must leave to the facet.
+//------------------------------------------------------
+template <typename _Ty>
+bool floating_chars(char (&tmp)[128], _Ty v, SIB(fmtflags) f, std::streamsize prec,
+					char*& body, char*& end, bool& neg)
+{
+	SIB(fmtflags) ff = f & SIB(floatfield);
+	bool point = (f & SIB(showpoint)) != 0;
+	int digits = static_cast<int>(prec < 0 ? 6 : prec);
+	char* last = tmp + sizeof(tmp);
+	std::to_chars_result r;
+
+	if (SIB(floatfield) == ff)
+	{
+		return false;	// hexfloat
+	}
+	else if (SIB(fixed) == ff)
+	{
+		r = std::to_chars(tmp, last, v, std::chars_format::fixed, digits);
+	}
+	else if (SIB(scientific) == ff)
+	{
+		r = std::to_chars(tmp, last, v, std::chars_format::scientific, digits);
+	}
+	else if (!point)
+	{
+		r = std::to_chars(tmp, last, v, std::chars_format::general, digits ? digits : 1);
+	}
+	else
+	{	// %#g keeps its trailing zeros, which to_chars can't do, so pick
+		// %e or %f from the exponent as the C standard describes
+		int p = digits ? digits : 1;
+		r = std::to_chars(tmp, last, v, std::chars_format::scientific, p - 1);
+		char* e = std::find(tmp, r.ptr, 'e');
+		if (std::errc() == r.ec && e != r.ptr)
+		{
+			int x(0);
+			std::from_chars(e + ('+' == e[1] ? 2 : 1), r.ptr, x);
+			if (p > x && x >= -4)
+			{
+				r = std::to_chars(tmp, last, v, std::chars_format::fixed, p - 1 - x);
+			}
+		}
+	}
+	if (std::errc() != r.ec)
+	{
+		return false;
+	}
+
+	body = tmp;
+	neg = '-' == *body;
+	if (neg) ++body;
+	bool finite = std::isdigit(static_cast<unsigned char>(*body)) != 0;
+	end = r.ptr;
+	if (point && finite && std::find(body, end, '.') == end)
+	{	// no digits after the point, %#.0f and %#.0e still show it
+		if (end == last) return false;
+		char* e = std::find(body, end, 'e');
+		std::copy_backward(e, end, end + 1);
+		*e = '.';
+		++end;
+	}
+	if ((f & SIB(uppercase)) && SIB(fixed) != ff)	// num_put uses %f, never %F
+	{
+		for (char* c = body; c != end; ++c)
+		{
+			*c = static_cast<char>(std::toupper(static_cast<unsigned char>(*c)));
+		}
+	}
+	return true;
+}
+
+//------------------------------------------------------
+// format_floating
+// Appends v to buf laid out as the num_put facet of the "C" locale
+// would for the flags, precision and width of io.
+// Returns false where floating_chars does.
+//------------------------------------------------------
+template <typename _E, typename _Tr, typename _Ty>
+bool format_floating(std::basic_string<_E,_Tr>& buf, _Ty v,
+					 const std::ios_base& io, const format_plan<_E,_Tr>& plan)
+{
+	char tmp[128];
+	char* body;
+	char* end;
+	bool neg;
+	if (!floating_chars(tmp, v, io.flags(), io.precision(), body, end, neg))
+	{
+		return false;
+	}
+	char sign[1];
+	char* pend = sign + sizeof(sign);
+	char* p = pend;
+	if (neg) *--p = '-';
+	else if (plan.showpos) *--p = '+';
+	layout_integer(buf, p, pend, body, end, plan);
+	return true;
+}
+
+//------------------------------------------------------
+// general_floating
+// Emulates %g (general floating point) for v, which num_put has no
+// equivalent of, by choosing fixed or scientific in f and adjusting
+// the precision prec.  Used where f has neither set.
+//------------------------------------------------------
+inline void general_floating(SIB(fmtflags)& f, std::streamsize& prec, double v)
+{
+	double mant = fabs(v);
+	if (mant < 1e-4 || (mant > 0.0 ? (log10(mant) >= prec) : true))
+	{
+		f |= SIB(scientific);
+	}
+	else
+	{
+		f |= SIB(fixed);
+	}
+	prec = prec > 0 ? prec - 1 : prec;
+	if (!(f & SIB(showpoint)))
+	{
+		mant = v * pow(-log10(mant), 10);
+		if ((mant - (double)(__int64)mant) > 10 * DBL_EPSILON)
+		{
+			f |= SIB(showpoint);
+		}
+	}
+}
+
+//------------------------------------------------------
+// TEMPLATE STRUCT format_is_integer
+// True for the types taken by basic_oformatstream's integer inserters,
+// including the 128 bit ones where available.
+//------------------------------------------------------
+template <typename _Ty>
+struct format_is_integer
+	: std::integral_constant<bool, std::is_integral<_Ty>::value>
+{};
+
+#if defined(__SIZEOF_INT128__)
+template <>
+struct format_is_integer<__int128> : std::true_type
+{};
+
+template <>
+struct format_is_integer<unsigned __int128> : std::true_type
+{};
+#endif
+
+//------------------------------------------------------
+// decimal_length
+// The number of decimal digits in u, from its bit width.
+//------------------------------------------------------
+template <typename _Uty>
+std::streamsize decimal_length(_Uty u)
+{
+	if constexpr (sizeof(_Uty) <= sizeof(unsigned long long))
+	{
+		static const unsigned long long powers[20] =
+		{
+			1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+			10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+			100000000000ull, 1000000000000ull, 10000000000000ull,
+			100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+			100000000000000000ull, 1000000000000000000ull,
+			10000000000000000000ull
+		};
+		unsigned long long v = u;
+		int t = (std::bit_width(v) * 1233) >> 12;
+		return t + (v >= powers[t]) + !v;
+	}
+	else
+	{
+		std::streamsize len(0);
+		do ++len; while (u /= 10);
+		return len;
+	}
+}
+
+//------------------------------------------------------
+// measure_value
+// The length of v written to a field of stream type _E with flags f,
+// width w and precision prec, as basic_oformatstream's inserters write
+// it in classic mode.  The precision of a double must already have been
+// adjusted by general_floating.
+//------------------------------------------------------
+template <typename _E, typename _Tr, typename _Ty>
+size_t measure_value(_Ty v, SIB(fmtflags) f, std::streamsize w, std::streamsize prec)
+{
+	std::streamsize len(0);
+	if constexpr (std::is_same<_Ty, bool>::value)
+	{	// num_put writes bool as long, unless boolalpha
+		if (!(f & SIB(boolalpha)))
+		{
+			return measure_value<_E,_Tr>(static_cast<long>(v), f, w, prec);
+		}
+		len = v ? 4 : 5;
+	}
+	else if constexpr (std::is_same<_Ty, _E>::value ||
+		std::is_same<_Ty, char>::value ||
+		std::is_same<_Ty, signed char>::value ||
+		std::is_same<_Ty, unsigned char>::value)
+	{
+		len = 1;
+	}
+	else if constexpr (format_is_integer<_Ty>::value)
+	{
+		typedef typename format_integer_traits<_Ty>::unsigned_type _Uty;
+		const bool is_signed = format_integer_traits<_Ty>::is_signed;
+		_Uty u = static_cast<_Uty>(v);
+		if (f & (SIB(hex) | SIB(oct)))
+		{
+			const int shift = (f & SIB(hex)) ? 4 : 3;
+			if (u && (f & SIB(showbase))) len = (4 == shift) ? 2 : 1;
+			do ++len; while (u >>= shift);
+		}
+		else
+		{
+			if (is_signed && v < 0)
+			{
+				len = 1;
+				u = static_cast<_Uty>(0) - u;
+			}
+			else if (is_signed && (f & SIB(showpos)))
+			{
+				len = 1;
+			}
+			len += decimal_length(u);
+		}
+	}
+	else if constexpr (std::is_floating_point<_Ty>::value)
+	{
+		char tmp[128];
+		char* body;
+		char* end;
+		bool neg;
+		if (floating_chars(tmp, v, f, prec, body, end, neg))
+		{
+			len = (end - body) + ((neg || (f & SIB(showpos))) ? 1 : 0);
+		}
+		else
+		{	// left to the facet, so measured by one
+			std::basic_ostringstream<_E,_Tr> os;
+			os.imbue(std::locale::classic());
+			os.flags(f);
+			os.precision(prec);
+			os << v;
+			len = static_cast<std::streamsize>(os.str().size());
+		}
+	}
+	else if constexpr (std::is_pointer<_Ty>::value)
+	{
+		typedef typename std::remove_cv<typename std::remove_pointer<_Ty>::type>::type _Pty;
+		static_assert(!std::is_base_of<std::basic_streambuf<_E,_Tr>, _Pty>::value,
+			"a stream buffer's contents can't be measured");
+		if constexpr (std::is_same<_Pty, _E>::value)
+		{
+			len = v ? static_cast<std::streamsize>(_Tr::length(v)) : 0;
+		}
+		else if constexpr (std::is_same<_Pty, char>::value ||
+			std::is_same<_Pty, signed char>::value ||
+			std::is_same<_Pty, unsigned char>::value)
+		{
+			len = v ? static_cast<std::streamsize>(
+				std::char_traits<char>::length(reinterpret_cast<const char*>(v))) : 0;
+		}
+		else if constexpr (std::is_same<_Pty, signed short>::value &&
+			std::is_same<_E, wchar_t>::value)
+		{
+			len = v ? static_cast<std::streamsize>(
+				_Tr::length(reinterpret_cast<const wchar_t*>(v))) : 0;
+		}
+		else
+		{	// every digit of the address, as format_pointer writes it
+			len = static_cast<std::streamsize>(sizeof(void*) * 2) +
+				((f & SIB(showbase)) ? 2 : 0);
+		}
+	}
+	else
+	{
+		static_assert(!sizeof(_Ty), "no oformatstream inserter for this type");
+	}
+	return static_cast<size_t>(w > len ? w : len);
+}
+
+//------------------------------------------------------
+// TEMPLATE CLASS format_measure
+// Follows a basic_formatter through a record as basic_oformatstream does,
+// adding up the length of each field rather than writing it.
+// Each value goes to the next field, integers being taken as a '*' width
+// or precision first, while a positional format places them by argument.
+// Used by basic_formatter::measure().
+//------------------------------------------------------
+template <typename _E, typename _Tr = std::char_traits<_E> >
+class format_measure
+{
+public:
+	typedef basic_formatter<_E,_Tr> formatter_type;
+	typedef typename formatter_type::table_type table_type;
+	typedef typename formatter_type::size_type size_type;
+
+	format_measure(formatter_type& f)
+		: _Format(f), _Table(f.table()), _N(0), _Argn(0), _Stars(0),
+		  _StarWidth(0), _StarPrec(0), _Length(0)
+	{
+		_Pad = f.default_format_specification().width;
+	}
+
+	template <typename _Ty>
+	void add(_Ty v)
+	{
+		if (_Format.positional())
+		{
+			add_argument(v);
+			return;
+		}
+		if constexpr (format_is_integer<_Ty>::value &&
+			!std::is_same<_Ty, bool>::value &&
+			!std::is_same<_Ty, _E>::value &&
+			!std::is_same<_Ty, char>::value &&
+			!std::is_same<_Ty, signed char>::value &&
+			!std::is_same<_Ty, unsigned char>::value)
+		{
+			bool starred;
+			if constexpr (sizeof(_Ty) > sizeof(long long))
+			{
+				starred = star(v);
+			}
+			else if constexpr (std::is_unsigned<_Ty>::value)
+			{
+				starred = star(static_cast<unsigned long long>(v));
+			}
+			else
+			{
+				starred = star(static_cast<long long>(v));
+			}
+			if (starred)
+			{
+				return;
+			}
+		}
+		SIB(fmtflags) f = _Table.flags(_N);
+		std::streamsize w = _Table.width(_N), prec = _Table.precision(_N);
+		if (_Table.widtharg(_N) && (_Stars & _StarWidthSet))
+		{
+			w = _StarWidth < 0 ? -_StarWidth : _StarWidth;
+		}
+		if (_Table.precarg(_N) && (_Stars & _StarPrecSet) && _StarPrec >= 0)
+		{
+			prec = _StarPrec;
+		}
+		_Stars = 0;
+		_Length += text_length(_N) + value_length(v, f, w, prec);
+		next();
+	}
+
+	// The length of the whole record
+	size_t finish()
+	{
+		if (!_Format.positional())
+		{
+			while (_N)
+			{
+				_Length += text_length(_N);
+				next();
+			}
+		}
+		return _Length;
+	}
+
+private:
+	enum { _StarWidthSet = 1, _StarPrecSet = 2 };
+
+	template <typename _Ty>
+	void add_argument(_Ty v)
+	{
+		size_type r, n;
+		if (!_Argn)
+		{
+			for (n = 0; n < _Format.FieldCount(); ++n)
+			{
+				_Length += text_length(n);
+			}
+		}
+		if (_Argn < _Format.ArgumentCount())
+		{
+			for (r = 0; r < _Format.ReferenceCount(_Argn); ++r)
+			{
+				n = _Format.Reference(_Argn, r);
+				_Length += value_length(v, _Table.flags(n), _Table.width(n),
+										_Table.precision(n));
+			}
+		}
+		if (++_Argn >= _Format.ArgumentCount())
+		{
+			_Argn = 0;
+		}
+	}
+
+	template <typename _Ty>
+	size_t value_length(_Ty v, SIB(fmtflags) f, std::streamsize w, std::streamsize prec)
+	{
+		if constexpr (std::is_same<_Ty, float>::value || std::is_same<_Ty, double>::value)
+		{
+			if (!(f & SIB(floatfield)))
+			{
+				general_floating(f, prec, v);
+			}
+			return measure_value<_E,_Tr>(static_cast<double>(v), f, w, prec);
+		}
+		else
+		{
+			return measure_value<_E,_Tr>(v, f, w, prec);
+		}
+	}
+
+	// As basic_oformatstream::star()
+	bool star(long long n)
+	{
+		const bool ignored = (n > INT_MAX || n < -INT_MAX);
+		if (_Table.widtharg(_N) && !(_Stars & _StarWidthSet))
+		{
+			_StarWidth = ignored ? 0 : static_cast<long>(n);
+			_Stars |= _StarWidthSet;
+			return true;
+		}
+		if (_Table.precarg(_N) && !(_Stars & _StarPrecSet))
+		{
+			_StarPrec = ignored ? -1 : static_cast<long>(n);
+			_Stars |= _StarPrecSet;
+			return true;
+		}
+		return false;
+	}
+
+	bool star(unsigned long long n)
+	{
+		return star(n > INT_MAX ? LLONG_MAX : static_cast<long long>(n));
+	}
+
+#if defined(__SIZEOF_INT128__)
+	bool star(__int128 n)
+	{
+		return star(n > INT_MAX || n < -INT_MAX ? LLONG_MAX : static_cast<long long>(n));
+	}
+
+	bool star(unsigned __int128 n)
+	{
+		return star(n > INT_MAX ? LLONG_MAX : static_cast<long long>(n));
+	}
+#endif
+
+	// A field's text, padded as basic_oformatstream::put_text() pads it
+	size_t text_length(size_type n)
+	{
+		size_t len = _Table.text_size(n);
+		return (len && _Pad > static_cast<std::streamsize>(len)) ?
+			static_cast<size_t>(_Pad) : len;
+	}
+
+	void next()
+	{
+		if (++_N >= _Format.FieldCount())
+		{
+			_N = 0;
+		}
+	}
+
+	formatter_type& _Format;
+	const table_type& _Table;
+	size_type _N;
+	size_type _Argn;
+	int _Stars;
+	long _StarWidth;
+	long _StarPrec;
+	std::streamsize _Pad;
+	size_t _Length;
+};
+
+template <typename _E, typename _Tr>
+template <typename... _Args> inline
+size_t basic_formatter<_E,_Tr>::measure(_Args... args)
+{
+	format_measure<_E,_Tr> m(*this);
+	(m.add(args), ...);
+	return m.finish();
+}
+
+//------------------------------------------------------
+// TEMPLATE CLASS format_facets
+// Caches what the formatters need to know about a stream's locale,
+// looking its facets up again only when a different locale is imbued.
+//------------------------------------------------------
+template <typename _E>
+class format_facets
+{
+public:
+	format_facets()
+		: _Valid(false), _Grouped(false)
+	{}
+
+	// True if the locale imbued in io groups the digits of numbers.
+	bool grouping(const std::ios_base& io)
+	{
+		std::locale loc(io.getloc());
+		if (!_Valid || !(loc == _Loc))
+		{
+			_Loc = loc;
+			_Grouped = !std::use_facet<std::numpunct<_E> >(_Loc).grouping().empty();
+			_Valid = true;
+		}
+		return _Grouped;
+	}
+
+private:
+	std::locale _Loc;
+	bool _Valid;
+	bool _Grouped;
+};
+
+template <typename _E, typename _Tr, typename... _Args>
+class basic_record_awaiter;
+
+//------------------------------------------------------
+// ENUM format_flush
+// When endl flushes a basic_oformatstream, see flush_policy().
+// The stream buffer still writes whenever it fills, and a basic_sinkbuf
+// whenever the format changes, whatever the policy.
+//------------------------------------------------------
+enum format_flush
+{
+	flush_every_line,		// each endl, as std::endl (the default)
+	flush_every_records,	// every n endl
+	flush_every_bytes,		// endl once n characters are waiting
+	flush_every_interval,	// endl once n milliseconds have passed
+	flush_explicit,			// only flush()
+	flush_never				// not even flush()
+};
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_oformatstream
+// Outputs values to the connected stream (does nothing if not).
+// The internal basic_formatter object controls the layout of each
+// output field and the order that they are expected.
+// No exceptions are thrown if the supplied field type does not match
+// the expected format. The output will probably just look awful.
+//
+// If the formatter is positional each argument is rendered into the
+// slot of every field that displays it, and the whole record is written
+// in field order once its last argument has been inserted.
+// Inserting setformat writes a record that is still missing arguments.
+//------------------------------------------------------
+template <typename _E, typename _Tr = std::char_traits<_E> >
+class basic_oformatstream
+{
+public:
+
+	typedef basic_oformatstream<_E,_Tr> _Myt;
+	typedef std::basic_ostream<_E,_Tr> _Myostream;
+	typedef _Myostream::_Mysb _Mysb;
+	typedef _Myostream::_Myios _Myios;
+
+	typedef typename basic_formatter<_E,_Tr>::size_type size_type;
+	typedef typename basic_formatter<_E>::table_type table_type;
+
+	basic_oformatstream()
+		: _Ostream(NULL), _Out(NULL), _Argn(0), _Ref(0), _Stars(0),
+		  _Classic(false), _Stable(NULL), _FlushWhen(flush_every_line),
+		  _FlushEvery(0), _Unflushed(0), _LineSize(0)
+	{}
+
+	explicit basic_oformatstream(const std::basic_string<_E,_Tr>& s, _Myostream *os = NULL)
+		: _Format(basic_formatter<_E,_Tr>(s)), _Ostream(NULL), _Out(NULL),
+		  _Argn(0), _Ref(0), _Stars(0), _Classic(false), _Stable(NULL),
+		  _FlushWhen(flush_every_line), _FlushEvery(0), _Unflushed(0), _LineSize(0)
+	{ tie(os); }
+
+	explicit basic_oformatstream(const basic_formatter<_E>& f, _Myostream *os = NULL)
+		: _Format(f), _Ostream(NULL), _Out(NULL), _Argn(0), _Ref(0), _Stars(0),
+		  _Classic(false), _Stable(NULL), _FlushWhen(flush_every_line),
+		  _FlushEvery(0), _Unflushed(0), _LineSize(0)
+	{ tie(os); }
+
+	basic_oformatstream(const basic_oformatstream& ofs)
+		: _Format(ofs._Format), _Ostream(NULL), _Out(NULL), _Argn(0), _Ref(0),
+		  _Stars(0), _Classic(ofs._Classic), _Stable(NULL), _FlushWhen(ofs._FlushWhen),
+		  _FlushEvery(ofs._FlushEvery), _Unflushed(0), _LineSize(0),
+		  _Flushed(ofs._Flushed)
+	{ tie(ofs._Ostream); }
+
+	basic_oformatstream& operator=(const basic_oformatstream& ofs)
+	{
+		if (this != &ofs)
+		{
+			formatter(ofs._Format);
+			tie(ofs._Ostream);
+			_Classic = ofs._Classic;
+			flush_policy(ofs._FlushWhen, ofs._FlushEvery);
+		}
+		return (*this);
+	}
+
+	virtual ~basic_oformatstream()
+	{
+		stat_publish();
+		release_sink();
+	}
+
+	void formatter(const basic_formatter<_E,_Tr>& f)
+	{
+		stat_publish();
+		_Format = f; _Out = _Ostream; _Argn = 0; _Stars = 0; _Slots.clear();
+		_LineSize = 0;
+		stat_reformat();
+	}
+
+	basic_formatter<_E>& formatter()
+	{ return _Format; }
+
+	// Take the format of a basic_format_record, unless the stream's
+	// formatter is an unedited copy of it already, as copying a
+	// formatter costs far more than a record.
+	void record_format(const basic_formatter<_E,_Tr>* f)
+	{
+		if (!f->key() || f->key() != _Format.key())
+		{
+			formatter(*f);
+		}
+	}
+
+	// A basic_sinkbuf under os is remembered, see put_text().
+	void tie(_Myostream *os)
+	{
+		release_sink();
+		_Ostream = _Out = os;
+		_Stable = os ? dynamic_cast<basic_stable_sinkbuf<_E,_Tr>*>(os->rdbuf()) : NULL;
+	}
+
+	_Myostream* get_ostream()
+	{ return _Ostream; }
+
+	// The basic_sinkbuf the stream writes to, if it does
+	basic_stable_sinkbuf<_E,_Tr>* sinkbuf()
+	{ return stable_sink() ? _Stable : NULL; }
+
+	// The stream the current field is being written to.
+	// Only differs from get_ostream() for positional formats.
+	_Myostream* get_field_ostream()
+	{ return _Out; }
+
+	// Write the current field's literal text and move on to the next
+	// field without a value, as setformat does.
+	void put_field_text()
+	{
+		stat_begin();
+		const table_type& t = table();
+		size_type n = _Format.position();
+		put_text(t.text(n), t.text_size(n));
+		*_Ostream << setformat(_Format);
+		stat_field();
+	}
+
+	// Write _X with the std::basic_ostream inserter of the field's stream.
+	// Used by the string inserters between prefix() and suffix().
+	// Counting statistics, _X is rendered into _Staging first, in the
+	// field's format, so that the length written is known.
+	template <typename _Ty>
+	void put_inserted(const _Ty& _X)
+	{
+#if defined(OFORMAT_STATISTICS)
+		if (_Out == _Ostream)
+		{
+			_Staging.str(std::basic_string<_E,_Tr>());
+			if (_Staging.getloc() != _Ostream->getloc())
+			{
+				_Staging.imbue(_Ostream->getloc());
+			}
+			_Staging.flags(_Ostream->flags());
+			_Staging.width(_Ostream->width());
+			_Staging.precision(_Ostream->precision());
+			_Staging.fill(_Ostream->fill());
+			_Staging << _X;
+			_Ostream->width(0);
+			std::basic_string<_E,_Tr> text(_Staging.str());
+			put_raw(*_Ostream, text.data(), text.size());
+			stat_bytes(text.size());
+			return;
+		}
+#endif
+		*_Out << _X;
+	}
+
+	// Write a single character padded to the current field's width.
+	// Used by the character inserter between prefix() and suffix().
+	void put_char(_E _C)
+	{
+		std::streamsize w = _Out->width();
+		std::streamsize pad = w > 1 ? w - 1 : 0;
+		_Buffer.assign(static_cast<size_t>(pad + 1), _Out->fill());
+		_Buffer[(_Out->flags() & SIB(left)) ? 0 : static_cast<size_t>(pad)] = _C;
+		put_buffer();
+	}
+
+	format_specification default_format_specification()
+	{ return _Format.default_format_specification(); }
+
+	// In classic mode numbers are always shown as the "C" locale would,
+	// without consulting the facets of the stream's imbued locale.
+	// Otherwise they follow its locale, eg. grouping the digits.
+	void classic(bool on)
+	{ _Classic = on; }
+
+	bool classic() const
+	{ return _Classic; }
+
+	// Have endl flush as when says, every n records, characters or
+	// milliseconds.  Characters are counted by a basic_sinkbuf, and
+	// otherwise guessed from record_size(), one record per line.
+	// With flush_every_interval, endl flushes once n milliseconds have
+	// passed since the last flush, but nothing flushes a stream that
+	// isn't written to; see async_fd_sink::flush_interval() for that.
+	void flush_policy(format_flush when, unsigned long long n = 0)
+	{
+		_FlushWhen = when; _FlushEvery = n; _Unflushed = 0;
+		if (flush_every_interval == when)
+		{
+			_Flushed = std::chrono::steady_clock::now();
+		}
+	}
+
+	format_flush flush_policy() const
+	{ return _FlushWhen; }
+
+	// MANIPULATION OPERATIONS
+
+	_Myt& operator<<(_Myt& (__cdecl *_F)(_Myt&))
+	{ return ((*_F)(*this)); }
+
+	_Myt& operator<<(_Myostream& (__cdecl *_F)(_Myostream&))
+	{ if (_Ostream) ((*_F)(*_Ostream)); return (*this); }
+
+	_Myt& operator<<(_Myios& (__cdecl *_F)(_Myios&))
+	{ if (_Ostream) (*_F)(*(_Myios *)_Ostream); return (*this); }
+
+	_Myt& operator<<(std::ios_base& (__cdecl *_F)(std::ios_base&))
+	{ if (_Ostream) (*_F)(*(std::ios_base *)_Ostream); return (*this); }
+
+	bool prefix()
+	{
+		bool ok(NULL != _Ostream);
+		if (ok && _Format.positional())
+		{
+			begin_argument();
+		}
+		else if (ok)
+		{
+			stat_begin();
+			const table_type& t = table();
+			size_type n = _Format.position();
+			put_text(t.text(n), t.text_size(n));
+			_Ostream->fill(t.fill(n));
+			*_Ostream << setformat(_Format);
+			if (_Stars)
+			{
+				apply_stars(t, n);
+			}
+		}
+		return ok;
+	}
+
+	// Consume n as the '*' width or precision of the current field.
+	// Returns false if the field is not waiting for one, in which case
+	// n is the field's value.  The compiled format is never changed.
+	// As printf takes an int, a value outside its range is consumed
+	// but ignored: the field has no width, or its own precision.
+	bool star(long long n)
+	{
+		if (NULL == _Ostream || _Format.positional())
+		{
+			return false;
+		}
+		const bool ignored = (n > INT_MAX || n < -INT_MAX);
+		const table_type& t = table();
+		size_type f = _Format.position();
+		if (t.widtharg(f) && !(_Stars & _StarWidthSet))
+		{
+			_StarWidth = ignored ? 0 : static_cast<std::streamsize>(n);
+			_Stars |= _StarWidthSet;
+			return true;
+		}
+		if (t.precarg(f) && !(_Stars & _StarPrecSet))
+		{
+			_StarPrec = ignored ? -1 : static_cast<std::streamsize>(n);
+			_Stars |= _StarPrecSet;
+			return true;
+		}
+		return false;
+	}
+
+	bool star(unsigned long long n)
+	{
+		return star(n > INT_MAX ? LLONG_MAX : static_cast<long long>(n));
+	}
+
+#if defined(__SIZEOF_INT128__)
+	bool star(__int128 n)
+	{
+		return star(n > INT_MAX || n < -INT_MAX ? LLONG_MAX : static_cast<long long>(n));
+	}
+
+	bool star(unsigned __int128 n)
+	{
+		return star(n > INT_MAX ? LLONG_MAX : static_cast<long long>(n));
+	}
+#endif
+	// Returns true if the same value must be written again,
+	// for the next field of a positional format that displays it.
+	bool suffix()
+	{
+		if (NULL != _Ostream)
+		{
+			if (_Format.positional())
+			{
+				return next_reference();
+			}
+			*_Ostream << setformat(_Format.default_format_specification());
+			stat_field();
+		}
+		return false;
+	}
+
+	// Write a positional record that is still missing some arguments.
+	void end_record()
+	{
+		if (_Argn)
+		{
+			write_record();
+		}
+	}
+
+	// INSERTER operators
+	_Myt& operator<<(bool _X)
+	{if (prefix())	do put_inserted(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(short _X)
+	{if (star((long long)_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(unsigned short _X)
+	{if (star((unsigned long long)_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(int _X)
+	{if (star((long long)_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(unsigned int _X)
+	{if (star((unsigned long long)_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(long _X)
+	{if (star((long long)_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(unsigned long _X)
+	{if (star((unsigned long long)_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(long long _X)
+	{if (star((long long)_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(unsigned long long _X)
+	{if (star((unsigned long long)_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+#if defined(__SIZEOF_INT128__)
+	_Myt& operator<<(__int128 _X)
+	{if (star(_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(unsigned __int128 _X)
+	{if (star(_X))	return (*this);
+	 if (prefix())	do put_integer(_X); while (suffix());
+		return (*this); }
+#endif
+	_Myt& operator<<(float _X)
+		{*this<<((double)_X);
+		return (*this); }
+	// %g format (general floating point) is emulated by general_floating,
+	// which adjusts the precision and fixed vs scientific format flags.
+	_Myt& operator<<(double _X)
+		{if (prefix()) do {SIB(fmtflags) _f = _Out->flags();
+			if (!(_f & SIB(floatfield))){
+				std::streamsize prec = _Out->precision();
+				general_floating(_f, prec, _X);
+				_Out->flags(_f);
+				_Out->precision(prec);
+			}
+			put_floating(_X);} while (suffix());
+		return (*this); }
+	_Myt& operator<<(long double _X)
+		{if (prefix())	do put_floating(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(const void *_X)
+		{if (prefix())	do put_pointer(_X); while (suffix());
+		return (*this); }
+	_Myt& operator<<(_Mysb *_Pb)
+		{if (prefix())	do put_inserted(_Pb); while (suffix());
+		return (*this); }
+
+	// RECORDS
+	// Output args as one whole record, then setformat as far as its last
+	// field.  The stream should be between records.  args may also be
+	// a basic_format_record, in its own format.
+	template <typename... _Args>
+	_Myt& put_record(const _Args&... args)
+		{if constexpr (sizeof...(_Args) != 0)
+			(*this << ... << args);
+		if (_Format.positional())
+			end_record();
+		else while (_Format.position())
+			put_field_text();
+		return (*this); }
+
+	// co_await ofs.write_record(args...) outputs args as put_record()
+	// does, but if the stream writes to a basic_sinkbuf whose sink would
+	// have to wait for room, the coroutine is suspended instead, and
+	// resumed by the sink once the record fits, see basic_record_awaiter.
+	// The values are kept until then, but not what pointers point to.
+	template <typename... _Args>
+	basic_record_awaiter<_E,_Tr,_Args...> write_record(_Args... args)
+		{return basic_record_awaiter<_E,_Tr,_Args...>(*this, args...); }
+
+	// BULK INSERTERS
+	// Each value is formatted against the next field, cycling through
+	// the field table exactly as the same values inserted one by one.
+	// Plain integer arrays are converted in one loop into a buffer that
+	// is written in large blocks, with each field's flags decided once.
+	// Anything else is handed to the ordinary inserters one by one.
+	template <typename _Ty, std::size_t _N>
+	_Myt& operator<<(std::span<_Ty,_N> _X)
+		{return insert(_X.data(), _X.data() + _X.size()); }
+
+	template <typename _Iter>
+	_Myt& insert(_Iter _F, _Iter _L)
+		{if constexpr (std::contiguous_iterator<_Iter>)
+			{insert_range(std::to_address(_F), std::to_address(_F) + (_L - _F));
+			return (*this); }
+		else
+			{for (; _F != _L; ++_F) *this << *_F;
+			return (*this); }}
+
+	_Myt& flush()
+		{if (flush_never == _FlushWhen)
+			return (*this);
+		if (_Ostream) { _Ostream->flush(); }
+		_Unflushed = 0;
+		if (flush_every_interval == _FlushWhen)
+			_Flushed = std::chrono::steady_clock::now();
+		OFORMAT_TRACE_EVENT(flush, this, 0);
+		stat_flush();
+		return (*this); }
+
+	// Output a new line, then flush if the flush policy says to, as endl does
+	_Myt& end_line()
+		{put(widen('\n'));
+		if (line_flush())
+			flush();
+		return (*this); }
+
+	_Myt& put(_E _X)
+		{if (_Ostream) { _Ostream->put(_X); stat_bytes(1); }
+		return (*this); }
+
+	_E widen(char _C) const
+		{return (_Ostream ? _Ostream->widen(_C): _E(0)); }
+
+private:
+	enum { _StarWidthSet = 1, _StarPrecSet = 2 };
+
+	// Convert an integer with format_integer, laid out by the width,
+	// fill and flags prefix() has set on the field's stream.
+	// Only a locale that groups digits needs the num_put facet,
+	// which has no 128 bit conversion so those are never grouped.
+	template <typename _Ty>
+	void put_integer(_Ty _X)
+	{
+		if constexpr (sizeof(_Ty) <= sizeof(long long))
+		{
+			if (!_Classic && _Facets.grouping(*_Out))
+			{
+				put_inserted(_X);
+				return;
+			}
+		}
+		format_plan<_E,_Tr> plan;
+		plan.set(*_Out, _Out->fill());
+		_Buffer.erase();
+		format_integer(_Buffer, _X, plan);
+		put_buffer();
+	}
+
+	// Floating point values only bypass the num_put facet in classic
+	// mode, as the locale decides their decimal point too.
+	template <typename _Ty>
+	void put_floating(_Ty _X)
+	{
+		if (_Classic)
+		{
+			format_plan<_E,_Tr> plan;
+			plan.set(*_Out, _Out->fill());
+			_Buffer.erase();
+			if (format_floating(_Buffer, _X, *_Out, plan))
+			{
+				put_buffer();
+				return;
+			}
+		}
+		put_inserted(_X);
+	}
+
+	void put_pointer(const void* _X)
+	{
+		format_plan<_E,_Tr> plan;
+		plan.set(*_Out, _Out->fill());
+		_Buffer.erase();
+		format_pointer(_Buffer, _X, plan);
+		put_buffer();
+	}
+
+	// Write a field laid out in _Buffer to the field's stream.
+	void put_buffer()
+	{
+		put_raw(*_Out, _Buffer.data(), _Buffer.size());
+		_Out->width(0);
+		if (_Out == _Ostream)
+		{
+			stat_bytes(_Buffer.size());
+		}
+	}
+
+	// A field's literal text from table() is written as is, its length
+	// already known, unless the default format is wide enough to pad it.
+	// A basic_sinkbuf is given the text itself, to keep until it syncs.
+	void put_text(const _E* text, size_t len)
+	{
+		if (!len)
+		{
+			return;
+		}
+		std::streamsize pad = _Format.default_format_specification().width;
+		if (pad > static_cast<std::streamsize>(len))
+		{
+			*_Ostream << setformat(_Format.default_format_specification())
+				<< std::basic_string<_E,_Tr>(text, len).c_str();
+			stat_bytes(static_cast<size_t>(pad));
+		}
+		else if (stable_sink() && _Ostream->good() &&
+				 !(_Ostream->flags() & SIB(unitbuf)))
+		{
+			_Stable->put_stable(text, len);
+			stat_bytes(len);
+		}
+		else
+		{
+			put_raw(*_Ostream, text, len);
+			stat_bytes(len);
+		}
+	}
+
+	// True if the flush policy says a line just ended should be flushed
+	bool line_flush()
+	{
+		switch (_FlushWhen)
+		{
+		case flush_every_line:
+			return true;
+		case flush_every_records:
+			return ++_Unflushed >= _FlushEvery;
+		case flush_every_bytes:
+			if (stable_sink())
+			{
+				return _Stable->unflushed() >= _FlushEvery;
+			}
+			if (!_LineSize)
+			{
+				_LineSize = _Format.record_size().typical + 1;
+			}
+			return (_Unflushed += _LineSize) >= _FlushEvery;
+		case flush_every_interval:
+			return std::chrono::steady_clock::now() - _Flushed >=
+				std::chrono::milliseconds(_FlushEvery);
+		default:
+			return false;
+		}
+	}
+
+	// True if the stream writes to the basic_sinkbuf found by tie()
+	bool stable_sink()
+	{
+		return _Stable && _Ostream->rdbuf() == _Stable;
+	}
+
+	// The packed fields.  A basic_sinkbuf may still hold text from the
+	// current table, so it is synced before the table is rebuilt.
+	const table_type& table()
+	{
+		if (!_Format.table_current() && stable_sink())
+		{
+			_Stable->pubsync();
+		}
+		return _Format.table();
+	}
+
+	// Sync a basic_sinkbuf which may hold text from our table,
+	// before the stream is untied or destroyed.
+	void release_sink()
+	{
+		if (stable_sink())
+		{
+			_Stable->pubsync();
+		}
+	}
+
+	// Write complete output straight to a stream's buffer.  Nothing
+	// needs the sentry's padding or conversions, only its error state
+	// and unitbuf handling.
+	static void put_raw(_Myostream& os, const _E* p, size_t len)
+	{
+		_Mysb* sb = os.rdbuf();
+		std::streamsize n = static_cast<std::streamsize>(len);
+		if (!os.good() || !sb)
+		{
+			os.setstate(SIB(failbit));
+		}
+		else if (sb->sputn(p, n) != n)
+		{
+			os.setstate(SIB(badbit));
+		}
+		else if (os.flags() & SIB(unitbuf))
+		{
+			os.flush();
+		}
+	}
+	enum { _BulkBlock = 4096 };	// characters buffered by the bulk inserters
+
+	// Write a full block of bulk inserted values
+	void write_block()
+	{
+		_Ostream->write(_Buffer.data(), _Buffer.size());
+		stat_bytes(_Buffer.size());
+		_Buffer.erase();
+	}
+
+	template <typename _Ty>
+	_Myt& insert_range(const _Ty* _F, const _Ty* _L)
+	{
+		typedef typename std::remove_cv<_Ty>::type _Vty;
+		if constexpr (std::is_integral<_Vty>::value &&
+			!std::is_same<_Vty, bool>::value &&
+			!std::is_same<_Vty, char>::value &&
+			!std::is_same<_Vty, signed char>::value &&
+			!std::is_same<_Vty, unsigned char>::value &&
+			!std::is_same<_Vty, wchar_t>::value)
+		{
+			if (plan_fields())
+			{
+				size_type n(_Format.position()), nfields(_Plans.size());
+				const size_type first(n), count(static_cast<size_type>(_L - _F));
+				_Buffer.erase();
+				if constexpr (sizeof(_Vty) <= sizeof(unsigned int))
+				{
+					if (_PlanBase)
+					{
+						n = insert_batched(_F, _L, n);
+						_F = _L;
+					}
+				}
+				for (; _F != _L; ++_F)
+				{
+					const format_plan<_E,_Tr>& plan = _Plans[n];
+					if (++n == nfields) n = 0;
+					_Buffer.append(plan.text, plan.textlen);
+					format_integer(_Buffer, *_F, plan);
+					if (_Buffer.size() >= _BulkBlock)
+					{
+						write_block();
+					}
+				}
+				_Ostream->write(_Buffer.data(), _Buffer.size());
+				stat_bytes(_Buffer.size());
+				stat_bulk(first, count);
+				_Format.position(n);
+				*_Ostream << setformat(_Format.default_format_specification());
+				return (*this);
+			}
+		}
+		for (; _F != _L; ++_F) *this << *_F;
+		return (*this);
+	}
+
+	// Values that fit an unsigned int, going to fields which all have the
+	// same decimal or hex format, have their digits made digits_batch at
+	// a time by the vector kernels of oformatdigits.  Each value is then
+	// laid out for its own field.  Returns the next field to use.
+	template <typename _Ty>
+	size_type insert_batched(const _Ty* _F, const _Ty* _L, size_type n)
+	{
+		typedef typename std::remove_cv<_Ty>::type _Vty;
+		typedef typename std::make_unsigned<_Vty>::type _Uty;
+		const bool dec(10 == _PlanBase);
+		const int width(dec ? digits_dec_width : digits_hex_width);
+		const size_type nfields(_Plans.size());
+		unsigned int u[digits_batch];
+		bool neg[digits_batch];
+		char digits[digits_batch * digits_dec_width];
+		char pre[2];
+		while (_F != _L)
+		{
+			int k, nb = static_cast<int>(_L - _F < digits_batch ? _L - _F : digits_batch);
+			for (k = 0; k < nb; ++k)
+			{
+				_Vty v = _F[k];
+				neg[k] = dec && std::is_signed<_Vty>::value && v < 0;
+				u[k] = neg[k] ? 0u - static_cast<unsigned int>(v)
+							  : static_cast<unsigned int>(static_cast<_Uty>(v));
+			}
+			for (; k < digits_batch; ++k)
+			{
+				u[k] = 0;
+			}
+			if (dec) digits_dec(u, digits);
+			else digits_hex(u, digits, _PlanUpper);
+			for (k = 0; k < nb; ++k, ++_F)
+			{
+				const format_plan<_E,_Tr>& plan = _Plans[n];
+				if (++n == nfields) n = 0;
+				_Buffer.append(plan.text, plan.textlen);
+				const char* body = digits + k * width;
+				const char* end = body + width;
+				while (body != end - 1 && '0' == *body) ++body;
+				const char* p = integer_prefix(pre + 2, neg[k],
+					std::is_signed<_Vty>::value, u[k] != 0, plan);
+				layout_integer(_Buffer, p, pre + 2, body, end, plan);
+				if (_Buffer.size() >= _BulkBlock)
+				{
+					write_block();
+				}
+			}
+		}
+		return n;
+	}
+
+	// Plan every field for the bulk inserters.  Returns false if
+	// the values must go through the ordinary inserters instead.
+	// Sets _PlanBase if every field has the same decimal or hex format.
+	bool plan_fields()
+	{
+		if (NULL == _Ostream || _Format.positional() || _Stars ||
+			!_Format.FieldCount() ||
+			_Format.default_format_specification().width > 1 ||
+			(!_Classic && _Facets.grouping(*_Ostream)))
+		{
+			return false;
+		}
+		size_type n, nfields(_Format.FieldCount());
+		_Plans.resize(nfields);
+		for (n = 0; n < nfields; ++n)
+		{
+			if (!_Plans[n].set(table(), n))
+			{
+				return false;
+			}
+		}
+		_PlanBase = _Plans[0].base;
+		_PlanUpper = _Plans[0].upper;
+		for (n = 1; n < nfields && _PlanBase; ++n)
+		{
+			if (_Plans[n].base != _PlanBase || _Plans[n].upper != _PlanUpper)
+			{
+				_PlanBase = 0;
+			}
+		}
+		if (8 == _PlanBase)
+		{
+			_PlanBase = 0;
+		}
+		return true;
+	}
+
+	// Override the compiled width and precision with the '*' values.
+	// As for printf a negative width means left justify and
+	// a negative precision is ignored.
+	void apply_stars(const table_type& t, size_type n)
+	{
+		if (t.widtharg(n) && (_Stars & _StarWidthSet))
+		{
+			if (_StarWidth < 0)
+			{
+				_Ostream->setf(SIB(left), SIB(adjustfield));
+				_StarWidth = -_StarWidth;
+			}
+			_Ostream->width(_StarWidth);
+		}
+		if (t.precarg(n) && (_Stars & _StarPrecSet) && _StarPrec >= 0)
+		{
+			_Ostream->precision(_StarPrec);
+		}
+		_Stars = 0;
+	}
 
-	_Myt& operator<<(_Myostream& (__cdecl *_F)(_Myostream&))
-	{ if (_Ostream) ((*_F)(*_Ostream)); return (*this); }
+	// Start rendering the next argument of a positional record
+	// into the slot of the first field that displays it.
+	void begin_argument()
+	{
+		if (!_Argn)
+		{
+			_Slots.resize(_Format.FieldCount());
+			_Staging.imbue(_Ostream->getloc());
+			stat_begin();
+		}
+		_Ref = 0;
+		set_reference();
+	}
 
-	_Myt& operator<<(_Myios& (__cdecl *_F)(_Myios&))
-	{ if (_Ostream) (*_F)(*(_Myios *)_Ostream); return (*this); }
+	void set_reference()
+	{
+		_Out = &_Staging;
+		_Staging.str(std::basic_string<_E,_Tr>());
+		if (_Argn < _Format.ArgumentCount() &&
+			_Ref < _Format.ReferenceCount(_Argn))
+		{
+			const table_type& t = table();
+			size_type n = _Format.Reference(_Argn, _Ref);
+			_Staging.fill(t.fill(n));
+			_Staging.width(t.width(n));
+			_Staging.precision(t.precision(n));
+			_Staging.flags(t.flags(n));
+		}
+		else
+		{	// an argument no field displays, render and discard it
+			_Staging << setformat(_Format.default_format_specification());
+		}
+	}
 
-	_Myt& operator<<(std::ios_base& (__cdecl *_F)(std::ios_base&))
-	{ if (_Ostream) (*_F)(*(std::ios_base *)_Ostream); return (*this); }
+	bool next_reference()
+	{
+		size_type refs(_Argn < _Format.ArgumentCount() ?
+			_Format.ReferenceCount(_Argn) : 0);
+		if (_Ref < refs)
+		{
+			_Slots[_Format.Reference(_Argn, _Ref)] = _Staging.str();
+		}
+		if (++_Ref < refs)
+		{
+			set_reference();
+			return true;
+		}
+		_Out = _Ostream;
+		if (++_Argn >= _Format.ArgumentCount())
+		{
+			write_record();
+		}
+		return false;
+	}
 
-	bool prefix()
+	// One linear pass over the fields, text then rendered argument.
+	void write_record()
 	{
-		bool ok(NULL != _Ostream);
-		if (ok)
+		size_type n, nfields(_Format.FieldCount());
+		const table_type& t = table();
+		_Slots.resize(nfields);
+		for (n = 0; n < nfields; ++n)
 		{
-			std::basic_string<_E,_Tr>& text = _Format().text;
-			if (!text.empty())
-				*_Ostream << setformat(_Format.default_format_specification())
-					<< text.c_str();
-			_Ostream->fill(_Format().fill);
-			*_Ostream << setformat(_Format);
+			put_text(t.text(n), t.text_size(n));
+			if (!_Slots[n].empty())
+			{
+				_Ostream->write(_Slots[n].data(), _Slots[n].size());
+				stat_bytes(_Slots[n].size());
+				_Slots[n].erase();
+			}
 		}
-		return ok;
+		_Argn = 0;
+		stat_record(nfields);
 	}
-	void suffix()
+
+	// STATISTICS AND TRACING
+	// These compile to nothing unless OFORMAT_STATISTICS or OFORMAT_TRACE
+	// is defined.  A record is timed from its first field's text to the
+	// end of its last field.  Bytes are counted from the lengths written.
+	// Fields and bytes are kept by the stream until a record ends, or the
+	// stream flushes, changes format or is destroyed, and then added to
+	// the format's counters together.
+	void stat_begin()
 	{
-		if (NULL != _Ostream)
+		if (0 == _Format.position())
 		{
-			*_Ostream << setformat(_Format.default_format_specification());
+#if defined(OFORMAT_STATISTICS)
+			_StatStart = format_statistics::clock::now();
+#endif
+			OFORMAT_TRACE_EVENT(record_begin, this, 0);
 		}
 	}
 
-	// INSERTER operators
-	_Myt& operator<<(bool _X)
-	{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(short _X)
-	{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(unsigned short _X)
-	{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(int _X)
-	{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(unsigned int _X)
-	{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(long _X)
-	{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(unsigned long _X)
-	{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(float _X)
-		{*this<<((double)_X);
-		return (*this); }
-	// The complexity in this inserter is due to the need to emulate
-	// %g format (general floating point). This code adjusts the precision
-	// and fixed vs scientific format flags.
-	_Myt& operator<<(double _X)
-		{if (prefix()){SIB(fmtflags) _f = _Ostream->flags();
-			if (!(_f & SIB(floatfield))){
-				std::streamsize prec = _Ostream->precision();
-				double mant = fabs(_X);
-				if (mant < 1e-4 || (mant > 0.0 ? (log10(mant) >= prec) : true)){
-					_Ostream->setf(SIB(scientific));
-				}
-				else {
-					_Ostream->setf(SIB(fixed));
-				}
-				_Ostream->precision(prec>0?prec-1:prec);
-				if (!(_Ostream->flags() & SIB(showpoint))){
-					mant = _X * pow(-log10(mant),10);
-					if ((mant - (double)(__int64)mant) > 10 * DBL_EPSILON)
-					{
-						_Ostream->setf(SIB(showpoint));
-					}
-				}
-			}
-			_Ostream->operator<<(_X); suffix();}
-		return (*this); }
-	_Myt& operator<<(long double _X)
-		{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(const void *_X)
-		{if (prefix())	{_Ostream->operator<<(_X); suffix(); }
-		return (*this); }
-	_Myt& operator<<(_Mysb *_Pb)
-		{if (prefix())  _Ostream->operator<<(_Pb);
-		return (*this); }
+	void stat_field()
+	{
+		if (0 == _Format.position())
+		{
+			stat_record(1);
+		}
+		else
+		{
+#if defined(OFORMAT_STATISTICS)
+			++_StatFields;
+#endif
+		}
+	}
 
-	_Myt& flush()
-		{if (_Ostream) { _Ostream->flush(); }
-		return (*this); }
+	void stat_record(size_type fields)
+	{
+		OFORMAT_TRACE_EVENT(record_end, this, _Format.FieldCount());
+#if defined(OFORMAT_STATISTICS)
+		unsigned long long ns = static_cast<unsigned long long>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				format_statistics::clock::now() - _StatStart).count());
+		_StatFields += fields;
+		stat_publish([ns](format_statistics& st) { ++st.records; st.latency.add(ns); });
+#else
+		(void)fields;
+#endif
+	}
 
-	_Myt& put(_E _X)
-		{if (_Ostream) { _Ostream->put(_X); }
-		return (*this); }
+	// count values from field first, converted by the bulk inserters
+	void stat_bulk(size_type first, size_type count)
+	{
+#if defined(OFORMAT_STATISTICS)
+		unsigned long long records = (first + count) / _Format.FieldCount();
+		_StatFields += count;
+		stat_publish([records](format_statistics& st) { st.records += records; });
+#else
+		(void)first;
+		(void)count;
+#endif
+	}
 
-	_E widen(char _C) const
-		{return (_Ostream ? _Ostream->widen(_C): _E(0)); }
+	void stat_bytes(size_t n)
+	{
+#if defined(OFORMAT_STATISTICS)
+		_StatBytes += n;
+#else
+		(void)n;
+#endif
+	}
+
+	void stat_flush()
+	{
+#if defined(OFORMAT_STATISTICS)
+		stat_publish([](format_statistics& st) { ++st.flushes; });
+#endif
+	}
+
+	void stat_reformat()
+	{
+#if defined(OFORMAT_STATISTICS)
+		_Format.counters().update([](format_statistics& st) { ++st.reformats; });
+#endif
+	}
+
+	// Add the fields and bytes kept so far to the format's counters,
+	// with whatever else f adds.
+	template <typename _Fn>
+	void stat_publish(_Fn f)
+	{
+#if defined(OFORMAT_STATISTICS)
+		unsigned long long fields(_StatFields), bytes(_StatBytes);
+		_StatFields = _StatBytes = 0;
+		_Format.counters().update([&](format_statistics& st) {
+			st.fields += fields;
+			st.bytes += bytes;
+			f(st);
+		});
+#else
+		(void)f;
+#endif
+	}
+
+	void stat_publish()
+	{
+#if defined(OFORMAT_STATISTICS)
+		if (_StatFields || _StatBytes)
+		{
+			stat_publish([](format_statistics&) {});
+		}
+#endif
+	}
 
-private:
 	basic_formatter<_E> _Format;
 	_Myostream *_Ostream;
+	_Myostream *_Out;	// _Ostream, or _Staging while rendering an argument
+	std::basic_ostringstream<_E,_Tr> _Staging;
+	std::vector<std::basic_string<_E,_Tr> > _Slots;	// rendered field values
+	size_type _Argn;	// argument of the current positional record
+	size_type _Ref;		// field of _Argn currently being rendered
+	int _Stars;			// which '*' values have been taken for this field
+	std::streamsize _StarWidth;
+	std::streamsize _StarPrec;
+	std::vector<format_plan<_E,_Tr> > _Plans;	// used by the bulk inserters
+	int _PlanBase;		// base shared by all _Plans, 0 if they differ
+	bool _PlanUpper;
+	std::basic_string<_E,_Tr> _Buffer;
+	bool _Classic;		// format numbers as the "C" locale would
+	basic_stable_sinkbuf<_E,_Tr>* _Stable;	// the sink under _Ostream, if any
+	format_facets<_E> _Facets;
+	format_flush _FlushWhen;
+	unsigned long long _FlushEvery;
+	unsigned long long _Unflushed;	// lines, or guessed characters, since the last flush
+	size_t _LineSize;				// guessed characters in a line, 0 until needed
+	std::chrono::steady_clock::time_point _Flushed;
+#if defined(OFORMAT_STATISTICS)
+	format_statistics::clock::time_point _StatStart;
+	unsigned long long _StatFields = 0;	// not yet added to the format's counters
+	unsigned long long _StatBytes = 0;
+#endif
 };
 
 
@@ -943,9 +3804,7 @@ basic_oformatstream<_E, _Tr>& __cdecl operator<<(
 	basic_oformatstream<_E, _Tr>& _O, const _E *_X)
 {
 	if (_O.prefix()) {
-		auto* os = _O.get_ostream();
-		*os << _X;
-		_O.suffix();
+		do _O.put_inserted(_X); while (_O.suffix());
 	}
 	return (_O); 
 }
@@ -955,9 +3814,30 @@ basic_oformatstream<_E, _Tr>& __cdecl operator<<(
 	basic_oformatstream<_E, _Tr>& _O, _E _C)
 {
 	if (_O.prefix()) {
-		auto os = _O.get_ostream();
-		*os << _C;
-		_O.suffix();
+		do _O.put_char(_C); while (_O.suffix());
+	}
+	return (_O); 
+}
+
+// Narrow characters and strings are widened for a wide stream,
+// as std::wostream does.
+template<class _Tr> inline
+basic_oformatstream<wchar_t, _Tr>& __cdecl operator<<(
+	basic_oformatstream<wchar_t, _Tr>& _O, const char *_X)
+{
+	if (_O.prefix()) {
+		do _O.put_inserted(_X); while (_O.suffix());
+	}
+	return (_O); 
+}
+
+template<class _Tr> inline
+basic_oformatstream<wchar_t, _Tr>& __cdecl operator<<(
+	basic_oformatstream<wchar_t, _Tr>& _O, char _C)
+{
+	if (_O.prefix()) {
+		auto* os = _O.get_field_ostream();
+		do _O.put_char(os->widen(_C)); while (_O.suffix());
 	}
 	return (_O); 
 }
@@ -1021,13 +3901,13 @@ _FSmanip<wchar_t, const wformatter&, std::char_traits<wchar_t> > reformat(const
 template<class _E, class _Tr> inline
 basic_oformatstream<_E, _Tr>&
 __cdecl endl(basic_oformatstream<_E, _Tr>& _O)
-{_O.put(_O.widen('\n'));_O.flush();return (_O);}
+{return (_O.end_line());}
 inline basic_oformatstream<char, std::char_traits<char> >&
 __cdecl endl(basic_oformatstream<char, std::char_traits<char> >& _O)
-{_O.put('\n');_O.flush();return (_O);}
+{return (_O.end_line());}
 inline basic_oformatstream<wchar_t, std::char_traits<wchar_t> >&
 __cdecl endl(basic_oformatstream<wchar_t, std::char_traits<wchar_t> >& _O)
-{_O.put('\n');_O.flush();return (_O);}
+{return (_O.end_line());}
 
 template<class _E, class _Tr> inline
 basic_oformatstream<_E, _Tr>&
@@ -1056,12 +3936,13 @@ basic_oformatstream<_E, _Tr>&
 __cdecl setformat(basic_oformatstream<_E,_Tr>& _O)
 {
 	auto os = _O.get_ostream();
-	if (os)
+	if (os && _O.formatter().positional())
+	{
+		_O.end_record();
+	}
+	else if (os)
 	{
-		basic_formatter<_E>& f = _O.formatter();
-		if (!f().text.empty())
-			*os << setformat(f.default_format_specification()) << f().text.c_str();
-		*os << setformat(f);
+		_O.put_field_text();
 	}
 	return (_O);
 }
@@ -1069,13 +3950,13 @@ inline basic_oformatstream<char, std::char_traits<char> >&
 __cdecl setformat(basic_oformatstream<char, std::char_traits<char> >& _O)
 {
 	auto os = _O.get_ostream();
-	if (os)
+	if (os && _O.formatter().positional())
+	{
+		_O.end_record();
+	}
+	else if (os)
 	{
-		basic_formatter<char>& f = _O.formatter();
-		if (!f().text.empty())
-			*os << setformat(f.default_format_specification())
-				<< f().text.c_str();
-		*os << setformat(f);
+		_O.put_field_text();
 	}
 	return (_O);
 }
@@ -1084,13 +3965,13 @@ __cdecl setformat(basic_oformatstream<wchar_t, std::char_traits<wchar_t> >& _O)
 {
 	basic_oformatstream<wchar_t,std::char_traits<wchar_t> >::_Myostream*
 		os = _O.get_ostream();
-	if (os)
+	if (os && _O.formatter().positional())
+	{
+		_O.end_record();
+	}
+	else if (os)
 	{
-		basic_formatter<wchar_t>& f = _O.formatter();
-		if (!f().text.empty())
-			*os << setformat(f.default_format_specification())
-				<< f().text.c_str();
-		*os << setformat(f);
+		_O.put_field_text();
 	}
 	return (_O);
 }
@@ -1099,5 +3980,394 @@ __cdecl setformat(basic_oformatstream<wchar_t, std::char_traits<wchar_t> >& _O)
 typedef basic_oformatstream<char, std::char_traits<char> > oformatstream;
 typedef basic_oformatstream<wchar_t, std::char_traits<wchar_t> > woformatstream;
 
+//------------------------------------------------------
+// TEMPLATE CLASS basic_record_awaiter
+// The awaitable returned by basic_oformatstream::write_record().
+// The record is measured, and if the stream's sink has room for it,
+// it is written at once without suspending.  Otherwise the coroutine is
+// handed to the sink, eg. an async_fd_sink, which resumes it as soon as
+// the record fits, and it is written then.  The record is measured as
+// in classic mode, and allowed twice that length otherwise, as a locale
+// grouping digits at most doubles them.
+// The coroutine should be the stream's only writer.
+//------------------------------------------------------
+template <typename _E, typename _Tr, typename... _Args>
+class basic_record_awaiter
+{
+public:
+	basic_record_awaiter(basic_oformatstream<_E,_Tr>& ofs, _Args... args)
+		: _Ofs(ofs), _Values(args...), _Length(0)
+	{}
+
+	bool await_ready()
+	{
+		basic_stable_sinkbuf<_E,_Tr>* sb = _Ofs.sinkbuf();
+		if (!sb)
+		{
+			return true;
+		}
+		_Length = std::apply([this](const _Args&... v)
+			{ return _Ofs.formatter().measure(v...); }, _Values);
+		if (!_Ofs.classic())
+		{
+			_Length *= 2;
+		}
+		return sb->ready(_Length);
+	}
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		return _Ofs.sinkbuf()->resume_when_ready(_Length, h);
+	}
+
+	void await_resume()
+	{
+		std::apply([this](const _Args&... v) { _Ofs.put_record(v...); }, _Values);
+	}
+
+private:
+	basic_oformatstream<_E,_Tr>& _Ofs;
+	std::tuple<_Args...> _Values;
+	size_t _Length;
+};
+
+//------------------------------------------------------
+// TEMPLATE CLASS basic_format_record
+// The values of one record, kept to be output later or on another
+// thread, eg.
+//
+// format_record rec(&catalog[n]);
+// rec << id << took << name;			// name is copied
+// queue.push_back(rec);
+// ...
+// ofs.put_record(queue.front());
+//
+// Each value keeps the type it was given as, so it is output exactly as
+// if inserted directly.  The first format_record_values values, and
+// strings of up to format_record_text characters in all, are kept in the
+// record itself, and only more than that goes on the heap.
+// Strings are copied, as the caller's may not last, unless given as
+// format_literal(p), whose text must outlive the record.  Narrow strings
+// and characters given to a wide record are widened as they are copied.
+// The format is a pointer to a compiled formatter, eg. in a
+// format_catalog, which must also outlive the record; without one the
+// values are output with the stream's current format.
+//------------------------------------------------------
+const size_t format_record_values = 8;
+const size_t format_record_text = 64;
+
+template <typename _E>
+struct basic_format_literal
+{
+	const _E* text;
+};
+
+inline basic_format_literal<char> format_literal(const char* p)
+{ basic_format_literal<char> l = { p }; return l; }
+inline basic_format_literal<wchar_t> format_literal(const wchar_t* p)
+{ basic_format_literal<wchar_t> l = { p }; return l; }
+
+template <typename _E, typename _Tr = std::char_traits<_E> >
+class basic_format_record
+{
+public:
+	typedef basic_formatter<_E,_Tr> formatter_type;
+
+	explicit basic_format_record(const formatter_type* f = NULL)
+		: _Fmt(f), _Count(0), _TextUsed(0)
+	{}
+
+	const formatter_type* format() const
+	{ return _Fmt; }
+
+	// Only between records, as the values are kept
+	void format(const formatter_type* f)
+	{ _Fmt = f; }
+
+	size_t size() const
+	{ return _Count; }
+
+	// True if some of the values or text didn't fit in the record itself
+	bool on_heap() const
+	{ return _Count > format_record_values || !_MoreText.empty(); }
+
+	void clear()
+	{ _Count = 0; _TextUsed = 0; _More.clear(); _MoreText.clear(); }
+
+	basic_format_record& operator<<(bool _X)
+	{ add(_Bool).v.i = _X; return (*this); }
+	basic_format_record& operator<<(short _X)
+	{ add(_Short).v.i = _X; return (*this); }
+	basic_format_record& operator<<(unsigned short _X)
+	{ add(_UShort).v.u = _X; return (*this); }
+	basic_format_record& operator<<(int _X)
+	{ add(_Int).v.i = _X; return (*this); }
+	basic_format_record& operator<<(unsigned int _X)
+	{ add(_UInt).v.u = _X; return (*this); }
+	basic_format_record& operator<<(long _X)
+	{ add(_Long).v.i = _X; return (*this); }
+	basic_format_record& operator<<(unsigned long _X)
+	{ add(_ULong).v.u = _X; return (*this); }
+	basic_format_record& operator<<(long long _X)
+	{ add(_LLong).v.i = _X; return (*this); }
+	basic_format_record& operator<<(unsigned long long _X)
+	{ add(_ULLong).v.u = _X; return (*this); }
+#if defined(__SIZEOF_INT128__)
+	basic_format_record& operator<<(__int128 _X)
+	{ add(_Int128).v.i128 = _X; return (*this); }
+	basic_format_record& operator<<(unsigned __int128 _X)
+	{ add(_UInt128).v.u128 = _X; return (*this); }
+#endif
+	basic_format_record& operator<<(float _X)
+	{ add(_Float).v.d = _X; return (*this); }
+	basic_format_record& operator<<(double _X)
+	{ add(_Double).v.d = _X; return (*this); }
+	basic_format_record& operator<<(long double _X)
+	{ add(_LDouble).v.ld = _X; return (*this); }
+	basic_format_record& operator<<(const void* _X)
+	{ add(_Pointer).v.p = _X; return (*this); }
+	basic_format_record& operator<<(_E _X)
+	{ add(_Char).v.c = _X; return (*this); }
+	basic_format_record& operator<<(basic_format_literal<_E> _X)
+	{ add(_Literal).v.s = _X.text; return (*this); }
+
+	// Copied, with its terminator, into the record's text
+	basic_format_record& operator<<(const _E* _X)
+	{
+		size_t n = _Tr::length(_X) + 1;
+		size_t at;
+		if (_MoreText.empty() && n <= format_record_text - _TextUsed)
+		{
+			at = _TextUsed;
+			_Tr::copy(_Text + at, _X, n);
+			_TextUsed += n;
+		}
+		else
+		{
+			at = format_record_text + _MoreText.size();
+			_MoreText.append(_X, n);
+		}
+		add(_String).v.at = at;
+		return (*this);
+	}
+
+	// Insert each value into ofs
+	void insert(basic_oformatstream<_E,_Tr>& ofs) const
+	{
+		for (size_t n = 0; n < _Count; ++n)
+		{
+			const _Value& a = value(n);
+			switch (a.type)
+			{
+			case _Bool: ofs << (0 != a.v.i); break;
+			case _Short: ofs << static_cast<short>(a.v.i); break;
+			case _UShort: ofs << static_cast<unsigned short>(a.v.u); break;
+			case _Int: ofs << static_cast<int>(a.v.i); break;
+			case _UInt: ofs << static_cast<unsigned int>(a.v.u); break;
+			case _Long: ofs << static_cast<long>(a.v.i); break;
+			case _ULong: ofs << static_cast<unsigned long>(a.v.u); break;
+			case _LLong: ofs << a.v.i; break;
+			case _ULLong: ofs << a.v.u; break;
+#if defined(__SIZEOF_INT128__)
+			case _Int128: ofs << a.v.i128; break;
+			case _UInt128: ofs << a.v.u128; break;
+#endif
+			case _Float: ofs << static_cast<float>(a.v.d); break;
+			case _Double: ofs << a.v.d; break;
+			case _LDouble: ofs << a.v.ld; break;
+			case _Pointer: ofs << a.v.p; break;
+			case _Char: ofs << a.v.c; break;
+			case _Literal: ofs << a.v.s; break;
+			default: ofs << text(a.v.at); break;
+			}
+		}
+	}
+
+private:
+	enum
+	{
+		_Bool, _Short, _UShort, _Int, _UInt, _Long, _ULong, _LLong, _ULLong,
+		_Int128, _UInt128, _Float, _Double, _LDouble, _Pointer, _Char,
+		_Literal, _String
+	};
+
+	struct _Value
+	{
+		union
+		{
+			long long i;
+			unsigned long long u;
+#if defined(__SIZEOF_INT128__)
+			__int128 i128;
+			unsigned __int128 u128;
+#endif
+			double d;	// floats too, which convert exactly
+			long double ld;
+			const void* p;
+			const _E* s;
+			_E c;
+			size_t at;	// of a copied string in the text
+		} v;
+		unsigned char type;
+	};
+
+	_Value& add(unsigned char type)
+	{
+		_Value* a;
+		if (_Count < format_record_values)
+		{
+			a = &_Values[_Count];
+		}
+		else
+		{
+			_More.push_back(_Value());
+			a = &_More.back();
+		}
+		++_Count;
+		a->type = type;
+		return *a;
+	}
+
+	const _Value& value(size_t n) const
+	{ return n < format_record_values ? _Values[n] : _More[n - format_record_values]; }
+
+	const _E* text(size_t at) const
+	{ return at < format_record_text ? _Text + at : _MoreText.data() + (at - format_record_text); }
+
+	const formatter_type* _Fmt;
+	size_t _Count;
+	size_t _TextUsed;
+	_Value _Values[format_record_values];
+	std::vector<_Value> _More;
+	_E _Text[format_record_text];
+	std::basic_string<_E,_Tr> _MoreText;	// text that didn't fit, by offset past _Text
+};
+
+// The values of a record, in its format if it has one
+template<class _E, class _Tr> inline
+basic_oformatstream<_E, _Tr>& __cdecl operator<<(
+	basic_oformatstream<_E, _Tr>& _O, const basic_format_record<_E, _Tr>& _R)
+{
+	if (_R.format())
+	{
+		_O.record_format(_R.format());
+	}
+	_R.insert(_O);
+	return (_O);
+}
+
+// Narrow characters and strings are widened into a wide record,
+// as a woformatstream in the global locale widens them.
+template<class _Tr> inline
+basic_format_record<wchar_t, _Tr>& __cdecl operator<<(
+	basic_format_record<wchar_t, _Tr>& _R, const char *_X)
+{
+	std::basic_string<wchar_t, _Tr> wide(std::char_traits<char>::length(_X), L'\0');
+	std::use_facet<std::ctype<wchar_t> >(std::locale()).widen(_X, _X + wide.size(), &wide[0]);
+	return (_R << wide.c_str());
+}
+
+template<class _Tr> inline
+basic_format_record<wchar_t, _Tr>& __cdecl operator<<(
+	basic_format_record<wchar_t, _Tr>& _R, char _C)
+{
+	return (_R << std::use_facet<std::ctype<wchar_t> >(std::locale()).widen(_C));
+}
+
+template<class _E, class _Tr> inline
+basic_format_record<_E, _Tr>& __cdecl operator<<(
+	basic_format_record<_E, _Tr>& _R, const signed char *_X)
+{
+	return (_R << (const char *)_X);
+}
+
+template<class _E, class _Tr> inline
+basic_format_record<_E, _Tr>& __cdecl operator<<(
+	basic_format_record<_E, _Tr>& _R, const signed char _C)
+{
+	return (_R << (char)_C);
+}
+
+template<class _E, class _Tr> inline
+basic_format_record<_E, _Tr>& __cdecl operator<<(
+	basic_format_record<_E, _Tr>& _R, const unsigned char *_X)
+{
+	return (_R << (const char *)_X);
+}
+
+template<class _E, class _Tr> inline
+basic_format_record<_E, _Tr>& __cdecl operator<<(
+	basic_format_record<_E, _Tr>& _R, const unsigned char _C)
+{
+	return (_R << (char)_C);
+}
+
+typedef basic_format_record<char, std::char_traits<char> > format_record;
+typedef basic_format_record<wchar_t, std::char_traits<wchar_t> > wformat_record;
+
+//------------------------------------------------------
+// format_batch
+// Outputs each of [first, last), a tuple of the values of one record,
+// as a whole record of ofs.  The output is exactly that of put_record()
+// with each tuple's values, but is formatted on up to threads threads,
+// 0 meaning one per processor.
+// Blocks of format_batch_block records are formatted into buffers of
+// their own by copies of ofs, and written to its stream in order,
+// format_batch_blocks blocks a thread at a time, so the buffers held
+// stay small however many records there are.
+// ofs must be between records.  Returns ofs.
+//------------------------------------------------------
+const size_t format_batch_block = 1024;
+const size_t format_batch_blocks = 4;
+
+template <typename _E, typename _Tr, typename _Iter>
+basic_oformatstream<_E,_Tr>& format_batch(basic_oformatstream<_E,_Tr>& ofs,
+										  _Iter first, _Iter last,
+										  unsigned int threads = 0)
+{
+	static_assert(std::random_access_iterator<_Iter>,
+		"format_batch divides its records by index");
+	typedef std::basic_string<_E,_Tr> string_type;
+	typename basic_oformatstream<_E,_Tr>::_Myostream* os = ofs.get_ostream();
+	if (!os)
+	{
+		return ofs;
+	}
+	if (!threads)
+	{
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	basic_formatter<_E,_Tr> format(ofs.formatter());
+	const std::locale loc(os->getloc());
+	const bool classic(ofs.classic());
+	const size_t count = static_cast<size_t>(last - first);
+	const size_t window = format_batch_block * format_batch_blocks * threads;
+	std::vector<string_type> chunks;
+
+	for (size_t at = 0; at < count && os->good(); at += window)
+	{
+		size_t n = std::min(window, count - at);
+		chunks.resize((n + format_batch_block - 1) / format_batch_block);
+		format_parallel_blocks(n, format_batch_block, threads, [&](size_t k, size_t end)
+		{
+			size_t c = k / format_batch_block;
+			std::basic_ostringstream<_E,_Tr> buf;
+			buf.imbue(loc);
+			basic_oformatstream<_E,_Tr> w(format, &buf);
+			w.classic(classic);
+			for (_Iter it = first + (at + k); k < end; ++k, ++it)
+			{
+				std::apply([&w](const auto&... v) { w.put_record(v...); }, *it);
+			}
+			chunks[c] = std::move(buf).str();
+		});
+		for (size_t c = 0; c < chunks.size(); ++c)
+		{
+			os->write(chunks[c].data(), static_cast<std::streamsize>(chunks[c].size()));
+		}
+	}
+	return ofs;
+}
+
 #undef SIB
 #endif	// _format_
@@ -3,10 +3,28 @@
 
 #include "stdafx.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 void TestFormat();
+void BenchFormat();
+int VerifyFormat();
+void FuzzFormat(int iterations);
 
 int main(int argc, char* argv[])
 {
 	TestFormat();
+	if (argc > 1 && 0 == strcmp(argv[1], "bench"))
+	{
+		BenchFormat();
+	}
+	else if (argc > 1 && 0 == strcmp(argv[1], "verify"))
+	{
+		return VerifyFormat() ? 1 : 0;
+	}
+	else if (argc > 1 && 0 == strcmp(argv[1], "fuzz"))
+	{
+		FuzzFormat(argc > 2 ? atoi(argv[2]) : 100000);
+	}
 	return 0;
 }
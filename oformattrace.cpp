@@ -0,0 +1,87 @@
+#include "stdafx.h"
+
+#include <atomic>
+#include <chrono>
+#include "oformattrace.hpp"
+
+// Each slot carries the sequence number of the event in it, stored after
+// the event itself, so a reader can tell a complete event from one that
+// is being overwritten.  Slot i % capacity holds event i, numbered from 1.
+namespace {
+
+struct trace_slot
+{
+	std::atomic<unsigned long long> seq;
+	format_trace_entry entry;
+};
+
+trace_slot ring[format_trace_capacity];
+std::atomic<unsigned long long> ring_next(0);
+std::atomic<bool> ring_on(false);
+
+}	// namespace
+
+void format_trace_enable(bool on)
+{
+	ring_on.store(on, std::memory_order_relaxed);
+}
+
+bool format_trace_enabled()
+{
+	return ring_on.load(std::memory_order_relaxed);
+}
+
+void format_trace_record(format_trace_event event, const void* stream,
+						 unsigned long long value)
+{
+	unsigned long long i = ring_next.fetch_add(1, std::memory_order_relaxed);
+	trace_slot& slot = ring[i % format_trace_capacity];
+	slot.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.entry.time = static_cast<unsigned long long>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	slot.entry.stream = stream;
+	slot.entry.event = event;
+	slot.entry.value = value;
+	slot.seq.store(i + 1, std::memory_order_release);
+}
+
+size_t format_trace_snapshot(format_trace_entry* out, size_t max)
+{
+	unsigned long long last = ring_next.load(std::memory_order_acquire);
+	unsigned long long first = last > format_trace_capacity ? last - format_trace_capacity : 0;
+	size_t n = 0;
+	for (unsigned long long i = first; i < last && n < max; ++i)
+	{
+		trace_slot& slot = ring[i % format_trace_capacity];
+		if (slot.seq.load(std::memory_order_acquire) != i + 1)
+		{
+			continue;
+		}
+		format_trace_entry e = slot.entry;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.seq.load(std::memory_order_relaxed) == i + 1)
+		{
+			out[n++] = e;
+		}
+	}
+	return n;
+}
+
+void format_trace_clear()
+{
+	for (size_t k = 0; k < format_trace_capacity; ++k)
+	{
+		ring[k].seq.store(0, std::memory_order_relaxed);
+	}
+	ring_next.store(0, std::memory_order_release);
+}
+
+const char* format_trace_name(format_trace_event event)
+{
+	static const char* const names[] = {
+		"record_begin", "record_end", "flush", "buffer_full"
+	};
+	return names[event];
+}
@@ -0,0 +1,89 @@
+//
+// oformattrace.hpp
+//
+//
+// Comments: tracing of basic_oformatstream activity
+//
+// Define OFORMAT_TRACE to have basic_oformatstream report when each record
+// starts and ends and when it is flushed, and the sinks of oformatsink.hpp
+// report when output fills a buffer and must be passed on, or waited for,
+// before more can be taken.  Without it the trace points compile to nothing.
+//
+// Each trace point is a static probe, where <sys/sdt.h> is available,
+// so "perf list sdt_oformatstream:*" shows them once the binary is known
+// to perf (perf buildid-cache --add).  They cost a single nop until a
+// tool attaches to them.
+//
+// The same events can also be kept in an in-process ring, eg. to dump the
+// activity leading up to a stall.  It is off until format_trace_enable(),
+// and holds the last format_trace_capacity events from every thread.
+//
+//
+
+#ifndef _oformattrace_
+#define _oformattrace_
+
+#include <stddef.h>
+
+enum format_trace_event
+{
+	format_trace_record_begin,	// value is the first field
+	format_trace_record_end,	// value is the number of fields in the format
+	format_trace_flush,			// value is 0
+	format_trace_buffer_full	// value is the number of characters passed on
+};
+
+struct format_trace_entry
+{
+	unsigned long long time;	// steady_clock nanoseconds
+	const void* stream;			// the basic_oformatstream, or for buffer_full
+								// the basic_sinkbuf, fd_sink or async_fd_sink
+	format_trace_event event;
+	unsigned long long value;
+};
+
+// Number of events the ring holds
+const size_t format_trace_capacity = 4096;
+
+// Start or stop keeping events in the ring
+void format_trace_enable(bool on);
+bool format_trace_enabled();
+
+// Add an event to the ring.  Safe to call from any thread.
+void format_trace_record(format_trace_event event, const void* stream,
+						 unsigned long long value);
+
+// Copy up to max of the events in the ring to out, oldest first.
+// Events being written while the copy is made are skipped.
+// Returns the number copied.
+size_t format_trace_snapshot(format_trace_entry* out, size_t max);
+
+// Discard every event in the ring
+void format_trace_clear();
+
+// "record_begin", "record_end", "flush" or "buffer_full"
+const char* format_trace_name(format_trace_event event);
+
+#if defined(OFORMAT_TRACE)
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define OFORMAT_PROBE(name, stream, value) \
+	DTRACE_PROBE2(oformatstream, name, stream, value)
+#endif
+#endif
+#if !defined(OFORMAT_PROBE)
+#define OFORMAT_PROBE(name, stream, value)
+#endif
+#define OFORMAT_TRACE_EVENT(name, stream, value) \
+	do { \
+		OFORMAT_PROBE(name, stream, value); \
+		if (format_trace_enabled()) \
+			format_trace_record(format_trace_##name, stream, \
+								static_cast<unsigned long long>(value)); \
+	} while (0)
+#else
+#define OFORMAT_TRACE_EVENT(name, stream, value) ((void)0)
+#endif
+
+#endif	// _oformattrace_